@@ -0,0 +1,202 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file ambient_probe_grid.cpp
+ */
+
+#include "ambient_probe_grid.h"
+
+#include <algorithm>
+#include <cmath>
+
+// The number of closest samples that are blended for a grid point.
+static const int grid_point_samples = 4;
+
+// Limit on the grid points along an axis of a leaf, so huge leafs don't take
+// up too much memory.  The spacing is made wider instead.
+static const int max_grid_dim = 16;
+
+AmbientProbeGrid::AmbientProbeGrid()
+{
+}
+
+void AmbientProbeGrid::clear()
+{
+	_leafs.clear();
+}
+
+/**
+ * Resets the grid to the indicated number of leafs, all of them empty.
+ */
+void AmbientProbeGrid::set_num_leafs( int num_leafs )
+{
+	_leafs.clear();
+	_leafs.resize( num_leafs );
+}
+
+/**
+ * Bakes the grid of a leaf from the ambient samples in it.  The grid covers
+ * the bounds of the leaf with points about spacing units apart.
+ */
+void AmbientProbeGrid::build_leaf( int leaf, const LPoint3 &mins, const LPoint3 &maxs, float spacing,
+				   const pvector<sample_t> &samples )
+{
+	nassertv( leaf >= 0 && leaf < (int)_leafs.size() );
+	nassertv( spacing > 0.0f );
+
+	leafgrid_t &grid = _leafs[leaf];
+	grid.cubes.clear();
+
+	if ( samples.empty() )
+	{
+		return;
+	}
+
+	grid.origin = LCAST( float, mins );
+	for ( int i = 0; i < 3; i++ )
+	{
+		float size = std::max( (float)( maxs[i] - mins[i] ), 0.0f );
+		int dim = (int)std::ceil( size / spacing ) + 1;
+		grid.dims[i] = std::min( std::max( dim, 1 ), max_grid_dim );
+		grid.spacing[i] = grid.dims[i] > 1 ? size / ( grid.dims[i] - 1 ) : 0.0f;
+	}
+
+	int num_points = grid.dims[0] * grid.dims[1] * grid.dims[2];
+	grid.cubes.resize( num_points * 6 );
+
+	int closest[grid_point_samples];
+	float closest_dist_sq[grid_point_samples];
+
+	int point = 0;
+	for ( int z = 0; z < grid.dims[2]; z++ )
+	{
+		for ( int y = 0; y < grid.dims[1]; y++ )
+		{
+			for ( int x = 0; x < grid.dims[0]; x++, point++ )
+			{
+				LPoint3 pos( grid.origin[0] + x * grid.spacing[0],
+					     grid.origin[1] + y * grid.spacing[1],
+					     grid.origin[2] + z * grid.spacing[2] );
+
+				// Find the closest samples, closest first.
+				int count = 0;
+				for ( size_t i = 0; i < samples.size(); i++ )
+				{
+					float d = ( samples[i].pos - pos ).length_squared();
+					if ( count == grid_point_samples && d >= closest_dist_sq[count - 1] )
+					{
+						continue;
+					}
+
+					int j = count < grid_point_samples ? count++ : count - 1;
+					for ( ; j > 0 && closest_dist_sq[j - 1] > d; j-- )
+					{
+						closest_dist_sq[j] = closest_dist_sq[j - 1];
+						closest[j] = closest[j - 1];
+					}
+					closest_dist_sq[j] = d;
+					closest[j] = (int)i;
+				}
+
+				// Weight them by inverse squared distance.  A sample right
+				// on the grid point gets (nearly) all of the weight.
+				LVector3 cube[6];
+				for ( int j = 0; j < 6; j++ )
+				{
+					cube[j] = LVector3::zero();
+				}
+				float total_weight = 0.0f;
+				for ( int i = 0; i < count; i++ )
+				{
+					float weight = 1.0f / ( closest_dist_sq[i] + 0.001f );
+					const sample_t &sample = samples[closest[i]];
+					for ( int j = 0; j < 6; j++ )
+					{
+						cube[j] += sample.cube[j] * weight;
+					}
+					total_weight += weight;
+				}
+
+				LVecBase3f *dest = &grid.cubes[point * 6];
+				for ( int j = 0; j < 6; j++ )
+				{
+					dest[j] = LCAST( float, cube[j] / total_weight );
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Fills in the six colors of the ambient cube at the indicated position in
+ * the leaf, interpolated from the grid points around it.  Returns false if
+ * the leaf has no grid.
+ */
+bool AmbientProbeGrid::sample( int leaf, const LPoint3 &pos, LVector3 *cube ) const
+{
+	if ( !has_leaf( leaf ) )
+	{
+		return false;
+	}
+
+	const leafgrid_t &grid = _leafs[leaf];
+
+	// Find the cell the position is in, and where in the cell it is.
+	int base[3];
+	float frac[3];
+	int step[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		base[i] = 0;
+		frac[i] = 0.0f;
+		step[i] = 0;
+		if ( grid.dims[i] > 1 )
+		{
+			float local = ( (float)pos[i] - grid.origin[i] ) / grid.spacing[i];
+			local = std::min( std::max( local, 0.0f ), (float)( grid.dims[i] - 1 ) );
+			base[i] = std::min( (int)local, grid.dims[i] - 2 );
+			frac[i] = local - base[i];
+			step[i] = 1;
+		}
+	}
+
+	int stride_y = grid.dims[0];
+	int stride_z = grid.dims[0] * grid.dims[1];
+	int corner = base[0] + base[1] * stride_y + base[2] * stride_z;
+
+	for ( int j = 0; j < 6; j++ )
+	{
+		cube[j] = LVector3::zero();
+	}
+
+	for ( int c = 0; c < 8; c++ )
+	{
+		int dx = c & 1;
+		int dy = ( c >> 1 ) & 1;
+		int dz = ( c >> 2 ) & 1;
+		if ( ( dx && !step[0] ) || ( dy && !step[1] ) || ( dz && !step[2] ) )
+		{
+			// Flat along this axis, there's no point on the other side.
+			continue;
+		}
+
+		float weight = ( dx ? frac[0] : 1.0f - frac[0] ) *
+			( dy ? frac[1] : 1.0f - frac[1] ) *
+			( dz ? frac[2] : 1.0f - frac[2] );
+		if ( weight == 0.0f )
+		{
+			continue;
+		}
+
+		const LVecBase3f *src = &grid.cubes[( corner + dx + dy * stride_y + dz * stride_z ) * 6];
+		for ( int j = 0; j < 6; j++ )
+		{
+			cube[j] += LCAST( PN_stdfloat, src[j] ) * weight;
+		}
+	}
+
+	return true;
+}
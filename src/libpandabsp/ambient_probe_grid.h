@@ -0,0 +1,68 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file ambient_probe_grid.h
+ */
+
+#ifndef AMBIENT_PROBE_GRID_H
+#define AMBIENT_PROBE_GRID_H
+
+#include "config_bsp.h"
+
+#include <referenceCount.h>
+#include <pvector.h>
+#include <luse.h>
+
+/**
+ * The ambient cubes of the level baked into a regular grid for each leaf.
+ * The value of each grid point is blended from the closest ambient samples in
+ * the leaf, so looking up the ambient cube at a position is a trilinear
+ * interpolation of the eight grid points around it, with no searching.
+ *
+ * Leafs without ambient samples have an empty grid.
+ */
+class EXPCL_PANDABSP AmbientProbeGrid : public ReferenceCount
+{
+public:
+	struct sample_t
+	{
+		LPoint3 pos;
+		LVector3 cube[6];
+	};
+
+	AmbientProbeGrid();
+
+	void clear();
+	void set_num_leafs( int num_leafs );
+	void build_leaf( int leaf, const LPoint3 &mins, const LPoint3 &maxs, float spacing,
+			 const pvector<sample_t> &samples );
+
+	INLINE int get_num_leafs() const
+	{
+		return (int)_leafs.size();
+	}
+
+	INLINE bool has_leaf( int leaf ) const
+	{
+		return leaf >= 0 && leaf < (int)_leafs.size() && !_leafs[leaf].cubes.empty();
+	}
+
+	bool sample( int leaf, const LPoint3 &pos, LVector3 *cube ) const;
+
+private:
+	struct leafgrid_t
+	{
+		LPoint3f origin;
+		LVector3f spacing;
+		int dims[3];
+		// Six colors for each grid point, x varying fastest.
+		pvector<LVecBase3f> cubes;
+	};
+
+	pvector<leafgrid_t> _leafs;
+};
+
+#endif // AMBIENT_PROBE_GRID_H
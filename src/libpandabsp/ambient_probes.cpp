@@ -29,10 +29,16 @@
 #include <colorBlendAttrib.h>
 #include <materialAttrib.h>
 #include <clipPlaneAttrib.h>
+#include <textureAttrib.h>
 #include <virtualFileSystem.h>
 #include <modelNode.h>
 #include <pstatTimer.h>
 #include <lineSegs.h>
+#include <lightMutexHolder.h>
+#include <mutexHolder.h>
+#include <thread.h>
+#include <asyncTaskManager.h>
+#include <configVariableInt.h>
 
 #include <bitset>
 
@@ -41,6 +47,27 @@
 
 IMPLEMENT_CLASS( CNodeShaderInput );
 
+static LightMutex blank_cubemap_mutex( "blank_cubemap_mutex" );
+static PT( Texture ) blank_cubemap = nullptr;
+
+/**
+ * Returns the black cubemap that nodes show until they find a cubemap of
+ * their own.  It is shared by all of them.
+ */
+Texture *CNodeShaderInput::get_blank_cubemap()
+{
+        LightMutexHolder holder( blank_cubemap_mutex );
+
+        if ( !blank_cubemap )
+        {
+                blank_cubemap = new Texture( "cubemap_image" );
+                blank_cubemap->setup_cube_map( 32, Texture::T_unsigned_byte, Texture::F_rgb8 );
+                blank_cubemap->clear_image();
+        }
+
+        return blank_cubemap;
+}
+
 static PStatCollector updatenode_collector              ( "AmbientProbes:UpdateNodes" );
 static PStatCollector finddata_collector                ( "AmbientProbes:UpdateNodes:FindNodeData" );
 static PStatCollector update_ac_collector               ( "AmbientProbes:UpdateNodes:UpdateAmbientCube" );
@@ -53,11 +80,22 @@ static PStatCollector ambientboost_collector( "AmbientProbes:UpdateNodes:BoostAm
 static PStatCollector xformlight_collector( "AmbientProbes:XformLight" );
 static PStatCollector loadcubemap_collector( "AmbientProbes:UpdateNodes:LoadCubemap" );
 static PStatCollector findcubemap_collector( "AmbientProbes:UpdateNodes:FindCubemap" );
+static PStatCollector updatelighting_collector( "AmbientProbes:UpdateLighting" );
 
 static ConfigVariableBool cfg_lightaverage
 ( "light-average", true, "Activates/deactivate light averaging" );
 static ConfigVariableDouble cfg_lightinterp
 ( "light-lerp-speed", 5.0, "Controls the speed of light interpolation, 0 turns off interpolation" );
+static ConfigVariableBool cfg_lightbatch
+( "light-batch", true, "Computes the lighting of moving models once per frame in a batch, instead of during the cull traversal" );
+static ConfigVariableInt cfg_lightthreads
+( "light-batch-threads", 2, "Number of threads the batched lighting is spread across, 0 computes it on the main thread" );
+static ConfigVariableInt cfg_lightbatchmax
+( "light-batch-max-jobs", 4096, "Most moving models that can wait for the batched lighting, the lighting of any more is computed during the cull traversal" );
+static ConfigVariableBool cfg_probegrid
+( "ambient-probe-grid", true, "Interpolates the ambient cube of models from a grid baked from the ambient probes, instead of using the closest probe" );
+static ConfigVariableDouble cfg_probegridspacing
+( "ambient-probe-grid-spacing", 4.0, "Distance between the points of the ambient probe grid" );
 
 static ConfigVariableBool r_ambientboost
 ( "r_ambientboost", true, "Boosts ambient term if it is totally swamped by local lights." );
@@ -80,9 +118,15 @@ static light_t *dummy_light = new light_t;
 AmbientProbeManager::AmbientProbeManager() :
         _loader( nullptr ),
         _sunlight( nullptr ),
-        //_light_kdtree( nullptr ),
-        //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _envmap_kdtree( nullptr ),
+        _probe_grid( new AmbientProbeGrid ),
+        _data_ready( 0 ),
+        _active_updates( 0 ),
+        _updates_drained( _updates_lock ),
+        _next_running_job( 0 ),
+        _lighting_chain( nullptr ),
+        _lighting_frame( -1 ),
+        _flush_task( nullptr )
 {
         dummy_light->id = -1;
         dummy_light->leaf = 0;
@@ -92,12 +136,77 @@ AmbientProbeManager::AmbientProbeManager() :
 AmbientProbeManager::AmbientProbeManager( BSPLoader *loader ) :
         _loader( loader ),
         _sunlight( nullptr ),
-        //_light_kdtree( nullptr ),
-        //_probe_kdtree( nullptr ),
-        _envmap_kdtree( nullptr )
+        _envmap_kdtree( nullptr ),
+        _probe_grid( new AmbientProbeGrid ),
+        _data_ready( 0 ),
+        _active_updates( 0 ),
+        _updates_drained( _updates_lock ),
+        _next_running_job( 0 ),
+        _lighting_chain( nullptr ),
+        _lighting_frame( -1 ),
+        _flush_task( nullptr )
 {
 }
 
+AmbientProbeManager::~AmbientProbeManager()
+{
+        stop_flush_task();
+}
+
+/**
+ * Keeps update_node() out of the shared probe, light and cubemap data, and
+ * waits for the updates that are already running to finish.
+ */
+void AmbientProbeManager::begin_modify_data()
+{
+        AtomicAdjust::set( _data_ready, 0 );
+
+        MutexHolder holder( _updates_lock );
+        while ( AtomicAdjust::get( _active_updates ) != 0 )
+        {
+                _updates_drained.wait();
+        }
+}
+
+/**
+ * Lets update_node() read the shared data again.
+ */
+void AmbientProbeManager::end_modify_data()
+{
+        AtomicAdjust::set( _data_ready, 1 );
+}
+
+/**
+ * Counts an update_node() call as reading the shared data for its lifetime.
+ * The last one to finish wakes up begin_modify_data().
+ */
+class ActiveUpdate
+{
+public:
+        INLINE ActiveUpdate( AtomicAdjust::Integer &count, Mutex &lock, ConditionVarFull &drained ) :
+                _count( count ),
+                _lock( lock ),
+                _drained( drained )
+        {
+                AtomicAdjust::inc( _count );
+        }
+        INLINE ~ActiveUpdate()
+        {
+                if ( !AtomicAdjust::dec( _count ) )
+                {
+                        // Notified under the lock, so a waiter that saw the
+                        // count before it dropped is already waiting.
+                        MutexHolder holder( _lock );
+                        _drained.notify_all();
+                }
+        }
+
+private:
+        AtomicAdjust::Integer &_count;
+        Mutex &_lock;
+        ConditionVarFull &_drained;
+};
+
 INLINE int lighttype_from_classname( const char *classname )
 {
         if ( !strncmp( classname, "light_environment", 18 ) )
@@ -118,6 +227,7 @@ INLINE int lighttype_from_classname( const char *classname )
 
 void AmbientProbeManager::process_ambient_probes()
 {
+        begin_modify_data();
 
 #ifdef VISUALIZE_AMBPROBES
         if ( !_vis_root.is_empty() )
@@ -131,9 +241,6 @@ void AmbientProbeManager::process_ambient_probes()
         _light_pvs.resize( _loader->_bspdata->dmodels[0].visleafs + 1 );
         _all_lights.clear();
 
-        //_light_kdtree = new KDTree( 3 );
-        //vector<vector<double>> light_points;
-
         // Build light data structures
         for ( int entnum = 0; entnum < _loader->_bspdata->numentities; entnum++ )
         {
@@ -225,19 +332,9 @@ void AmbientProbeManager::process_ambient_probes()
                                 // don't put the sun in the k-d tree
                                 _sunlight = light;
                         }
-                        //else
-                        //{
-                        //        // add the light into our k-d tree
-                        //        light_points.push_back( { light->pos[0], light->pos[1], light->pos[2] } );
-                        //}
                 }
         }
 
-        //if ( light_points.size() )
-        //{
-        //        _light_kdtree->build( light_points );
-        //}
-
         // Build light PVS
         for ( size_t lightnum = 0; lightnum < _all_lights.size(); lightnum++ )
         {
@@ -252,14 +349,38 @@ void AmbientProbeManager::process_ambient_probes()
                 }
         }
 
+        // Lay the light positions out for sorting by distance, four at a time.
+        _light_pvs_pos.clear();
+        _light_pvs_pos.resize( _light_pvs.size() );
+        for ( size_t leafnum = 0; leafnum < _light_pvs.size(); leafnum++ )
+        {
+                const pvector<light_t *> &lights = _light_pvs[leafnum];
+                pvector<FourVectors> &positions = _light_pvs_pos[leafnum];
+                positions.resize( ( lights.size() + 3 ) / 4 );
+                for ( size_t i = 0; i < positions.size(); i++ )
+                {
+                        positions[i].DuplicateVector( LVector3::zero() );
+                }
+                for ( size_t i = 0; i < lights.size(); i++ )
+                {
+                        FourVectors &pos4 = positions[i >> 2];
+                        SubFloat( pos4.x, i & 3 ) = lights[i]->pos[0];
+                        SubFloat( pos4.y, i & 3 ) = lights[i]->pos[1];
+                        SubFloat( pos4.z, i & 3 ) = lights[i]->pos[2];
+                }
+        }
+
+        _probe_grid->set_num_leafs( (int)_loader->_bspdata->leafambientindex.size() );
+        pvector<AmbientProbeGrid::sample_t> grid_samples;
+
         for ( size_t i = 0; i < _loader->_bspdata->leafambientindex.size(); i++ )
         {
                 dleafambientindex_t *ambidx = &_loader->_bspdata->leafambientindex[i];
                 dleaf_t *leaf = _loader->_bspdata->dleafs + i;
                 _probes[i] = pvector<PT( ambientprobe_t )>();
 
-                _probe_kdtrees[i] = new KDTree( 3 );
-                vector<vector<double>> probe_points;
+                _probe_kdtrees[i] = new FlatKDTree;
+                pvector<LPoint3> probe_points;
 
                 for ( int j = 0; j < ambidx->num_ambient_samples; j++ )
                 {
@@ -305,24 +426,40 @@ void AmbientProbeManager::process_ambient_probes()
                         _probes[i].push_back( probe );
 
                         // insert probe into the k-d tree so we can find them quickly
-                        probe_points.push_back( { probe->pos[0], probe->pos[1], probe->pos[2] } );
+                        probe_points.push_back( probe->pos );
                         _all_probes.push_back( probe );
                 }
 
-                if ( probe_points.size() )
+                _probe_kdtrees[i]->build( probe_points );
+
+                grid_samples.resize( _probes[i].size() );
+                for ( size_t j = 0; j < _probes[i].size(); j++ )
                 {
-                        _probe_kdtrees[i]->build( probe_points );
+                        const ambientprobe_t *probe = _probes[i][j];
+                        grid_samples[j].pos = probe->pos;
+                        for ( int k = 0; k < 6; k++ )
+                        {
+                                grid_samples[j].cube[k] = probe->cube[k];
+                        }
                 }
+                _probe_grid->build_leaf( (int)i,
+                                         LPoint3( leaf->mins[0], leaf->mins[1], leaf->mins[2] ) / 16.0,
+                                         LPoint3( leaf->maxs[0], leaf->maxs[1], leaf->maxs[2] ) / 16.0,
+                                         cfg_probegridspacing.get_value(), grid_samples );
         }
 
-        
+        end_modify_data();
+
+        start_flush_task();
 }
 
 void AmbientProbeManager::load_cubemaps()
 {
+        begin_modify_data();
+
         std::cout << _loader->_bspdata->cubemaps.size() << " cubemaps " << std::endl;
-        _envmap_kdtree = new KDTree( 3 );
-        vector<vector<double>> envmap_points;
+        _envmap_kdtree = new FlatKDTree;
+        pvector<LPoint3> envmap_points;
         for ( size_t i = 0; i < _loader->_bspdata->cubemaps.size(); i++ )
         {
                 dcubemap_t *dcm = &_loader->_bspdata->cubemaps[i];
@@ -346,7 +483,7 @@ void AmbientProbeManager::load_cubemaps()
                 cm->has_full_cubemap = true;
 
                 // insert into k-d tree
-                envmap_points.push_back( { cm->pos[0], cm->pos[1], cm->pos[2] } );
+                envmap_points.push_back( cm->pos );
 
 		// Cubemap is in linear space.
                 cm->cubemap_tex = new Texture( "cubemap_tex" );
@@ -355,6 +492,12 @@ void AmbientProbeManager::load_cubemaps()
                 cm->cubemap_tex->set_wrap_v( SamplerState::WM_clamp );
                 cm->cubemap_tex->set_keep_ram_image( true );
 
+                // Decode each side straight into the RAM image of the cube map.
+                size_t side_texels = (size_t)dcm->size * dcm->size * 3;
+                PTA_uchar image = PTA_uchar::empty_array( side_texels * 6 * sizeof( unsigned short ) );
+                unsigned short *texels = (unsigned short *)image.p();
+                pvector<unsigned short> side( side_texels );
+
                 for ( int j = 0; j < 6; j++ ) // for each side in the cubemap_tex
                 {
                         if ( dcm->imgofs[j] == -1 )
@@ -364,63 +507,34 @@ void AmbientProbeManager::load_cubemaps()
                                 continue;
                         }
 
-                        int xel = 0;
-
-                        PNMImage img( dcm->size, dcm->size );
-			img.set_color_space( ColorSpace::CS_linear );
-			img.set_maxval( USHRT_MAX );
-                        img.fill( 0 );
-
-                        for ( int y = 0; y < dcm->size; y++ )
-                        {
-                                for ( int x = 0; x < dcm->size; x++ )
-                                {
-                                        colorrgbexp32_t *col = &_loader->_bspdata->cubemapdata[dcm->imgofs[j] + xel];
-                                        LVector3 vcol;
-                                        ColorRGBExp32ToVector( *col, vcol );
-                                        img.set_xel( x, y, vcol );
-                                        xel++;
-                                }
-                        }
-
-                        cm->cubemap_tex->load( img, j, 0 );
-                        cm->cubemap_images[j] = img;
+                        ColorRGBExp32ToTexels16( &_loader->_bspdata->cubemapdata[dcm->imgofs[j]],
+                                                 dcm->size * dcm->size, 1.0f, side.data() );
+                        BlitTexels16( side.data(), dcm->size, dcm->size, texels + j * side_texels,
+                                      dcm->size, dcm->size, 0, 0, false );
                 }
 
+                cm->cubemap_tex->set_ram_image( image );
+
 		cm->cubemap_tex->write( std::cout, 0 );
 
                 _cubemaps.push_back( cm );
         }
 
-        if ( envmap_points.size() )
-        {
-                _envmap_kdtree->build( envmap_points );
-        }      
+        _envmap_kdtree->build( envmap_points );
+
+        end_modify_data();
 }
 
-INLINE bool AmbientProbeManager::is_sky_visible( const LPoint3 &point )
+INLINE Ray AmbientProbeManager::make_sky_ray( const LPoint3 &point ) const
 {
-        if ( _sunlight == nullptr )
-        {
-                return false;
-        }
-
         LPoint3 start( ( point + LPoint3( 0, 0, 0.05 ) ) * 16 );
         LPoint3 end = start + ( _sunlight->direction.get_xyz() * 10000 );
-        Ray ray( start, end, LPoint3::zero(), LPoint3::zero() );
-        Trace trace;
-        CM_BoxTrace( ray, 0, CONTENTS_SKY | CONTENTS_SOLID, false, _loader->_colldata, trace );
-
-        return trace.has_hit() && trace.hit_contents == CONTENTS_SKY;
+        return Ray( start, end, LPoint3::zero(), LPoint3::zero() );
 }
 
-INLINE bool AmbientProbeManager::is_light_visible( const LPoint3 &point, const light_t *light )
+INLINE Ray AmbientProbeManager::make_light_ray( const LPoint3 &point, const light_t *light ) const
 {
-        Ray ray( ( point + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, LPoint3::zero(), LPoint3::zero() );
-        Trace trace;
-        CM_BoxTrace( ray, 0, CONTENTS_SOLID, false, _loader->_colldata, trace );
-
-        return !trace.has_hit();
+        return Ray( ( point + LPoint3( 0, 0, 0.05 ) ) * 16, light->pos * 16, LPoint3::zero(), LPoint3::zero() );
 }
 
 INLINE LMatrix4 pack_lightdata( const light_t *light )
@@ -443,19 +557,388 @@ INLINE void apply_lightdatas( int n, const light_t *light, CNodeShaderInput *inp
                 input->active_lights++;
 }
 
+/**
+ * Fills in the indicated lights of the leaf, sorted from closest to furthest
+ * from the position.
+ */
+void AmbientProbeManager::sort_lights( int leaf, const LPoint3 &pos, pvector<light_t *> &lights ) const
+{
+        const pvector<light_t *> &leaf_lights = _light_pvs[leaf];
+        const pvector<FourVectors> &positions = _light_pvs_pos[leaf];
+        size_t numlights = leaf_lights.size();
+
+        FourVectors pos4;
+        pos4.DuplicateVector( LVector3( pos ) );
+
+        pvector<std::pair<float, int>> order( numlights );
+        for ( size_t i = 0; i < positions.size(); i++ )
+        {
+                FourVectors delta = positions[i];
+                delta -= pos4;
+                fltx4 dist_sq = delta * delta;
+                for ( size_t j = 0; j < 4 && i * 4 + j < numlights; j++ )
+                {
+                        order[i * 4 + j] = std::make_pair( SubFloat( dist_sq, j ), (int)( i * 4 + j ) );
+                }
+        }
+        std::sort( order.begin(), order.end() );
+
+        lights.resize( numlights );
+        for ( size_t i = 0; i < numlights; i++ )
+        {
+                lights[i] = leaf_lights[order[i].second];
+        }
+}
+
+/**
+ * Computes the lighting of the job's node that depends on its position: the
+ * closest ambient probe and cubemap, and which local lights it can see.
+ * Only reads the shared probe and light data, so jobs can be computed in
+ * parallel.
+ */
+void AmbientProbeManager::compute_lighting( lightingjob_t &job )
+{
+        job.amb_probe = nullptr;
+        job.has_probe_cube = false;
+        job.cubemap = nullptr;
+
+        // Update ambient cube
+        int probes_itr = _probes.find( job.leaf );
+        if ( cfg_probegrid.get_value() && _probe_grid->has_leaf( job.leaf ) )
+        {
+                update_ac_collector.start();
+                job.has_probe_cube = _probe_grid->sample( job.leaf, job.pos, job.probe_cube );
+                update_ac_collector.stop();
+        }
+        else if ( probes_itr != -1 && _probes.get_data( probes_itr ).size() > 0 )
+        {
+                const pvector<PT( ambientprobe_t )> &leaf_probes = _probes.get_data( probes_itr );
+
+                update_ac_collector.start();
+                job.amb_probe = find_closest_in_kdtree( get_probe_kdtree( job.leaf ), job.pos, leaf_probes );
+                update_ac_collector.stop();
+
+                if ( job.amb_probe != nullptr )
+                {
+                        for ( int i = 0; i < 6; i++ )
+                        {
+                                job.probe_cube[i] = job.amb_probe->cube[i];
+                        }
+                        job.has_probe_cube = true;
+                }
+
+#ifdef VISUALIZE_AMBPROBES
+                ambientprobe_t *sample = job.amb_probe;
+                std::cout << "Box colors:" << std::endl;
+                for ( int i = 0; i < 6; i++ )
+                {
+                        std::cout << "\t" << sample->cube[i] << std::endl;
+                }
+                for ( size_t j = 0; j < leaf_probes.size(); j++ )
+                {
+                        leaf_probes[j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
+                }
+                if ( !sample->visnode.is_empty() )
+                {
+                        sample->visnode.set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+                }
+#endif
+        }
+
+        // Update envmap
+        if ( _cubemaps.size() > 0 )
+        {
+                findcubemap_collector.start();
+                job.cubemap = find_closest_in_kdtree( _envmap_kdtree, job.pos, _cubemaps );
+                findcubemap_collector.stop();
+        }
+
+        update_locallights_collector.start();
+
+        job.occluded_lights.reset();
+
+        // Sort local lights from closest to furthest distance from node, we will choose the two closest lights.
+        sort_lights( job.leaf, job.pos, job.locallights );
+
+        job.sky_idx = -1;
+
+        // Trace to the sun and the lights four rays at a time, closest lights
+        // first, until we have found as many visible lights as can be active.
+        // The sun goes in the first packet.
+        Ray rays[4];
+        int masks[4];
+        int light_lanes[4];
+
+        bool trace_sky = _sunlight != nullptr;
+        int visible_lights = 0;
+        size_t next_light = 0;
+        while ( trace_sky || ( next_light < job.locallights.size() && visible_lights < MAX_ACTIVE_LIGHTS ) )
+        {
+                int num_rays = 0;
+                int sky_lane = -1;
+                if ( trace_sky )
+                {
+                        rays[num_rays] = make_sky_ray( job.pos );
+                        masks[num_rays] = CONTENTS_SKY | CONTENTS_SOLID;
+                        sky_lane = num_rays++;
+                        trace_sky = false;
+                }
+                int first_light = num_rays;
+                for ( ; num_rays < 4 && next_light < job.locallights.size(); num_rays++ )
+                {
+                        light_lanes[num_rays] = (int)next_light;
+                        rays[num_rays] = make_light_ray( job.pos, job.locallights[next_light++] );
+                        masks[num_rays] = CONTENTS_SOLID;
+                }
+
+                Trace traces[4];
+                CM_BoxTrace4( rays, num_rays, 0, masks, _loader->_colldata, traces );
+
+                if ( sky_lane != -1 && traces[sky_lane].has_hit() &&
+                     traces[sky_lane].hit_contents == CONTENTS_SKY )
+                {
+                        // If we hit the sky from current position, sunlight takes
+                        // precedence over all other local light sources.
+                        job.sky_idx = 0;
+                        visible_lights++;
+                }
+
+                for ( int i = first_light; i < num_rays && visible_lights < MAX_ACTIVE_LIGHTS; i++ )
+                {
+                        if ( traces[i].has_hit() )
+                        {
+                                job.occluded_lights.set( light_lanes[i] );
+                                continue;
+                        }
+                        visible_lights++;
+                }
+        }
+
+        if ( job.sky_idx == 0 )
+        {
+                job.locallights.insert( job.locallights.begin(), _sunlight );
+                job.occluded_lights <<= 1;
+        }
+
+        update_locallights_collector.stop();
+}
+
+/**
+ * Hands the results of a lighting job to its node.  The caller must be
+ * holding the node's lock.
+ */
+void AmbientProbeManager::apply_lighting( const lightingjob_t &job )
+{
+        CNodeShaderInput *input = job.input;
+
+        if ( job.has_probe_cube )
+        {
+                input->amb_probe = job.amb_probe;
+                memcpy( input->probe_cube, job.probe_cube, sizeof( LVector3 ) * 6 );
+                input->has_probe_cube = true;
+        }
+
+        cubemap_t *cm = job.cubemap;
+        if ( cm && cm->has_full_cubemap && cm != input->cubemap )
+        {
+                loadcubemap_collector.start();
+                input->cubemap = cm;
+                // Bind the level's cubemap texture itself.  The cubemap also
+                // goes on a texture stage, so the node ends up in a different
+                // state and gets its shader inputs made again with the new
+                // envmap.
+                input->cubemap_tex = cm->cubemap_tex;
+                CPT( RenderAttrib ) texattr = DCAST( TextureAttrib, TextureAttrib::make() )->add_on_stage(
+                        TextureStages::get_cubemap(), cm->cubemap_tex );
+                input->state_with_input = RenderState::make( AuxDataAttrib::make( input ), texattr );
+                input->cubemap_changed = true;
+                loadcubemap_collector.stop();
+        }
+
+        input->locallights = job.locallights;
+        input->sky_idx = job.sky_idx;
+        input->occluded_lights = job.occluded_lights;
+        input->lighting_changed = true;
+}
+
+/**
+ * Computes the running lighting jobs that no other thread has taken yet.
+ */
+void AmbientProbeManager::run_lighting_jobs()
+{
+        // Jobs are taken a few at a time, and are sorted by leaf, so a thread
+        // tends to work on nodes that share the same probes and lights.
+        static const AtomicAdjust::Integer chunk = 8;
+        AtomicAdjust::Integer num_jobs = (AtomicAdjust::Integer)_running_jobs.size();
+
+        AtomicAdjust::Integer first = AtomicAdjust::get( _next_running_job );
+        while ( first < num_jobs )
+        {
+                AtomicAdjust::Integer orig = AtomicAdjust::compare_and_exchange( _next_running_job, first, first + chunk );
+                if ( orig != first )
+                {
+                        first = orig;
+                        continue;
+                }
+
+                AtomicAdjust::Integer last = std::min( first + chunk, num_jobs );
+                for ( AtomicAdjust::Integer i = first; i < last; i++ )
+                {
+                        compute_lighting( _running_jobs[i] );
+                }
+
+                first = AtomicAdjust::get( _next_running_job );
+        }
+}
+
+AsyncTask::DoneStatus AmbientProbeManager::lighting_task( GenericAsyncTask *task, void *data )
+{
+        ( (AmbientProbeManager *)data )->run_lighting_jobs();
+        return AsyncTask::DS_done;
+}
+
+AsyncTask::DoneStatus AmbientProbeManager::flush_task( GenericAsyncTask *task, void *data )
+{
+        ( (AmbientProbeManager *)data )->update_lighting();
+        return AsyncTask::DS_cont;
+}
+
+/**
+ * Starts calling update_lighting() every frame, so the nodes queued by the
+ * last cull traversal are flushed whether or not a main camera is rendering.
+ * It runs just before igLoop, which has a sort of 50.
+ */
+void AmbientProbeManager::start_flush_task()
+{
+        if ( _flush_task != nullptr )
+        {
+                return;
+        }
+
+        _flush_task = new GenericAsyncTask( "ambientLightingFlush", flush_task, this );
+        _flush_task->set_sort( 40 );
+        AsyncTaskManager::get_global_ptr()->add( _flush_task );
+}
+
+void AmbientProbeManager::stop_flush_task()
+{
+        if ( _flush_task == nullptr )
+        {
+                return;
+        }
+
+        _flush_task->remove();
+        _flush_task = nullptr;
+}
+
+/**
+ * Computes the lighting of every node that moved since the last call, spread
+ * across the lighting threads, and hands the results to the nodes.  Called
+ * once per frame by the flush task; further calls in the same frame do
+ * nothing.
+ */
+void AmbientProbeManager::update_lighting()
+{
+        LightMutexHolder holder( _lighting_lock );
+
+        int frame = ClockObject::get_global_clock()->get_frame_count();
+        if ( frame == _lighting_frame )
+        {
+                return;
+        }
+        _lighting_frame = frame;
+
+        {
+                LightMutexHolder jobs_holder( _lighting_jobs_lock );
+                _running_jobs.swap( _lighting_jobs );
+        }
+
+        if ( _running_jobs.empty() )
+        {
+                return;
+        }
+
+        PStatTimer timer( updatelighting_collector );
+
+        ActiveUpdate active( _active_updates, _updates_lock, _updates_drained );
+        bool data_ready = AtomicAdjust::get( _data_ready ) != 0;
+        if ( data_ready )
+        {
+                std::sort( _running_jobs.begin(), _running_jobs.end(), []( const lightingjob_t &a, const lightingjob_t &b )
+                {
+                        return a.leaf < b.leaf;
+                } );
+
+                AtomicAdjust::set( _next_running_job, 0 );
+
+                int num_threads = std::min( cfg_lightthreads.get_value(), (int)_running_jobs.size() );
+                if ( num_threads > 1 && Thread::is_threading_supported() )
+                {
+                        AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+                        if ( _lighting_chain == nullptr )
+                        {
+                                _lighting_chain = mgr->make_task_chain( "ambientLighting" );
+                                _lighting_chain->set_num_threads( cfg_lightthreads.get_value() );
+                                _lighting_chain->set_frame_sync( false );
+                        }
+
+                        for ( int i = 0; i < num_threads; i++ )
+                        {
+                                PT( GenericAsyncTask ) task = new GenericAsyncTask( "ambientLighting", lighting_task, this );
+                                task->set_task_chain( "ambientLighting" );
+                                mgr->add( task );
+                        }
+                        _lighting_chain->wait_for_tasks();
+                }
+                else
+                {
+                        run_lighting_jobs();
+                }
+        }
+
+        for ( size_t i = 0; i < _running_jobs.size(); i++ )
+        {
+                const lightingjob_t &job = _running_jobs[i];
+                LightMutexHolder node_holder( get_node_lock( job.node ) );
+                job.input->lighting_queued = false;
+                if ( data_ready )
+                {
+                        apply_lighting( job );
+                }
+                else
+                {
+                        // The job was dropped, make the node queue itself
+                        // again on its next update even if it stays put.
+                        job.input->last_transform = nullptr;
+                }
+        }
+
+        _running_jobs.clear();
+}
+
 const RenderState *AmbientProbeManager::update_node( PandaNode *node,
 						     CPT( TransformState ) curr_trans,
 						     bool should_update )
 {
         PStatTimer timer( updatenode_collector );
 
-        MutexHolder holder( _cache_mutex );
-
         if ( !node || !curr_trans )
         {
                 return nullptr;
         }
 
+        // Only updates of the same node need to be serialized.
+        LightMutexHolder holder( get_node_lock( node ) );
+
+        ActiveUpdate active( _active_updates, _updates_lock, _updates_drained );
+        if ( AtomicAdjust::get( _data_ready ) == 0 )
+        {
+                // The level is being loaded or unloaded, keep whatever state
+                // the node already has.
+                CNodeShaderInput *input = DCAST( CNodeShaderInput, node->get_user_data() );
+                return input ? input->state_with_input.p() : nullptr;
+        }
+
 	// By default, the lighting position is the position of the node.
 	// An effect can be applied to offset the lighting position.
 	if ( node->has_effect( LightingOriginEffect::get_class_type() ) )
@@ -492,18 +975,16 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         input->cubemap_changed = false;
 
         // Is it even necessary to update anything?
+        // A node without a last transform had its lighting dropped, and
+        // counts as moved.
         CPT( TransformState ) prev_trans = input->last_transform;
         LVector3 pos_delta( 0 );
         if ( prev_trans != nullptr )
         {
                 pos_delta = curr_trans->get_pos() - prev_trans->get_pos();
         }
-        else
-        {
-                input->last_transform = curr_trans;
-        }
 
-        bool pos_changed = pos_delta.length_squared() >= EQUAL_EPSILON || new_instance;
+        bool pos_changed = pos_delta.length_squared() >= EQUAL_EPSILON || prev_trans == nullptr || new_instance;
 
         bool average_lighting = cfg_lightaverage.get_value();
 
@@ -526,106 +1007,61 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         // be in the incorrect leaf, giving incorrect ambient.
         curr_net[2] += ON_EPSILON;
 
-        int leaf_id = _loader->find_leaf( curr_net );
-
-        if ( pos_changed )
+        if ( pos_changed && !input->lighting_queued )
         {
-                // Update ambient cube
-                if ( _probes[leaf_id].size() > 0 )
-                {
-                        update_ac_collector.start();
-                        ambientprobe_t *sample = find_closest_in_kdtree( get_probe_kdtree( leaf_id ), curr_net, _probes[leaf_id] );
-                        input->amb_probe = sample;
-                        update_ac_collector.stop();
+                lightingjob_t job;
+                job.node = node;
+                job.input = input;
+                job.pos = curr_net;
+                job.leaf = _loader->find_leaf( curr_net );
 
-#ifdef VISUALIZE_AMBPROBES
-                        std::cout << "Box colors:" << std::endl;
-                        for ( int i = 0; i < 6; i++ )
-                        {
-                                std::cout << "\t" << sample->cube[i] << std::endl;
-                        }
-                        for ( size_t j = 0; j < _probes[leaf_id].size(); j++ )
-                        {
-                                _probes[leaf_id][j]->visnode.set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
-                        }
-                        if ( !sample->visnode.is_empty() )
+                if ( !new_instance && cfg_lightbatch.get_value() )
+                {
+                        // Computed by the next update_lighting(), if there's
+                        // room left in the batch.
+                        LightMutexHolder jobs_holder( _lighting_jobs_lock );
+                        if ( (int)_lighting_jobs.size() < cfg_lightbatchmax.get_value() )
                         {
-                                sample->visnode.set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+                                input->lighting_queued = true;
+                                _lighting_jobs.push_back( job );
                         }
-#endif
                 }
 
-                // Update envmap
-                if ( _cubemaps.size() > 0 )
+                if ( !input->lighting_queued )
                 {
-                        findcubemap_collector.start();
-                        cubemap_t *cm = find_closest_in_kdtree( _envmap_kdtree, curr_net, _cubemaps );
-                        findcubemap_collector.stop();
-                        if ( cm && cm->has_full_cubemap && cm != input->cubemap )
-                        {
-                                loadcubemap_collector.start();
-                                input->cubemap = cm;
-				// Cubemap is in linear space
-                                input->cubemap_tex->setup_cube_map( cm->size, Texture::T_unsigned_short, Texture::F_rgb );
-                                input->cubemap_tex->set_ram_image( cm->cubemap_tex->get_ram_image(),
-                                                                   cm->cubemap_tex->get_ram_image_compression(),
-                                                                   cm->cubemap_tex->get_ram_image_size() );
-                                input->cubemap_changed = true;
-                                loadcubemap_collector.stop();
-                        }
-                        
+                        // There's no lighting to show yet, or the batch is
+                        // full, compute it now.
+                        compute_lighting( job );
+                        apply_lighting( job );
                 }
 
                 // Cache the last position.
                 input->last_transform = curr_trans;
         }
 
+        bool lighting_changed = input->lighting_changed;
+        input->lighting_changed = false;
+
         bool ambientcube_changed = false;
 
         interp_ac_collector.start();
-        if ( input->amb_probe )
+        if ( input->has_probe_cube )
         {
                 // Interpolate ambient probe colors
                 LVector3 delta( 0 );
                 for ( int i = 0; i < 6; i++ )
                 {
-                        delta = input->amb_probe->cube[i] - input->boxcolor[i];
+                        delta = input->probe_cube[i] - input->boxcolor[i];
                         if ( average_lighting && delta.length_squared() >= EQUAL_EPSILON )
                         {
                                 delta *= atten_factor;
                                 ambientcube_changed = true;
                         }
-                        input->boxcolor[i] = input->amb_probe->cube[i] - delta;
+                        input->boxcolor[i] = input->probe_cube[i] - delta;
                 }
         }
         interp_ac_collector.stop();
 
-        update_locallights_collector.start();
-        if ( pos_changed )
-        {
-                input->occluded_lights.reset();
-
-                // Update local light sources
-                input->locallights = _light_pvs[leaf_id];
-                // Sort local lights from closest to furthest distance from node, we will choose the two closest lights.
-                std::sort( input->locallights.begin(), input->locallights.end(), [curr_net]( const light_t *a, const light_t *b )
-                {
-                        return ( a->pos - curr_net ).length_squared() < ( b->pos - curr_net ).length_squared();
-                } );
-
-                int sky_idx = -1;
-                if ( is_sky_visible( curr_net ) )
-                {
-                        // If we hit the sky from current position, sunlight takes
-                        // precedence over all other local light sources.
-			input->locallights.insert( input->locallights.begin(), _sunlight );
-                        sky_idx = 0;
-                }
-
-                input->sky_idx = sky_idx;
-        }
-        update_locallights_collector.stop();
-        
         size_t numlights = input->locallights.size();
         int lights_updated = 0;
 
@@ -662,19 +1098,7 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         {
                 light_t *light = input->locallights[i];
 
-                bool occluded = false;
-
-                if ( pos_changed )
-                {
-                        if ( i != input->sky_idx && !is_light_visible( curr_net, light ) )
-                        {
-                                // The light is occluded, don't add it.
-                                input->occluded_lights.set( i );
-                                occluded = true;
-                        }
-                }
-
-                if ( occluded || input->occluded_lights.test( i ) )
+                if ( input->occluded_lights.test( i ) )
                 {
                         // light occluded
                         continue;
@@ -763,7 +1187,7 @@ const RenderState *AmbientProbeManager::update_node( PandaNode *node,
         if ( lights_updated > 0 && r_ambientboost.get_value() &&
                 node->has_effect( AmbientBoostEffect::get_class_type() ) )
         {
-                if ( pos_changed || ambientcube_changed )
+                if ( lighting_changed || ambientcube_changed )
                 {
                         static const LVector3 lum_coeff( 0.3, 0.59, 0.11 );
                         float avg_cube_luminance = 0.0;
@@ -876,29 +1300,46 @@ void AmbientProbeManager::xform_lights( const TransformState *cam_trans )
 }
 
 template<class T>
-T AmbientProbeManager::find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
+T AmbientProbeManager::find_closest_in_kdtree( const FlatKDTree *tree, const LPoint3 &pos,
                                                const pvector<T> &items )
 {
         if ( !tree )
                 return nullptr;
 
-        std::vector<double> data = { pos[0], pos[1], pos[2] };
-        auto res = tree->query( data );
-        return items[res.first];
+        int index = tree->find_nearest( pos );
+        if ( index == -1 )
+                return nullptr;
+        return items[index];
 }
 
 void AmbientProbeManager::cleanup()
 {
-        MutexHolder holder( _cache_mutex );
+        // Stays closed until the next level's probes are processed.
+        begin_modify_data();
+
+        stop_flush_task();
+
+        // Drop the queued nodes, they queue themselves again once the next
+        // level is loaded.
+        pvector<lightingjob_t> jobs;
+        _lighting_jobs_lock.acquire();
+        jobs.swap( _lighting_jobs );
+        _lighting_jobs_lock.release();
+        for ( size_t i = 0; i < jobs.size(); i++ )
+        {
+                LightMutexHolder node_holder( get_node_lock( jobs[i].node ) );
+                jobs[i].input->lighting_queued = false;
+                jobs[i].input->last_transform = nullptr;
+        }
 
         _sunlight = nullptr;
-        //_probe_kdtree = nullptr;
-        //_light_kdtree = nullptr;
         _envmap_kdtree = nullptr;
         _probe_kdtrees.clear();
+        _probe_grid->clear();
         _probes.clear();
         _all_probes.clear();
         _light_pvs.clear();
+        _light_pvs_pos.clear();
         _all_lights.clear();
         _cubemaps.clear();
 }
@@ -22,17 +22,26 @@
 #include <cullableObject.h>
 #include <shaderAttrib.h>
 #include <updateSeq.h>
+#include <lightMutex.h>
+#include <pmutex.h>
+#include <conditionVarFull.h>
+#include <atomicAdjust.h>
+#include <genericAsyncTask.h>
+#include <asyncTaskChain.h>
 
 #include <unordered_map>
 #include <bitset>
 
-#include "kdtree/KDTree.h"
+#include "kdtree/flat_kdtree.h"
+#include "ambient_probe_grid.h"
 
 #include "config_bsp.h"
+#include "mathlib/ssemath.h"
 
 class BSPLoader;
 struct dleafambientindex_t;
 struct dleafambientlighting_t;
+struct Ray;
 class cubemap_t;
 
 enum
@@ -75,6 +84,9 @@ struct light_t : public ReferenceCount
 
 #define LIGHTING_UNINITIALIZED -1
 
+// Number of locks the per-node lighting state is spread across
+#define NODE_LOCK_SHARDS 32
+
 #ifndef CPPPARSER
 class CNodeShaderInput : public TypedReferenceCount
 {
@@ -101,7 +113,13 @@ public:
         UpdateSeq node_sequence;
 
         ambientprobe_t *amb_probe;
+        // The ambient cube the node is moving towards, from the closest probe
+        // or interpolated from the probe grid.
+        LVector3 probe_cube[6];
+        bool has_probe_cube;
         cubemap_t *cubemap;
+        // The texture of the closest cubemap, shared with every other node
+        // near it.  Blank until the node has a cubemap.
         PT( Texture ) cubemap_tex;
         bool cubemap_changed;
         pvector<light_t *> locallights;
@@ -113,6 +131,11 @@ public:
 
         int active_lights;
 
+        // Set while the node is waiting for AmbientProbeManager::update_lighting().
+        bool lighting_queued;
+        // Set when new lighting results were applied to the node.
+        bool lighting_changed;
+
         INLINE void copy_needed( const CNodeShaderInput *other )
         {
                 light_count.set_data( other->light_count.get_data() );
@@ -122,6 +145,8 @@ public:
                 active_lights = other->active_lights;
         }
 
+        static Texture *get_blank_cubemap();
+
         INLINE CNodeShaderInput( const CNodeShaderInput *other ) :
                 TypedReferenceCount()
         {
@@ -139,17 +164,19 @@ public:
                 light_data2 = PTA_LMatrix4f::empty_array( MAX_TOTAL_LIGHTS );
                 light_ids = PTA_int::empty_array( MAX_TOTAL_LIGHTS );
                 amb_probe = nullptr;
+                has_probe_cube = false;
                 cubemap = nullptr;
                 state_with_input = nullptr;
                 last_transform = nullptr;
-                cubemap_tex = new Texture( "cubemap_image" );
-		cubemap_tex->setup_cube_map( 32, Texture::T_unsigned_byte, Texture::F_rgb8 );
-                cubemap_tex->clear_image();
+                cubemap_tex = get_blank_cubemap();
                 sky_idx = -1;
                 active_lights = 0;
                 ambient_boost = false;
+                lighting_queued = false;
+                lighting_changed = false;
                 memset( boxcolor, 0, sizeof( LVector3 ) * 6 );
                 memset( boxcolor_boosted, 0, sizeof( LVector3 ) * 6 );
+                memset( probe_cube, 0, sizeof( LVector3 ) * 6 );
 
                 lighting_time = LIGHTING_UNINITIALIZED;
         }
@@ -159,6 +186,7 @@ public:
                 lighting_time( other.lighting_time ),
                 node_sequence( other.node_sequence ),
                 amb_probe( other.amb_probe ),
+                has_probe_cube( other.has_probe_cube ),
                 locallights( other.locallights ),
                 sky_idx( other.sky_idx ),
                 active_lights( other.active_lights ),
@@ -180,6 +208,10 @@ public:
                 light_data2.set_data( other.light_data2.get_data() );
                 light_ids.set_data( other.light_ids.get_data() );
                 light_count.set_data( other.light_count.get_data() );
+                memcpy( probe_cube, other.probe_cube, sizeof( LVector3 ) * 6 );
+
+                lighting_queued = false;
+                lighting_changed = other.lighting_changed;
         }
 };
 #else
@@ -191,32 +223,26 @@ class EXPCL_PANDABSP AmbientProbeManager
 public:
         AmbientProbeManager();
         AmbientProbeManager( BSPLoader *loader );
+        ~AmbientProbeManager();
 
         void process_ambient_probes();
 
 	const RenderState *update_node( PandaNode *node, CPT( TransformState ) net_ts, bool should_update = true );
+        void update_lighting();
 
         void load_cubemaps();
 
         template<class T>
-        T find_closest_in_kdtree( KDTree *tree, const LPoint3 &pos,
+        T find_closest_in_kdtree( const FlatKDTree *tree, const LPoint3 &pos,
                                   const pvector<T> &items );
 
-        template<class T>
-        T find_closest_n_in_kdtree( KDTree *tree, const LPoint3 &pos,
-                                  const pvector<T> &items, int n );
-
         void cleanup();
 
-        //INLINE KDTree *get_light_kdtree() const
-        //{
-        //        return _light_kdtree;
-        //}
-        INLINE KDTree *get_envmap_kdtree() const
+        INLINE FlatKDTree *get_envmap_kdtree() const
         {
                 return _envmap_kdtree;
         }
-        INLINE KDTree *get_probe_kdtree( int leaf ) const
+        INLINE FlatKDTree *get_probe_kdtree( int leaf ) const
         {
                 int itr = _probe_kdtrees.find( leaf );
                 if ( itr == -1 )
@@ -238,23 +264,60 @@ public:
         void xform_lights( const TransformState *cam_trans );
 
 private:
-        INLINE bool is_sky_visible( const LPoint3 &point );
-        INLINE bool is_light_visible( const LPoint3 &point, const light_t *light );
+        // The lighting of a node that depends on its position, computed
+        // outside of the cull traversal.
+        struct lightingjob_t
+        {
+                PT( PandaNode ) node;
+                PT( CNodeShaderInput ) input;
+                LPoint3 pos;
+                int leaf;
+
+                ambientprobe_t *amb_probe;
+                LVector3 probe_cube[6];
+                bool has_probe_cube;
+                cubemap_t *cubemap;
+                pvector<light_t *> locallights;
+                int sky_idx;
+                std::bitset<0xFFF> occluded_lights;
+        };
+
+        INLINE LightMutex &get_node_lock( PandaNode *node )
+        {
+                return _node_locks[( (uintptr_t)node >> 4 ) % NODE_LOCK_SHARDS];
+        }
+
+        void compute_lighting( lightingjob_t &job );
+        void run_lighting_jobs();
+        void apply_lighting( const lightingjob_t &job );
+        void sort_lights( int leaf, const LPoint3 &pos, pvector<light_t *> &lights ) const;
+        static AsyncTask::DoneStatus lighting_task( GenericAsyncTask *task, void *data );
+        static AsyncTask::DoneStatus flush_task( GenericAsyncTask *task, void *data );
+        void start_flush_task();
+        void stop_flush_task();
+
+        void begin_modify_data();
+        void end_modify_data();
+
+        INLINE Ray make_sky_ray( const LPoint3 &point ) const;
+        INLINE Ray make_light_ray( const LPoint3 &point, const light_t *light ) const;
 
 private:
         BSPLoader *_loader;
 
         // NodePaths to be influenced by the ambient probes.
         SimpleHashMap<int, pvector<PT( ambientprobe_t )>, int_hash> _probes;
-        SimpleHashMap<int, PT( KDTree ), int_hash> _probe_kdtrees;
+        SimpleHashMap<int, PT( FlatKDTree ), int_hash> _probe_kdtrees;
         pvector<ambientprobe_t *> _all_probes;
         pvector<PT( light_t )> _all_lights;
         pvector<PT( cubemap_t )> _cubemaps;
         pvector<pvector<light_t *>> _light_pvs;
+        // Positions of the lights in _light_pvs, four at a time.
+        pvector<pvector<FourVectors>> _light_pvs_pos;
         light_t *_sunlight;
 
-       // PT( KDTree ) _light_kdtree;
-        PT( KDTree ) _envmap_kdtree;
+        PT( FlatKDTree ) _envmap_kdtree;
+        PT( AmbientProbeGrid ) _probe_grid;
 
         NodePath _vis_root;
 
@@ -262,7 +325,30 @@ private:
 
         double _last_garbage_collect_time;
 
-        Mutex _cache_mutex;
+        // Each node's lighting state is updated under one of these, picked by
+        // the node's address, so different nodes can be updated in parallel.
+        LightMutex _node_locks[NODE_LOCK_SHARDS];
+
+        // The probes, lights and cubemaps are shared by every update_node()
+        // and are only modified while none is running.  Updates are let in
+        // while _data_ready is set, and counted in _active_updates so the
+        // loading code can wait on _updates_drained for them to drain.
+        AtomicAdjust::Integer _data_ready;
+        AtomicAdjust::Integer _active_updates;
+        Mutex _updates_lock;
+        ConditionVarFull _updates_drained;
+
+        // Nodes that moved, waiting for the next update_lighting().
+        pvector<lightingjob_t> _lighting_jobs;
+        LightMutex _lighting_jobs_lock;
+        // The batch that update_lighting() is working on.
+        pvector<lightingjob_t> _running_jobs;
+        AtomicAdjust::Integer _next_running_job;
+        AsyncTaskChain *_lighting_chain;
+        int _lighting_frame;
+        LightMutex _lighting_lock;
+        // Calls update_lighting() every frame while a level is loaded.
+        PT( GenericAsyncTask ) _flush_task;
 
 public:
         friend class NodeWeakCallback;
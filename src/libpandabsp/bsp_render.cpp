@@ -26,8 +26,6 @@
 
 static PStatCollector pvs_test_geom_collector( "Cull:BSP:AddForDraw:Geom_LeafBoundsIntersect" );
 static PStatCollector pvs_test_node_collector( "Cull:BSP:Node_LeafBoundsIntersect" );
-static PStatCollector pvs_xform_collector( "Cull:BSP:AddForDraw:Geom_LeafBoundsXForm" );
-static PStatCollector pvs_node_xform_collector( "Cull:BSP:Node_LeafBoundsXForm" );
 static PStatCollector addfordraw_collector( "Cull:BSP:AddForDraw" );
 static PStatCollector findgeomshader_collector( "Cull:BSP:FindGeomShader" );
 static PStatCollector applyshaderattrib_collector( "Cull:BSP:ApplyShaderAttrib" );
@@ -67,14 +65,10 @@ bool BSPCullTraverser::is_in_view( CullTraverserData &data )
 		// View frustum test passed.
 		// Now test against PVS (AABBs of all potentially visible leafs).
 
-		pvs_node_xform_collector.start();
-		CPT( GeometricBoundingVolume ) bbox = loader->make_net_bounds(
-			data.get_net_transform( this ),
-			data.node()->get_bounds()->as_geometric_bounding_volume() );
-		pvs_node_xform_collector.stop();
-
 		pvs_test_node_collector.start();
-		bool ret = loader->pvs_bounds_test( bbox, get_required_leaf_flags() );
+		CPT( BoundingVolume ) bounds = data.node()->get_bounds();
+		bool ret = loader->pvs_net_bounds_test( data.get_net_transform( this ),
+			bounds->as_geometric_bounding_volume(), get_required_leaf_flags() );
 		pvs_test_node_collector.stop();
 		return ret;
 	}
@@ -170,15 +164,10 @@ INLINE void BSPCullTraverser::add_geomnode_for_draw( GeomNode *node, CullTravers
 				data._state->get_attrib_def( bfa );
 				if ( !bfa->get_ignore_pvs() )
 				{
-					pvs_xform_collector.start();
-					CPT( GeometricBoundingVolume ) net_geom_volume =
-						loader->make_net_bounds( net_transform, geom_gbv );
-					pvs_xform_collector.stop();
-
 					pvs_test_geom_collector.start();
 					// Test geom bounds against visible leaf bounding boxes.
 					// Always test against PVS even if camera's bit isn't set in CAMERA_MASK_CULLING.
-					if ( !loader->pvs_bounds_test( net_geom_volume, get_required_leaf_flags() ) )
+					if ( !loader->pvs_net_bounds_test( net_transform, geom_gbv, get_required_leaf_flags() ) )
 					{
 						// Didn't intersect any, cull.
 						pvs_test_geom_collector.stop();
@@ -251,12 +240,13 @@ void BSPCullTraverser::traverse_below( CullTraverserData &data )
 
 			keep_going = false;
 
-			_loader->_leaf_aabb_lock.acquire();
-			bool should_render = _loader->_curr_leaf_idx != 0;
+			// Keep the snapshot alive while we're recording its Geoms.
+			CPT( BSPLoader::visdata_t ) vis = _loader->get_visdata();
+			bool should_render = vis != nullptr && vis->leaf != 0 && vis->has_world_geoms;
 
 			if ( should_render )
 			{
-				const GeomNode::Geoms &world_geoms = _loader->_leaf_world_geoms[_loader->_curr_leaf_idx];
+				const GeomNode::Geoms &world_geoms = vis->world_geoms;
 
 				int num_world_geoms = world_geoms.get_num_geoms();
 				for ( int i = 0; i < num_world_geoms; i++ )
@@ -314,8 +304,6 @@ void BSPCullTraverser::traverse_below( CullTraverserData &data )
 				}
 			}
 
-			_loader->_leaf_aabb_lock.release();
-
 			wsp_trav_collector.stop();
 		}
 		else if ( _loader->has_active_level() &&
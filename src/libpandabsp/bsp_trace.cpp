@@ -17,6 +17,8 @@
 #include <pstatTimer.h>
 #include <pstatCollector.h>
 
+#include <algorithm>
+
 static PStatCollector piw_collector( "BSP:Trace:PointInWinding" );
 static PStatCollector ff_collector( "BSP:FaceFinder" );
 
@@ -309,13 +311,69 @@ bool IntersectRayWithBoxBrush( Trace *trace, const dbrush_t *brush, const cboxbr
 
 #define NEVER_UPDATED -99999
 
+// What CM_ClipBoxToBrush() has found out about the sides of a brush so far.
+struct brushclip_t
+{
+        float enter_frac;
+        float leave_frac;
+        bool getout;
+        bool startout;
+        const dbrushside_t *leadside;
+};
+
+/**
+ * Clips the trace against one side of the brush, given the distances of both
+ * ends of the trace to the side's plane.  Both ends must not be in front of
+ * the plane.
+ */
+INLINE static void CM_ClipBoxToBrushSide( brushclip_t &clip, const dbrushside_t *side, float d1, float d2 )
+{
+        if ( d1 > 0.0 )
+        {
+                clip.startout = true;
+        }
+        else
+        {
+                if ( d2 <= 0.0 )
+                {
+                        return;
+                }
+                clip.getout = true;
+        }
+
+        // crosses face
+        if ( d1 > d2 )
+        {
+                // enter
+                float f = ( d1 - DIST_EPSILON );
+                if ( f < 0.f )
+                {
+                        f = 0.f;
+                }
+                f = f / ( d1 - d2 );
+                if ( f > clip.enter_frac )
+                {
+                        clip.enter_frac = f;
+                        clip.leadside = side;
+                }
+        }
+        else
+        {	// leave
+                float f = ( d1 + DIST_EPSILON ) / ( d1 - d2 );
+                if ( f < clip.leave_frac )
+                {
+                        clip.leave_frac = f;
+                }
+        }
+}
+
 template <bool IS_POINT>
 void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
 {
         // special SIMD accelerated case for box brushes ( 6 sides and axis-aligned )
         if ( trace->bspdata->boxbrushes[brush_idx].is_box )
         {
-                cboxbrush_t *bbrush = trace->bspdata->boxbrushes + brush_idx;
+                cboxbrush_t *bbrush = &trace->bspdata->boxbrushes[brush_idx];
                 IntersectRayWithBoxBrush( trace, brush, bbrush );
                 return;
         }
@@ -329,87 +387,61 @@ void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
         const LVector3 &p2 = trace->end_pos;
         int brush_contents = brush->contents;
 
-        float enter_frac = NEVER_UPDATED;
-        float leave_frac = 1.0;
-
-        bool getout = false;
-        bool startout = false;
-        const dbrushside_t *leadside = nullptr;
+        brushclip_t clip;
+        clip.enter_frac = NEVER_UPDATED;
+        clip.leave_frac = 1.0;
+        clip.getout = false;
+        clip.startout = false;
+        clip.leadside = nullptr;
 
-        float dist;
+        const collbspdata_t *cdata = trace->bspdata;
+        const dbrushside_t *firstside = &cdata->bspdata->dbrushsides[brush->firstside];
 
-        const dbrushside_t *side = &trace->bspdata->bspdata->dbrushsides[brush->firstside];
-        for (const dbrushside_t * const sidelimit = side + brush->numsides; side < sidelimit; side++)
+        const cbrushsidegroup_t *group = &cdata->sidegroups[cdata->brush_sidegroups[brush_idx]];
+        for ( int first = 0; first < brush->numsides; first += 4, group++ )
         {
-                const dplane_t *plane = trace->bspdata->bspdata->dplanes + side->planenum;
-                LVector3 plane_normal( plane->normal[0], plane->normal[1], plane->normal[2] );
-
+                fltx4 dist = group->dists;
                 if ( !IS_POINT )
                 {
                         // general box case
-                        // push the plane out appropriately for mins/maxs
-
-                        dist = DotProductAbs( plane_normal, trace->extents );
-                        dist = plane->dist + dist;
+                        // push the planes out appropriately for mins/maxs
+                        dist = AddSIMD( dist, group->abs_normals * trace->extents );
                 }
-                else
+
+                fltx4 d1 = SubSIMD( group->normals * p1, dist );
+                fltx4 d2 = SubSIMD( group->normals * p2, dist );
+                if ( IS_POINT )
                 {
-                        dist = plane->dist;
                         // don't trace rays against bevel planes
-                        if ( side->bevel )
-                        {
-                                continue;
-                        }
+                        d1 = MaskedAssign( group->ray_mask, d1, Four_NegativeOnes );
+                        d2 = MaskedAssign( group->ray_mask, d2, Four_NegativeOnes );
                 }
 
-                float d1 = p1.dot( plane_normal ) - dist;
-                float d2 = p2.dot( plane_normal ) - dist;
-
-                // if completely in front of face, no intersection
-                if ( d1 > 0.0 )
+                // if completely in front of any of the four faces, no intersection
+                if ( IsAnyNegative( AndSIMD( CmpGtSIMD( d1, Four_Zeros ), CmpGtSIMD( d2, Four_Zeros ) ) ) )
                 {
-                        startout = true;
-
-                        if ( d2 > 0.0 )
-                        {
-                                return;
-                        }
+                        return;
                 }
-                else
+
+                int count = std::min( brush->numsides - first, 4 );
+                for ( int i = 0; i < count; i++ )
                 {
-                        if ( d2 <= 0.0 )
+                        const dbrushside_t *side = firstside + first + i;
+                        if ( IS_POINT && side->bevel )
                         {
                                 continue;
                         }
-                        getout = true;
-                }
 
-                // crosses face
-                if ( d1 > d2 )
-                {
-                        // enter
-                        float f = ( d1 - DIST_EPSILON );
-                        if ( f < 0.f )
-                        {
-                                f = 0.f;
-                        }
-                        f = f / ( d1 - d2 );
-                        if ( f > enter_frac )
-                        {
-                                enter_frac = f;
-                                leadside = side;
-                        }
-                }
-                else
-                {	// leave
-                        float f = ( d1 + DIST_EPSILON ) / ( d1 - d2 );
-                        if ( f < leave_frac )
-                        {
-                                leave_frac = f;
-                        }
+                        CM_ClipBoxToBrushSide( clip, side, SubFloat( d1, i ), SubFloat( d2, i ) );
                 }
         }
 
+        float enter_frac = clip.enter_frac;
+        float leave_frac = clip.leave_frac;
+        bool getout = clip.getout;
+        bool startout = clip.startout;
+        const dbrushside_t *leadside = clip.leadside;
+
         // when this happens, we entered the brush *after* leaving the previous brush.
         // Therefore, we're still outside!
 
@@ -472,18 +504,26 @@ void CM_ClipBoxToBrush( Trace *trace, const dbrush_t *brush, int brush_idx )
                                 enter_frac = 0;
                         trace->fraction = enter_frac;
                         trace->plane = *( trace->bspdata->bspdata->dplanes + leadside->planenum );
-                        trace->surface = (texinfo_t *)trace->bspdata->bspdata->texinfo + side->texinfo;
+                        trace->surface = (texinfo_t *)&trace->bspdata->bspdata->texinfo[leadside->texinfo];
                         trace->hit_contents = brush_contents;
                 }
         }
 }
 
+// The brushes that the current trace on this thread has clipped against.
+// A brush is checked if its count is the current checkcount.
+struct brushchecks_t
+{
+        pvector<unsigned int> counts;
+        unsigned int checkcount;
+};
+static thread_local brushchecks_t brush_checks;
+
 template <bool IS_POINT>
 void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_frac )
 {
         const dleaf_t *leaf = trace->bspdata->bspdata->dleafs + leaf_idx;
-
-        bool simd_loaded = false;
+        brushchecks_t &checks = brush_checks;
 
         //
         // trace ray/box sweep against all brushes in this leaf
@@ -493,6 +533,14 @@ void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_fra
                 int lbidx = leaf->firstleafbrush + leafbrush;
                 int brushidx = trace->bspdata->bspdata->dleafbrushes[lbidx];
 
+                // brushes that are in more than one leaf along the trace
+                // only have to be clipped against once
+                if ( checks.counts[brushidx] == checks.checkcount )
+                {
+                        continue;
+                }
+                checks.counts[brushidx] = checks.checkcount;
+
                 const dbrush_t *brush = &trace->bspdata->bspdata->dbrushes[brushidx];
 
                 // only collide with objects you are interested in
@@ -502,13 +550,6 @@ void CM_TraceToLeaf( Trace *trace, int leaf_idx, float start_frac, float end_fra
                         continue;
                 }
 
-                // only load SIMD if we have to
-                if ( trace->bspdata->boxbrushes[brushidx].is_box && !simd_loaded )
-                {
-                        trace->load_simd();
-                        simd_loaded = true;
-                }   
-
                 CM_ClipBoxToBrush<IS_POINT>( trace, brush, brushidx );
                 if ( !trace->fraction )
                 {
@@ -631,6 +672,17 @@ void CM_RecursiveHullCheckImpl( Trace *trace, int num, const float p1f, const fl
 
 void CM_RecursiveHullCheck( Trace *trace, int headnode, const float p1f, const float p2f )
 {
+        // start a new set of brush checks
+        brushchecks_t &checks = brush_checks;
+        size_t num_brushes = trace->bspdata->boxbrushes.size();
+        if ( checks.counts.size() != num_brushes || ++checks.checkcount == 0 )
+        {
+                checks.counts.assign( num_brushes, 0 );
+                checks.checkcount = 1;
+        }
+
+        // everything the box brushes need is loaded up front
+        trace->load_simd();
 
         if ( trace->is_point )
         {
@@ -705,12 +757,317 @@ void CM_BoxTrace( const Ray &ray, int headnode, int brushmask, bool compute_endp
         }
 }
 
+//==============================================================================================//
+// Ray packets
+//
+// Traces up to four point rays through the tree at once.  The rays share
+// the descent down to the leafs, with the plane distances of all four
+// computed together, and box brushes are rejected for all of them at once.
+// Rays from the same point to several lights tend to follow the same path
+// through the tree for most of the way.
+//==============================================================================================//
+
+static PStatCollector bt4_collector( "BSP:CM_BoxTrace4" );
+
+INLINE static FourVectors lerp_four( const FourVectors &a, const FourVectors &b, const fltx4 &t )
+{
+        FourVectors ret = b;
+        ret -= a;
+        ret *= t;
+        ret += a;
+        return ret;
+}
+
+INLINE static FourVectors masked_assign_four( const fltx4 &mask, const FourVectors &a, const FourVectors &b )
+{
+        FourVectors ret;
+        ret.x = MaskedAssign( mask, a.x, b.x );
+        ret.y = MaskedAssign( mask, a.y, b.y );
+        ret.z = MaskedAssign( mask, a.z, b.z );
+        return ret;
+}
+
+// Returns the number of lanes set in a four lane mask.
+INLINE static int count_lanes( int lanes )
+{
+        static const int counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+        return counts[lanes & 15];
+}
+
+INLINE static fltx4 lane_mask( int lanes )
+{
+        static const int32_t ALIGN_16BYTE masks[16][4] =
+        {
+                { 0, 0, 0, 0 }, { -1, 0, 0, 0 }, { 0, -1, 0, 0 }, { -1, -1, 0, 0 },
+                { 0, 0, -1, 0 }, { -1, 0, -1, 0 }, { 0, -1, -1, 0 }, { -1, -1, -1, 0 },
+                { 0, 0, 0, -1 }, { -1, 0, 0, -1 }, { 0, -1, 0, -1 }, { -1, -1, 0, -1 },
+                { 0, 0, -1, -1 }, { -1, 0, -1, -1 }, { 0, -1, -1, -1 }, { -1, -1, -1, -1 },
+        };
+        return LoadAlignedSIMD( (const float *)masks[lanes] );
+}
+
+/**
+ * Clips the active rays of the packet against the brushes of a leaf.
+ * segmins and segmaxs are the bounds of each whole ray.
+ */
+static void CM_TraceToLeaf4( const collbspdata_t *bspdata, Trace *traces, int active, int leaf_idx,
+                             const FourVectors &segmins, const FourVectors &segmaxs )
+{
+        const dleaf_t *leaf = bspdata->bspdata->dleafs + leaf_idx;
+
+        int simd_loaded = 0;
+
+        for ( int leafbrush = 0; leafbrush < leaf->numleafbrushes && active; leafbrush++ )
+        {
+                int lbidx = leaf->firstleafbrush + leafbrush;
+                int brushidx = bspdata->bspdata->dleafbrushes[lbidx];
+
+                const dbrush_t *brush = &bspdata->bspdata->dbrushes[brushidx];
+                const cboxbrush_t *bbrush = &bspdata->boxbrushes[brushidx];
+
+                // only collide with objects the ray is interested in
+                int lanes = 0;
+                for ( int i = 0; i < 4; i++ )
+                {
+                        if ( ( active & ( 1 << i ) ) && ( brush->contents & traces[i].contents ) )
+                        {
+                                lanes |= 1 << i;
+                        }
+                }
+                if ( !lanes )
+                {
+                        continue;
+                }
+
+                if ( bbrush->is_box )
+                {
+                        // Throw out the rays whose bounds don't touch the box.
+                        fltx4 hit = CmpLeSIMD( segmins.x, ReplicateX4( bbrush->maxs[0] + DIST_EPSILON ) );
+                        hit = AndSIMD( hit, CmpGeSIMD( segmaxs.x, ReplicateX4( bbrush->mins[0] - DIST_EPSILON ) ) );
+                        hit = AndSIMD( hit, CmpLeSIMD( segmins.y, ReplicateX4( bbrush->maxs[1] + DIST_EPSILON ) ) );
+                        hit = AndSIMD( hit, CmpGeSIMD( segmaxs.y, ReplicateX4( bbrush->mins[1] - DIST_EPSILON ) ) );
+                        hit = AndSIMD( hit, CmpLeSIMD( segmins.z, ReplicateX4( bbrush->maxs[2] + DIST_EPSILON ) ) );
+                        hit = AndSIMD( hit, CmpGeSIMD( segmaxs.z, ReplicateX4( bbrush->mins[2] - DIST_EPSILON ) ) );
+                        lanes &= TestSignSIMD( hit );
+                }
+
+                for ( int i = 0; i < 4; i++ )
+                {
+                        if ( !( lanes & ( 1 << i ) ) )
+                        {
+                                continue;
+                        }
+
+                        Trace *trace = &traces[i];
+                        if ( bbrush->is_box && !( simd_loaded & ( 1 << i ) ) )
+                        {
+                                trace->load_simd();
+                                simd_loaded |= 1 << i;
+                        }
+
+                        CM_ClipBoxToBrush<true>( trace, brush, brushidx );
+                        if ( !trace->fraction )
+                        {
+                                active &= ~( 1 << i );
+                        }
+                }
+        }
+}
+
+/**
+ * Packet version of CM_RecursiveHullCheckImpl<true>().  Each lane carries its
+ * own [p1f, p2f] segment of its ray.  Where the rays split at a node, each
+ * child is visited once with the lanes that reach it.
+ */
+static void CM_RecursiveHullCheck4( const collbspdata_t *bspdata, Trace *traces, int active, int num,
+                                    const fltx4 &p1f, const fltx4 &p2f,
+                                    const FourVectors &p1, const FourVectors &p2,
+                                    const FourVectors &segmins, const FourVectors &segmaxs )
+{
+        for ( int i = 0; i < 4; i++ )
+        {
+                if ( ( active & ( 1 << i ) ) && traces[i].fraction <= SubFloat( p1f, i ) )
+                {
+                        // already hit something nearer
+                        active &= ~( 1 << i );
+                }
+        }
+        if ( !active )
+        {
+                return;
+        }
+
+        const dnode_t *node = nullptr;
+        fltx4 t1 = Four_Zeros, t2 = Four_Zeros;
+        int front = 0, back = 0;
+
+        while ( num >= 0 )
+        {
+                node = bspdata->bspdata->dnodes + num;
+                const dplane_t *plane = bspdata->bspdata->dplanes + node->planenum;
+                fltx4 dist = ReplicateX4( plane->dist );
+
+                if ( plane->type < 3 )
+                {
+                        t1 = SubSIMD( p1[plane->type], dist );
+                        t2 = SubSIMD( p2[plane->type], dist );
+                }
+                else
+                {
+                        LVector3 normal( plane->normal[0], plane->normal[1], plane->normal[2] );
+                        t1 = SubSIMD( p1 * normal, dist );
+                        t2 = SubSIMD( p2 * normal, dist );
+                }
+
+                // see which sides we need to consider
+                front = TestSignSIMD( AndSIMD( CmpGtSIMD( t1, Four_Zeros ), CmpGtSIMD( t2, Four_Zeros ) ) ) & active;
+                back = TestSignSIMD( AndSIMD( CmpLtSIMD( t1, Four_Zeros ), CmpLtSIMD( t2, Four_Zeros ) ) ) & active;
+                if ( front == active )
+                {
+                        num = node->children[0];
+                        continue;
+                }
+                if ( back == active )
+                {
+                        num = node->children[1];
+                        continue;
+                }
+                break;
+        }
+
+        // if < 0, we are in a leaf node
+        if ( num < 0 )
+        {
+                CM_TraceToLeaf4( bspdata, traces, active, ~num, segmins, segmaxs );
+                return;
+        }
+
+        int cross = active & ~( front | back );
+        fltx4 cross_mask = lane_mask( cross );
+
+        // put the crosspoint DIST_EPSILON pixels on the near side
+        fltx4 dist_eps = ReplicateX4( DIST_EPSILON );
+        fltx4 denom = SubSIMD( t1, t2 );
+        fltx4 parallel = CmpEqSIMD( denom, Four_Zeros );
+        fltx4 idist = DivSIMD( Four_Ones, MaskedAssign( parallel, Four_Ones, denom ) );
+        // side 1 where t1 < t2, the ray starts behind the plane
+        fltx4 side1 = CmpLtSIMD( t1, t2 );
+        fltx4 frac = MulSIMD( MaskedAssign( side1, SubSIMD( t1, dist_eps ), AddSIMD( t1, dist_eps ) ), idist );
+        fltx4 frac2 = MulSIMD( MaskedAssign( side1, AddSIMD( t1, dist_eps ), SubSIMD( t1, dist_eps ) ), idist );
+        frac = MaskedAssign( parallel, Four_Ones, frac );
+        frac2 = MaskedAssign( parallel, Four_Zeros, frac2 );
+        frac = MinSIMD( MaxSIMD( frac, Four_Zeros ), Four_Ones );
+        frac2 = MinSIMD( MaxSIMD( frac2, Four_Zeros ), Four_Ones );
+
+        // near part: [p1, mid], far part: [mid2, p2]
+        fltx4 delta_f = SubSIMD( p2f, p1f );
+        fltx4 midf = AddSIMD( p1f, MulSIMD( delta_f, frac ) );
+        fltx4 midf2 = AddSIMD( p1f, MulSIMD( delta_f, frac2 ) );
+        FourVectors mid = lerp_four( p1, p2, frac );
+        FourVectors mid2 = lerp_four( p1, p2, frac2 );
+
+        // Crossing lanes on side 0 go to child 0 with their near part and to
+        // child 1 with their far part, and the other way around on side 1.
+        fltx4 near0 = AndNotSIMD( side1, cross_mask );
+        fltx4 near1 = AndSIMD( side1, cross_mask );
+
+        // child 0: near part of side 0 lanes, far part of side 1 lanes
+        fltx4 c0_p1f = MaskedAssign( near1, midf2, p1f );
+        fltx4 c0_p2f = MaskedAssign( near0, midf, p2f );
+        FourVectors c0_p1 = masked_assign_four( near1, mid2, p1 );
+        FourVectors c0_p2 = masked_assign_four( near0, mid, p2 );
+
+        // child 1: near part of side 1 lanes, far part of side 0 lanes
+        fltx4 c1_p1f = MaskedAssign( near0, midf2, p1f );
+        fltx4 c1_p2f = MaskedAssign( near1, midf, p2f );
+        FourVectors c1_p1 = masked_assign_four( near0, mid2, p1 );
+        FourVectors c1_p2 = masked_assign_four( near1, mid, p2 );
+
+        // Visit the child that most of the crossing rays start in first.
+        int side1_lanes = TestSignSIMD( near1 );
+        int first = count_lanes( side1_lanes & cross ) > count_lanes( ~side1_lanes & cross ) ? 1 : 0;
+        for ( int i = 0; i < 2; i++ )
+        {
+                int child = first ^ i;
+                if ( child == 0 )
+                {
+                        CM_RecursiveHullCheck4( bspdata, traces, front | cross, node->children[0],
+                                                c0_p1f, c0_p2f, c0_p1, c0_p2, segmins, segmaxs );
+                }
+                else
+                {
+                        CM_RecursiveHullCheck4( bspdata, traces, back | cross, node->children[1],
+                                                c1_p1f, c1_p2f, c1_p1, c1_p2, segmins, segmaxs );
+                }
+        }
+}
+
+/**
+ * Traces up to four rays along the BSP tree at once, each with its own brush
+ * contents mask.  Point rays are traced as a packet; swept boxes fall back to
+ * CM_BoxTrace().  The end points of the traces are not computed.
+ */
+void CM_BoxTrace4( const Ray *rays, int num_rays, int headnode, const int *brushmasks,
+                   const collbspdata_t *bspdata, Trace *traces )
+{
+        nassertv( num_rays >= 0 && num_rays <= 4 );
+
+        PStatTimer timer( bt4_collector );
+
+        int active = 0;
+        FourVectors p1, p2;
+        p1.DuplicateVector( LVector3::zero() );
+        p2.DuplicateVector( LVector3::zero() );
+
+        for ( int i = 0; i < num_rays; i++ )
+        {
+                // Start every lane from a clean trace, the caller may be
+                // reusing the array from a previous packet.
+                traces[i] = Trace();
+
+                const Ray &ray = rays[i];
+                if ( !ray.is_ray )
+                {
+                        CM_BoxTrace( ray, headnode, brushmasks[i], false, bspdata, traces[i] );
+                        continue;
+                }
+
+                Trace &trace = traces[i];
+                trace.contents = brushmasks[i];
+                trace.start_pos = ray.start;
+                trace.end_pos = ray.start + ray.delta;
+                trace.extents = ray.extents;
+                trace.delta = ray.delta;
+                trace.inv_delta = ray.inv_delta();
+                trace.mins = -ray.extents;
+                trace.maxs = ray.extents;
+                trace.is_point = true;
+                trace.bspdata = (collbspdata_t *)bspdata;
+
+                for ( int j = 0; j < 3; j++ )
+                {
+                        SubFloat( p1[j], i ) = trace.start_pos[j];
+                        SubFloat( p2[j], i ) = trace.end_pos[j];
+                }
+
+                active |= 1 << i;
+        }
+
+        if ( !active )
+        {
+                return;
+        }
+
+        CM_RecursiveHullCheck4( bspdata, traces, active, headnode, Four_Zeros, Four_Ones,
+                                p1, p2, minimum( p1, p2 ), maximum( p1, p2 ) );
+}
+
 collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata )
 {
         collbspdata_t *cdata = new collbspdata_t;
-        memset( cdata, 0, sizeof( collbspdata_t ) );
-
         cdata->bspdata = bspdata;
+        // zero-filled, only box brushes get filled in
+        cdata->boxbrushes.resize( bspdata->dbrushes.size() );
 
         // find brushes with 6 sides, they are box brushes and we can accelerate the ray tracing
         for ( size_t brushnum = 0; brushnum < bspdata->dbrushes.size(); brushnum++ )
@@ -748,12 +1105,12 @@ collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata )
                                         bbrush.surface_indices[axis] = t;
                                 }
 
-                                bbrush.ssemins = LoadAlignedSIMD( LVector4( bbrush.mins, 0 ).get_data() );
-                                bbrush.ssemaxs = LoadAlignedSIMD( LVector4( bbrush.maxs, 0 ).get_data() );
                         }
 
                         if ( is_box )
                         {
+                                bbrush.ssemins = LoadAlignedSIMD( LVector4( bbrush.mins, 0 ).get_data() );
+                                bbrush.ssemaxs = LoadAlignedSIMD( LVector4( bbrush.maxs, 0 ).get_data() );
                                 bbrush.is_box = 1;
                                 cdata->boxbrushes[brushnum] = bbrush;
                         }
@@ -761,6 +1118,59 @@ collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata )
                 }
         }
 
+        // the planes of every other brush are stored four sides at a time
+        cdata->brush_sidegroups.resize( bspdata->dbrushes.size(), -1 );
+        for ( size_t brushnum = 0; brushnum < bspdata->dbrushes.size(); brushnum++ )
+        {
+                const dbrush_t *dbrush = &bspdata->dbrushes[brushnum];
+                if ( cdata->boxbrushes[brushnum].is_box || dbrush->numsides <= 0 )
+                {
+                        continue;
+                }
+
+                cdata->brush_sidegroups[brushnum] = (int)cdata->sidegroups.size();
+                for ( int first = 0; first < dbrush->numsides; first += 4 )
+                {
+                        ALIGN_16BYTE float normals[3][4];
+                        ALIGN_16BYTE float dists[4];
+                        ALIGN_16BYTE uint32_t ray_mask[4];
+                        for ( int i = 0; i < 4; i++ )
+                        {
+                                if ( first + i < dbrush->numsides )
+                                {
+                                        const dbrushside_t *bside = &bspdata->dbrushsides[dbrush->firstside + first + i];
+                                        const dplane_t *plane = &bspdata->dplanes[bside->planenum];
+                                        for ( int j = 0; j < 3; j++ )
+                                        {
+                                                normals[j][i] = plane->normal[j];
+                                        }
+                                        dists[i] = plane->dist;
+                                        ray_mask[i] = bside->bevel ? 0 : ~0u;
+                                }
+                                else
+                                {
+                                        for ( int j = 0; j < 3; j++ )
+                                        {
+                                                normals[j][i] = 0.0f;
+                                        }
+                                        dists[i] = FLT_MAX;
+                                        ray_mask[i] = 0;
+                                }
+                        }
+
+                        cbrushsidegroup_t group;
+                        group.normals.x = LoadAlignedSIMD( normals[0] );
+                        group.normals.y = LoadAlignedSIMD( normals[1] );
+                        group.normals.z = LoadAlignedSIMD( normals[2] );
+                        group.abs_normals.x = fabs( group.normals.x );
+                        group.abs_normals.y = fabs( group.normals.y );
+                        group.abs_normals.z = fabs( group.normals.z );
+                        group.dists = LoadAlignedSIMD( dists );
+                        group.ray_mask = LoadAlignedSIMD( (float *)ray_mask );
+                        cdata->sidegroups.push_back( group );
+                }
+        }
+
         return cdata;
 }
 
@@ -775,37 +1185,49 @@ BSPTrace::BSPTrace( BSPLoader *loader ) :
 	_scene->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
 }
 
+/**
+ * Adds the faces of the dmodel to the scene as a single triangle mesh.  The
+ * scene is not committed, call update() on it once all the dmodels are in.
+ */
 void BSPTrace::add_dmodel( const dmodel_t *model, unsigned int mask )
 {
 	nassertv( _scene != nullptr );
 
 	const bspdata_t *data = _loader->get_bspdata();
 
+	PT( RayTraceTriangleMesh ) geom = new RayTraceTriangleMesh;
+	geom->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
+	geom->set_mask( mask );
+
+	// The triangles are added in order, so the primitive ID of a triangle
+	// indexes straight into this.
+	pvector<const dface_t *> prim_dfaces;
+
 	for ( int facenum = 0; facenum < model->numfaces; facenum++ )
 	{
 		const dface_t *face = &data->dfaces[model->firstface + facenum];
 
-		PT( RayTraceTriangleMesh ) geom = new RayTraceTriangleMesh;
-		geom->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
-		geom->set_mask( mask );
-
 		int ntris = face->numedges - 2;
 		for ( int tri = 0; tri < ntris; tri++ )
 		{
 			geom->add_triangle( VertCoord( data, face, 0 ),
 				VertCoord( data, face, ( tri + 1 ) % face->numedges ),
 				VertCoord( data, face, ( tri + 2 ) % face->numedges ) );
+			prim_dfaces.push_back( face );
 		}
+	}
 
-		geom->build();
+	if ( prim_dfaces.empty() )
+	{
+		return;
+	}
 
-		_scene->add_geometry( geom );
-		_geom_handles.push_back( geom );
+	geom->build();
 
-		_dface_map[geom->get_geom_id()] = face;
-	}
+	_scene->add_geometry( geom );
+	_geom_handles.push_back( geom );
 
-	_scene->update();
+	_dface_map[geom->get_geom_id()].swap( prim_dfaces );
 }
 
 void BSPTrace::clear()
@@ -46,16 +46,32 @@ struct cboxbrush_t
         int is_box;
 };
 
+// The planes of four sides of a brush that isn't a box, so they can be
+// tested against a trace all at once.  Lanes past the last side have a zero
+// normal and a huge distance, which puts both ends of any trace behind them.
+struct cbrushsidegroup_t
+{
+        FourVectors normals;
+        FourVectors abs_normals;
+        fltx4 dists;
+        // All bits on in the lanes of sides that aren't bevels.
+        fltx4 ray_mask;
+};
+
 struct collbspdata_t
 {
         const bspdata_t *bspdata;
-        cboxbrush_t boxbrushes[MAX_MAP_BRUSHES];
+        pvector<cboxbrush_t> boxbrushes; // one per dbrush
+        pvector<int> brush_sidegroups; // first side group of each dbrush, -1 for box brushes
+        pvector<cbrushsidegroup_t> sidegroups;
 };
 
 extern EXPCL_PANDABSP collbspdata_t *SetupCollisionBSPData( const bspdata_t *bspdata );
 
 extern EXPCL_PANDABSP void CM_BoxTrace( const Ray &ray, int headnode, int brushmask,
                          bool compute_endpoint, const collbspdata_t *bspdata, Trace &trace );
+extern EXPCL_PANDABSP void CM_BoxTrace4( const Ray *rays, int num_rays, int headnode, const int *brushmasks,
+                                        const collbspdata_t *bspdata, Trace *traces );
 
 class BSPLoader;
 
@@ -77,12 +93,15 @@ public:
 		return _scene;
 	}
 
-	INLINE const dface_t *lookup_dface( int geom_id )
+	INLINE const dface_t *lookup_dface( int geom_id, int prim_id )
 	{
 		int idx = _dface_map.find( geom_id );
 		if ( idx == -1 )
 			return nullptr;
-		return _dface_map.get_data( idx );
+		const pvector<const dface_t *> &prim_dfaces = _dface_map.get_data( idx );
+		if ( prim_id < 0 || prim_id >= (int)prim_dfaces.size() )
+			return nullptr;
+		return prim_dfaces[prim_id];
 	}
 
 	void clear();
@@ -90,7 +109,8 @@ public:
 private:
 	PT( RayTraceScene ) _scene;
 	pvector<PT( RayTraceGeometry )> _geom_handles;
-	typedef SimpleHashMap<int, const dface_t *, int_hash> RT_DFaceMap;
+	// The dface of each triangle of a dmodel's mesh, by geometry ID.
+	typedef SimpleHashMap<int, pvector<const dface_t *>, int_hash> RT_DFaceMap;
 	RT_DFaceMap _dface_map;
 
 	BSPLoader *_loader;
@@ -24,15 +24,14 @@
 
 #include <array>
 #include <bitset>
+#include <memory>
 #include <math.h>
+#include <float.h>
 
 #include <asyncTaskManager.h>
-#include <eggData.h>
-#include <eggPolygon.h>
-#include <eggVertexUV.h>
-#include <eggWriter.h>
+#include <asyncTaskChain.h>
+#include <thread.h>
 #include <geomNode.h>
-#include <load_egg_file.h>
 #include <loader.h>
 #include <nodePathCollection.h>
 #include <pointLight.h>
@@ -42,6 +41,8 @@
 #include <texturePool.h>
 #include <textureStage.h>
 #include <virtualFileSystem.h>
+#include <config_putil.h>
+#include <subfileInfo.h>
 #include <directionalLight.h>
 #include <ambientLight.h>
 #include <spotlight.h>
@@ -51,6 +52,7 @@
 #include <graphicsEngine.h>
 #include <boundingBox.h>
 #include <pStatCollector.h>
+#include <clockObject.h>
 #include <cullTraverser.h>
 #include <cullTraverserData.h>
 #include <cullableObject.h>
@@ -60,6 +62,11 @@
 #include <lightReMutexHolder.h>
 #include <geomVertexData.h>
 #include <geomVertexRewriter.h>
+#include <geomVertexWriter.h>
+#include <geomTriangles.h>
+#include <textureAttrib.h>
+#include <transparencyAttrib.h>
+#include <depthWriteAttrib.h>
 #include <sceneGraphReducer.h>
 #include <characterJointEffect.h>
 #include <orthographicLens.h>
@@ -72,6 +79,10 @@
 #include <bulletTriangleMeshShape.h>
 #include <bulletWorld.h>
 #include <omniBoundingVolume.h>
+#include <configVariableInt.h>
+#include <bamCache.h>
+#include <bamCacheRecord.h>
+#include <datagram.h>
 
 static LVector3 default_shadow_dir( 0.5, 0, -0.9 );
 static LVector4 default_shadow_color( 0.5, 0.5, 0.5, 1.0 );
@@ -79,6 +90,43 @@ static LVector4 default_shadow_color( 0.5, 0.5, 0.5, 1.0 );
 static PT( InternalName ) static_vertex_lighting_name = InternalName::make( "static_vertex_lighting" );
 
 static ConfigVariableBool dumpcubemaps( "dumpcubemaps", false );
+static ConfigVariableBool bsp_mmap_load
+( "bsp-mmap-load", true,
+  PRC_DESC( "If true, BSP files are memory-mapped when they are loaded, and the "
+            "large lumps are read straight out of the mapping instead of being "
+            "copied.  The mapped pages are shared by every process that has the "
+            "same level loaded." ) );
+static ConfigVariableInt bsp_pvs_tree_threshold
+( "bsp-pvs-tree-threshold", 64,
+  PRC_DESC( "When more leafs than this are visible, pvs_bounds_test() descends the "
+            "BSP tree and skips whole subtrees with no visible leafs, instead of "
+            "testing against every visible leaf." ) );
+static ConfigVariableBool bsp_geometry_cache
+( "bsp-geometry-cache", true,
+  PRC_DESC( "If true, the renderable face geometry built for a level is stored in the "
+            "model-cache-dir, keyed on the checksums of the lumps it was built from.  "
+            "Loading the same level again reads the geometry out of the cache instead "
+            "of building it again." ) );
+static ConfigVariableInt bsp_line_batch_threads
+( "bsp-line-batch-threads", 2,
+  PRC_DESC( "Number of threads the lines given to trace_lines() and clip_lines() "
+            "are spread across.  0 traces them on the calling thread." ) );
+static ConfigVariableInt bsp_leaf_batch_threads
+( "bsp-leaf-batch-threads", 4,
+  PRC_DESC( "Number of threads that build the per-leaf world batches when a level "
+            "is loaded.  0 builds them on the loading thread." ) );
+static ConfigVariableInt bsp_net_bounds_cache_size
+( "bsp-net-bounds-cache-size", 8192,
+  PRC_DESC( "The most results of pvs_net_bounds_test() each cull thread remembers "
+            "in a frame.  Past this many, the rest of the frame's tests aren't "
+            "remembered." ) );
+
+// Bump this whenever make_faces() changes the geometry it produces.
+static const uint8_t face_geometry_cache_version = 2;
+
+static PStatCollector net_bounds_hit_collector( "Cull:BSP:NetBoundsCache:Hits" );
+static PStatCollector net_bounds_miss_collector( "Cull:BSP:NetBoundsCache:Misses" );
+static PStatCollector net_bounds_xform_collector( "Cull:BSP:NetBoundsCache:XForm" );
 
 static const pvector<std::string> world_entities =
 {
@@ -116,7 +164,7 @@ bool BSPFaceAttrib::has_cull_callback() const
         return false;
 }
 
-CPT( RenderAttrib ) BSPFaceAttrib::make( const string &face_material, int face_type )
+CPT( RenderAttrib ) BSPFaceAttrib::make( const std::string &face_material, int face_type )
 {
         BSPFaceAttrib *attrib = new BSPFaceAttrib;
         attrib->_material = face_material;
@@ -174,7 +222,7 @@ size_t BSPFaceAttrib::get_hash_impl() const
 
 int BSPLoader::extract_modelnum_s( entity_t *ent )
 {
-        string model = ValueForKey( ent, "model" );
+        std::string model = ValueForKey( ent, "model" );
         if ( model[0] == '*' )
         {
                 return atoi( model.substr( 1 ).c_str() );
@@ -214,6 +262,7 @@ void GetParamsFromEnt( entity_t *mapent )
 NotifyCategoryDef( bspfile, "" );
 
 BSPLoader *BSPLoader::_global_ptr = nullptr;
+AtomicAdjust::Integer BSPLoader::_net_bounds_generation = 0;
 
 int BSPLoader::find_leaf( const LPoint3 &pos, int headnode )
 {
@@ -352,46 +401,6 @@ LTexCoord BSPLoader::get_lightcoords( int facenum, const LVector3 &point )
 	return lightcoord;
 }
 
-PT( EggVertex ) BSPLoader::make_vertex_ai( EggVertexPool *vpool, EggPolygon *poly, dedge_t *edge, int k )
-{
-        dvertex_t *vert = &_bspdata->dvertexes[edge->v[k]];
-        float *vpos = vert->point;
-        PT( EggVertex ) v = new EggVertex;
-        v->set_pos( LPoint3d( vpos[0], vpos[1], vpos[2] ) );
-        return v;
-}
-
-PT( EggVertex ) BSPLoader::make_vertex( EggVertexPool *vpool, EggPolygon *poly,
-                                        dedge_t *edge, texinfo_t *texinfo,
-                                        dface_t *face, int k, Texture *tex )
-{
-	int facenum = face - _bspdata->dfaces;
-        dvertex_t *vert = &_bspdata->dvertexes[edge->v[k]];
-        float *vpos = vert->point;
-        PT( EggVertex ) v = new EggVertex;
-        v->set_pos( LPoint3d( vpos[0], vpos[1], vpos[2] ) );
-
-        // The widths and heights are retrieved from the actual loaded textures that were referenced.
-        double df_width = 1.0;
-        double df_height = 1.0;
-        if ( tex != nullptr )
-        {
-                df_width = tex->get_orig_file_x_size();
-                df_height = tex->get_orig_file_y_size();
-        }
-
-        // Texture and lightmap coordinates
-        LTexCoord uv = get_vertex_uv( texinfo, vert );
-	LTexCoord luv = get_lightcoords( facenum, LVector3( vpos[0], vpos[1], vpos[2] ) );
-        LTexCoordd df_uv( uv.get_x() / df_width, -uv.get_y() / df_height );
-        LTexCoordd lm_uv( luv[0], luv[1] );
-
-        v->set_uv( df_uv );
-        v->set_uv( "lightmap", lm_uv );
-
-        return v;
-}
-
 CPT( BSPMaterial ) BSPLoader::try_load_texref( texref_t *tref )
 {
         if ( _texref_materials.find( tref ) != _texref_materials.end() )
@@ -399,7 +408,7 @@ CPT( BSPMaterial ) BSPLoader::try_load_texref( texref_t *tref )
                 return _texref_materials[tref];
         }
 
-        string name = tref->name;
+        std::string name = tref->name;
 
         CPT( BSPMaterial ) tex = BSPMaterial::get_from_file( name );
 
@@ -419,8 +428,8 @@ void BSPLoader::make_brush_model_collisions( int explicit_modelnum )
 	// Bullet rigid body node -> triangle index -> [material, modelnum]
 	BSPLoader::BSPCollisionData_t data;
 
-	typedef unordered_map<int, pvector<int>> model2faces;
-	unordered_map<int, model2faces> type2model2faces;
+	typedef std::unordered_map<int, pvector<int>> model2faces;
+	std::unordered_map<int, model2faces> type2model2faces;
 
 	std::ostringstream modelnums_ss;
 
@@ -572,14 +581,16 @@ NodePath BSPLoader::make_model_faces( int modelnum )
 	ss << "model-faces-" << modelnum;
 	NodePath ret( ss.str() );
 
+	PT( GeomNode ) gn = new GeomNode( "faces" );
+	ret.attach_new_node( gn );
+
+	// All faces of the model share one vertex data, with a Geom per face.
+	PT( GeomVertexData ) vdata = new GeomVertexData( "modelfaces", GeomVertexFormat::get_v3(), GeomEnums::UH_static );
+	GeomVertexWriter vwriter( vdata, InternalName::get_vertex() );
+	int num_rows = 0;
+
 	for ( int facenum = mdl->firstface; facenum < mdl->firstface + mdl->numfaces; facenum++ )
 	{
-		PT( EggData ) data = new EggData;
-		PT( EggVertexPool ) vpool = new EggVertexPool( "facevpool" );
-		data->add_child( vpool );
-
-		PT( EggPolygon ) poly = new EggPolygon;
-		data->add_child( poly );
 		dface_t *face = _bspdata->dfaces + facenum;
 		texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
 		texref_t *texref = &_bspdata->dtexrefs[texinfo->texref];
@@ -592,43 +603,53 @@ NodePath BSPLoader::make_model_faces( int modelnum )
 			continue;
 		}
 
+		if ( face->numedges < 3 )
+		{
+			continue;
+		}
+
+		int first_row = num_rows;
+		pvector<LPoint3> points;
+		points.reserve( face->numedges );
+
+		// BSP faces wind the other way from Panda.
 		for ( int j = face->numedges - 1; j >= 0; j-- )
 		{
 			int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
+			dedge_t *edge = &_bspdata->dedges[surf_edge >= 0 ? surf_edge : -surf_edge];
+			const float *vpos = _bspdata->dvertexes[edge->v[surf_edge >= 0 ? 0 : 1]].point;
+			points.push_back( LPoint3( vpos[0], vpos[1], vpos[2] ) );
+			vwriter.add_data3f( points.back() );
+			num_rows++;
+		}
 
-			dedge_t *edge;
-			int index;
-			if ( surf_edge >= 0 )
-			{
-				edge = &_bspdata->dedges[surf_edge];
-				index = 0;
-			}
-
-			else
-			{
-				edge = &_bspdata->dedges[-surf_edge];
-				index = 1;
-			}
+		// Newell's method.
+		LNormal norm( 0 );
+		for ( size_t j = 0; j < points.size(); j++ )
+		{
+			const LPoint3 &a = points[j];
+			const LPoint3 &b = points[( j + 1 ) % points.size()];
+			norm[0] += ( a[1] - b[1] ) * ( a[2] + b[2] );
+			norm[1] += ( a[2] - b[2] ) * ( a[0] + b[0] );
+			norm[2] += ( a[0] - b[0] ) * ( a[1] + b[1] );
+		}
 
-			PT( EggVertex ) v = make_vertex_ai( vpool, poly, edge, index );
-			vpool->add_vertex( v );
-			poly->add_vertex( v );
+		PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
+		for ( int j = 1; j < face->numedges - 1; j++ )
+		{
+			tris->add_vertices( first_row, first_row + j, first_row + j + 1 );
 		}
 
-		data->remove_unused_vertices( true );
-		data->remove_invalid_primitives( true );
+		PT( Geom ) geom = new Geom( vdata );
+		geom->add_primitive( tris );
 
-		LNormald norm;
-		poly->calculate_normal( norm );
+		norm.normalize();
 		int face_type = BSPFaceAttrib::FACETYPE_WALL;
-		if ( norm.almost_equal( LNormald::up(), 0.5 ) )
+		if ( norm.almost_equal( LNormal::up(), 0.5 ) )
 			face_type = BSPFaceAttrib::FACETYPE_FLOOR;
 
-		NodePath geom = ret.attach_new_node( load_egg_data( data ) );
-		geom.set_attrib( BSPFaceAttrib::make( bspmat->get_surface_prop(), face_type ) );
-		geom.set_attrib( BSPMaterialAttrib::make( bspmat ) );
-		geom.clear_model_nodes();
-		geom.flatten_strong();
+		gn->add_geom( geom, RenderState::make( BSPFaceAttrib::make( bspmat->get_surface_prop(), face_type ),
+						       BSPMaterialAttrib::make( bspmat ) ) );
 	}
 
 	return ret;
@@ -769,16 +790,423 @@ void BSPLoader::init_dface_lightmap_info( dface_lightmap_info_t *info, int facen
 	info->t_scale = info->texsize[1] * info->t_scale;
 }
 
+/**
+ * Returns the modification time of the indicated file, searched for along the
+ * model path, or 0 if it can't be found.
+ */
+static time_t get_file_timestamp( Filename file )
+{
+	VirtualFileSystem *vfs = VirtualFileSystem::get_global_ptr();
+	if ( !vfs->resolve_filename( file, get_model_path() ) )
+	{
+		return 0;
+	}
+
+	PT( VirtualFile ) vfile = vfs->get_file( file );
+	return vfile != nullptr ? vfile->get_timestamp() : 0;
+}
+
+/**
+ * Returns a string identifying everything the face geometry built by
+ * make_faces() depends on: the checksums of the lumps the vertices come from,
+ * where each face's lightmap landed in the palettes, the material and base
+ * texture files of each brush texture, and which faces were batched together.
+ * The lightmap info must already be initialized for every face.
+ */
+std::string BSPLoader::get_face_geometry_key( const pvector<facebatch_t> &batches ) const
+{
+	Datagram dg;
+	dg.add_uint8( face_geometry_cache_version );
+	dg.add_int32( _bspdata->numfaces );
+	dg.add_int32( _bspdata->dfaces_checksum );
+	dg.add_int32( _bspdata->dvertexes_checksum );
+	dg.add_int32( _bspdata->dedges_checksum );
+	dg.add_int32( _bspdata->dsurfedges_checksum );
+	dg.add_int32( _bspdata->texinfo_checksum );
+	dg.add_int32( _bspdata->dtexrefs_checksum );
+	dg.add_int32( FastChecksum( _bspdata->vertnormals.data(),
+				    _bspdata->vertnormals.size() * sizeof( dvertex_t ) ) );
+	dg.add_int32( FastChecksum( _bspdata->vertnormalindices.data(),
+				    _bspdata->vertnormalindices.size() * sizeof( unsigned short ) ) );
+
+	for ( int facenum = 0; facenum < _bspdata->numfaces; facenum++ )
+	{
+		const dface_lightmap_info_t &lminfo = _face_lightmap_info[facenum];
+		dg.add_bool( lminfo.flipped );
+		dg.add_stdfloat( lminfo.s_scale );
+		dg.add_stdfloat( lminfo.s_offset );
+		dg.add_stdfloat( lminfo.t_scale );
+		dg.add_stdfloat( lminfo.t_offset );
+	}
+
+	// The material decides whether a face gets geometry at all, and the texture
+	// coordinates are normalized by the size of its base texture.  Both are
+	// keyed on their files, so a cache hit never has to load the textures.
+	for ( int i = 0; i < _bspdata->numtexrefs; i++ )
+	{
+		Filename mat_file = std::string( _bspdata->dtexrefs[i].name );
+		dg.add_int64( get_file_timestamp( mat_file ) );
+
+		CPT( BSPMaterial ) bspmat = BSPMaterial::get_from_file( mat_file );
+		dg.add_int32( bspmat != nullptr ? ContentsFromName( bspmat->get_contents().c_str() ) : 0 );
+		if ( bspmat == nullptr || !bspmat->has_keyvalue( "$basetexture" ) )
+		{
+			dg.add_string( "" );
+			dg.add_int64( 0 );
+			continue;
+		}
+
+		Filename tex_file = bspmat->get_keyvalue( "$basetexture" );
+		dg.add_string( tex_file.get_fullpath() );
+		dg.add_int64( get_file_timestamp( tex_file ) );
+	}
+
+	for ( size_t i = 0; i < batches.size(); i++ )
+	{
+		dg.add_uint32( batches[i].faces.size() );
+		for ( size_t j = 0; j < batches[i].faces.size(); j++ )
+		{
+			dg.add_int32( batches[i].faces[j] );
+		}
+	}
+
+	std::ostringstream ss;
+	ss << std::hex << (unsigned int)FastChecksum( dg.get_data(), dg.get_length() )
+		<< "-" << std::dec << dg.get_length();
+	return ss.str();
+}
+
+/**
+ * Looks for face geometry of the current level in the model cache that was
+ * built with the indicated key.  On success, fills in batch_nodes with one
+ * GeomNode per face batch, as they came out of build_face_geoms(), and returns
+ * true.
+ */
+bool BSPLoader::read_face_geometry_cache( const std::string &key, size_t num_batches,
+					  pvector<PT( GeomNode )> &batch_nodes )
+{
+	BamCache *cache = BamCache::get_global_ptr();
+	if ( !bsp_geometry_cache || !cache->get_active() || !cache->get_cache_models() )
+	{
+		return false;
+	}
+
+	PT( BamCacheRecord ) record = cache->lookup( _map_file, "bspgeom" );
+	if ( record == nullptr || !record->has_data() ||
+	     !record->get_data()->is_of_type( PandaNode::get_class_type() ) )
+	{
+		return false;
+	}
+
+	PandaNode *root = DCAST( PandaNode, record->get_data() );
+	if ( root->get_tag( "key" ) != key || root->get_num_children() != (int)num_batches )
+	{
+		bspfile_cat.info()
+			<< "Cached face geometry for " << _map_file << " is out of date\n";
+		return false;
+	}
+
+	batch_nodes.resize( num_batches );
+	for ( size_t i = 0; i < num_batches; i++ )
+	{
+		PandaNode *child = root->get_child( i );
+		if ( !child->is_geom_node() )
+		{
+			batch_nodes.clear();
+			return false;
+		}
+		batch_nodes[i] = DCAST( GeomNode, child );
+	}
+	root->remove_all_children();
+
+	return true;
+}
+
+/**
+ * Stores the face geometry built by make_faces() in the model cache, so the
+ * next load of this level doesn't have to build it again.
+ */
+void BSPLoader::write_face_geometry_cache( const std::string &key, const pvector<PT( GeomNode )> &batch_nodes )
+{
+	BamCache *cache = BamCache::get_global_ptr();
+	if ( !bsp_geometry_cache || !cache->get_active() || !cache->get_cache_models() )
+	{
+		return;
+	}
+
+	PT( BamCacheRecord ) record = cache->lookup( _map_file, "bspgeom" );
+	if ( record == nullptr )
+	{
+		return;
+	}
+
+	PT( PandaNode ) root = new PandaNode( "face-geometry" );
+	root->set_tag( "key", key );
+	for ( size_t i = 0; i < batch_nodes.size(); i++ )
+	{
+		root->add_child( batch_nodes[i] );
+	}
+
+	record->set_data( root );
+	cache->store( record );
+}
+
+/**
+ * Returns the vertex format of renderable brush faces.
+ */
+static const GeomVertexFormat *get_face_vertex_format()
+{
+	static CPT( GeomVertexFormat ) format = nullptr;
+	if ( format == nullptr )
+	{
+		PT( GeomVertexArrayFormat ) array = new GeomVertexArrayFormat;
+		array->add_column( InternalName::get_vertex(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_point );
+		array->add_column( InternalName::get_normal(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_normal );
+		array->add_column( InternalName::get_texcoord(), 2, GeomEnums::NT_stdfloat, GeomEnums::C_texcoord );
+		array->add_column( InternalName::get_texcoord_name( "lightmap" ), 2, GeomEnums::NT_stdfloat, GeomEnums::C_texcoord );
+		array->add_column( InternalName::get_tangent(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+		array->add_column( InternalName::get_binormal(), 3, GeomEnums::NT_stdfloat, GeomEnums::C_vector );
+		format = GeomVertexFormat::register_format( array );
+	}
+	return format;
+}
+
+/**
+ * Computes the s and t directions of a face's texture mapping from the first
+ * non-degenerate triangle of its fan.  Brush faces are planar and mapped
+ * linearly, so one triangle describes the whole face.
+ */
+static void calc_face_tangent_basis( const LVector3 *positions, const LTexCoord *uvs, int count,
+				     LVector3 &sdir, LVector3 &tdir )
+{
+	for ( int i = 2; i < count; i++ )
+	{
+		LVector3 e1 = positions[i - 1] - positions[0];
+		LVector3 e2 = positions[i] - positions[0];
+		LVector2 d1 = uvs[i - 1] - uvs[0];
+		LVector2 d2 = uvs[i] - uvs[0];
+
+		float r = d1[0] * d2[1] - d2[0] * d1[1];
+		if ( fabsf( r ) < 1e-8f )
+			continue;
+
+		r = 1.0f / r;
+		sdir = ( e1 * d2[1] - e2 * d1[1] ) * r;
+		tdir = ( e2 * d1[0] - e1 * d2[0] ) * r;
+		return;
+	}
+
+	sdir = LVector3::right();
+	tdir = LVector3::forward();
+}
+
+/**
+ * Orthogonalizes each vertex's face s direction against the vertex normal to
+ * get the tangent, and derives the binormal from the normal and tangent,
+ * flipped where the texture is mirrored.  Works on four vertices at a time.
+ */
+static void calc_vertex_tangents( const LVector3 *normals, const LVector3 *sdirs, const LVector3 *tdirs,
+				  LVector3 *tangents, LVector3 *binormals, size_t count )
+{
+	for ( size_t i = 0; i < count; i += 4 )
+	{
+		size_t n = std::min( count - i, (size_t)4 );
+
+		FourVectors norm, sdir, tdir;
+		for ( size_t k = 0; k < 4; k++ )
+		{
+			// Pad the last group out with copies of its last vertex.
+			size_t idx = i + std::min( k, n - 1 );
+			norm.X( k ) = normals[idx][0];
+			norm.Y( k ) = normals[idx][1];
+			norm.Z( k ) = normals[idx][2];
+			sdir.X( k ) = sdirs[idx][0];
+			sdir.Y( k ) = sdirs[idx][1];
+			sdir.Z( k ) = sdirs[idx][2];
+			tdir.X( k ) = tdirs[idx][0];
+			tdir.Y( k ) = tdirs[idx][1];
+			tdir.Z( k ) = tdirs[idx][2];
+		}
+
+		FourVectors proj = norm;
+		proj *= norm * sdir;
+		FourVectors tangent = sdir;
+		tangent -= proj;
+		tangent.VectorNormalize();
+
+		FourVectors binormal = norm ^ tangent;
+		fltx4 mirrored = CmpLtSIMD( ( norm ^ sdir ) * tdir, Four_Zeros );
+		binormal.x = MaskedAssign( mirrored, NegSIMD( binormal.x ), binormal.x );
+		binormal.y = MaskedAssign( mirrored, NegSIMD( binormal.y ), binormal.y );
+		binormal.z = MaskedAssign( mirrored, NegSIMD( binormal.z ), binormal.z );
+
+		for ( size_t k = 0; k < n; k++ )
+		{
+			tangents[i + k] = tangent.Vec( k );
+			binormals[i + k] = binormal.Vec( k );
+		}
+	}
+}
+
+/**
+ * Writes the renderable geometry of the indicated faces straight into vertex
+ * data that is shared by all of them, and adds one Geom per face to the
+ * GeomNode, so world faces can still be culled per leaf.  The Geoms are added
+ * with an empty state.
+ */
+void BSPLoader::build_face_geoms( const vector_int &faces, const vector_int &face_vertnormalindices, GeomNode *gn )
+{
+	size_t num_verts = 0;
+	for ( size_t i = 0; i < faces.size(); i++ )
+	{
+		num_verts += _bspdata->dfaces[faces[i]].numedges;
+	}
+
+	pvector<LVector3> positions, normals, sdirs, tdirs, tangents, binormals;
+	pvector<LTexCoord> uvs, lmuvs;
+	positions.reserve( num_verts );
+	normals.reserve( num_verts );
+	uvs.reserve( num_verts );
+	lmuvs.reserve( num_verts );
+	sdirs.reserve( num_verts );
+	tdirs.reserve( num_verts );
+
+	// The base texture size of each texref, for normalizing texture coordinates.
+	pmap<int, LVecBase2> texref_sizes;
+
+	for ( size_t i = 0; i < faces.size(); i++ )
+	{
+		int facenum = faces[i];
+		dface_t *face = &_bspdata->dfaces[facenum];
+		texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
+
+		auto itr = texref_sizes.find( texinfo->texref );
+		if ( itr == texref_sizes.end() )
+		{
+			// The widths and heights are retrieved from the actual loaded textures that were referenced.
+			LVecBase2 size( 1.0 );
+			CPT( BSPMaterial ) bspmat = BSPMaterial::get_from_file( std::string( _bspdata->dtexrefs[texinfo->texref].name ) );
+			if ( bspmat->has_keyvalue( "$basetexture" ) )
+			{
+				Texture *tex = TexturePool::load_texture( bspmat->get_keyvalue( "$basetexture" ) );
+				if ( tex != nullptr )
+					size.set( tex->get_orig_file_x_size(), tex->get_orig_file_y_size() );
+			}
+			itr = texref_sizes.insert( pmap<int, LVecBase2>::value_type( texinfo->texref, size ) ).first;
+		}
+		const LVecBase2 &texsize = itr->second;
+
+		size_t first = positions.size();
+
+		// BSP faces wind the other way from Panda.
+		for ( int j = face->numedges - 1; j >= 0; j-- )
+		{
+			int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
+			dedge_t *edge = &_bspdata->dedges[surf_edge >= 0 ? surf_edge : -surf_edge];
+			dvertex_t *vert = &_bspdata->dvertexes[edge->v[surf_edge >= 0 ? 0 : 1]];
+			LVector3 pos( vert->point[0], vert->point[1], vert->point[2] );
+
+			LVector3 normal( 0 );
+			if ( face_vertnormalindices[facenum] != -1 )
+			{
+				int vert_normal_idx = face_vertnormalindices[facenum] + j;
+				const float *n = _bspdata->vertnormals[_bspdata->vertnormalindices[vert_normal_idx]].point;
+				normal.set( n[0], n[1], n[2] );
+			}
+
+			LTexCoord uv = get_vertex_uv( texinfo, vert );
+
+			positions.push_back( pos );
+			normals.push_back( normal );
+			uvs.push_back( LTexCoord( uv[0] / texsize[0], -uv[1] / texsize[1] ) );
+			lmuvs.push_back( get_lightcoords( facenum, pos ) );
+		}
+
+		LVector3 sdir, tdir;
+		calc_face_tangent_basis( positions.data() + first, uvs.data() + first, face->numedges, sdir, tdir );
+		sdirs.resize( positions.size(), sdir );
+		tdirs.resize( positions.size(), tdir );
+	}
+
+	tangents.resize( num_verts );
+	binormals.resize( num_verts );
+	calc_vertex_tangents( normals.data(), sdirs.data(), tdirs.data(),
+			      tangents.data(), binormals.data(), num_verts );
+
+	size_t vertex = 0;
+	size_t i = 0;
+	while ( i < faces.size() )
+	{
+		// Faces share vertex datas of up to 64k vertices, to keep 16-bit indices.
+		size_t end = i;
+		int rows = 0;
+		while ( end < faces.size() &&
+			( end == i || rows + _bspdata->dfaces[faces[end]].numedges <= 0xffff ) )
+		{
+			rows += _bspdata->dfaces[faces[end]].numedges;
+			end++;
+		}
+
+		PT( GeomVertexData ) vdata = new GeomVertexData( "brushfaces", get_face_vertex_format(), GeomEnums::UH_static );
+		vdata->unclean_set_num_rows( rows );
+		GeomVertexWriter vwriter( vdata, InternalName::get_vertex() );
+		GeomVertexWriter nwriter( vdata, InternalName::get_normal() );
+		GeomVertexWriter twriter( vdata, InternalName::get_texcoord() );
+		GeomVertexWriter lwriter( vdata, InternalName::get_texcoord_name( "lightmap" ) );
+		GeomVertexWriter tanwriter( vdata, InternalName::get_tangent() );
+		GeomVertexWriter binwriter( vdata, InternalName::get_binormal() );
+
+		int row = 0;
+		for ( ; i < end; i++ )
+		{
+			int numedges = _bspdata->dfaces[faces[i]].numedges;
+			int first_row = row;
+
+			for ( int j = 0; j < numedges; j++, vertex++ )
+			{
+				vwriter.set_data3f( positions[vertex] );
+				nwriter.set_data3f( normals[vertex] );
+				twriter.set_data2f( uvs[vertex] );
+				lwriter.set_data2f( lmuvs[vertex] );
+				tanwriter.set_data3f( tangents[vertex] );
+				binwriter.set_data3f( binormals[vertex] );
+			}
+			row += numedges;
+
+			if ( numedges < 3 )
+			{
+				continue;
+			}
+
+			// Brush faces are convex, so a fan covers them.
+			PT( GeomTriangles ) tris = new GeomTriangles( GeomEnums::UH_static );
+			for ( int j = 1; j < numedges - 1; j++ )
+			{
+				tris->add_vertices( first_row, first_row + j, first_row + j + 1 );
+			}
+
+			PT( Geom ) geom = new Geom( vdata );
+			geom->add_primitive( tris );
+			geom->set_bounds_type( BoundingVolume::BT_box );
+			gn->add_geom( geom );
+		}
+	}
+}
+
 void BSPLoader::make_faces()
 {
         bspfile_cat.info()
                 << "Making faces...\n";
 
 	_face_lightmap_info.resize( _bspdata->numfaces );
+	for ( int facenum = 0; facenum < _bspdata->numfaces; facenum++ )
+	{
+		init_dface_lightmap_info( &_face_lightmap_info[facenum], facenum );
+	}
 
         // build table of per-face beginning index into vertnormalindices
-        int face_vertnormalindices[MAX_MAP_FACES];
-        memset( face_vertnormalindices, -1, sizeof( int ) * MAX_MAP_FACES );
+        vector_int face_vertnormalindices;
+        face_vertnormalindices.resize( _bspdata->numfaces, -1 );
         int normal_index = 0;
         for ( int i = 0; i < _bspdata->numfaces; i++ )
         {
@@ -788,6 +1216,12 @@ void BSPLoader::make_faces()
 
 	_model_data.resize( _bspdata->nummodels );
 
+	// Faces of the same model that render with the same state are built
+	// together.  Batches are kept in the order they are first seen, so they
+	// line up with the geometry cache.
+	pvector<facebatch_t> batches;
+	pmap<std::pair<int, const RenderState *>, size_t> batch_index;
+
         // In BSP files, models are brushes that have been grouped together to be used as an entity.
         // We can group all of the face GeomNodes of the model to a root node.
         for ( int modelnum = 0; modelnum < _bspdata->nummodels; modelnum++ )
@@ -823,16 +1257,9 @@ void BSPLoader::make_faces()
 
                 for ( int facenum = firstface; facenum < firstface + numfaces; facenum++ )
                 {
-                        PT( EggData ) data = new EggData;
-                        PT( EggVertexPool ) vpool = new EggVertexPool( "facevpool" );
-                        data->add_child( vpool );
-
                         dface_t *face = &_bspdata->dfaces[facenum];
 			_dface_dmodels[face] = model;
 
-                        PT( EggPolygon ) poly = new EggPolygon;
-                        data->add_child( poly );
-
                         texinfo_t *texinfo = &_bspdata->texinfo[face->texinfo];
 
                         texref_t *texref = &_bspdata->dtexrefs[texinfo->texref];
@@ -855,149 +1282,130 @@ void BSPLoader::make_faces()
                                 continue;
                         }
 
-                        bool skip = false;
-
-                        bool mat_normalmap = bspmat->has_keyvalue( "$bumpmap" );
-
-                        bool has_lighting = ( face->lightofs != -1 && _want_lightmaps ) && !skip && bspmat->get_shader() == "LightmappedGeneric";
+                        bool has_lighting = ( face->lightofs != -1 && _want_lightmaps ) && bspmat->get_shader() == "LightmappedGeneric";
                         if ( has_lighting &&
                              bspmat->has_keyvalue( "$lightmapped" ) &&
                              atoi( bspmat->get_keyvalue( "$lightmapped" ).c_str() ) == 0 )
                         {
                                 has_lighting = false;
                         }
-                                
-                        bool has_texture = !skip;
-
-                        // HACKHACK:
-                        // Read the material's $basetexture and alpha to determine
-                        // if a TransparencyAttrib is needed, and to get the size of the
-                        // texture for brush face texcoords
-                        PT( Texture ) tex = nullptr;
-                        if ( bspmat->has_keyvalue( "$basetexture" ) )
-                        {
-                                tex = TexturePool::load_texture( bspmat->get_keyvalue( "$basetexture" ) );
-                        }
-                        bool has_transparency = bspmat->has_transparency();
-
-			dface_lightmap_info_t lminfo;
-			init_dface_lightmap_info( &lminfo, facenum );
-			_face_lightmap_info[facenum] = lminfo;
-                        LVertexd centroid( 0 );
-                        int verts = 0;
-
-                        for ( int j = face->numedges - 1; j >= 0; j-- )
-                        {
-                                LNormald normal( 0 );
-                                if ( face_vertnormalindices[facenum] != -1 )
-                                {
-                                        int vert_normal_idx = face_vertnormalindices[facenum] + j;
-                                        vec3_t normalf_v;
-                                        VectorCopy( _bspdata->vertnormals[_bspdata->vertnormalindices[vert_normal_idx]].point, normalf_v );
-                                        normal = LNormald( normalf_v[0], normalf_v[1], normalf_v[2] );
-                                }
-
-                                int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
-                                dedge_t *edge;
-				int index;
-				if ( surf_edge >= 0 )
-				{
-					edge = &_bspdata->dedges[surf_edge];
-					index = 0;
-				}   
-				else
-				{
-					edge = &_bspdata->dedges[-surf_edge];
-					index = 1;
-				}
-
-				PT( EggVertex ) v = make_vertex( vpool, poly, edge, texinfo,
-					face, index, tex );
-				v->set_normal( normal );
-				vpool->add_vertex( v );
-				poly->add_vertex( v );
-				centroid += v->get_pos3();
-				verts++;
-                        }
-
-                        data->remove_unused_vertices( true );
-                        data->remove_invalid_primitives( true );
 
-                        centroid /= verts;
+			const dface_lightmap_info_t &lminfo = _face_lightmap_info[facenum];
 
-                        data->recompute_tangent_binormal( GlobPattern( "*" ) );
+			CPT( RenderState ) state = RenderState::make_empty();
+			CPT( TextureAttrib ) texattr = DCAST( TextureAttrib, TextureAttrib::make() );
 
-                        NodePath faceroot = _result.attach_new_node( load_egg_data( data ) );
-
-                        if ( has_transparency )
+                        if ( bspmat->has_transparency() )
                         {
-                                faceroot.set_transparency( TransparencyAttrib::M_dual, 1 );
+                                state = state->set_attrib( TransparencyAttrib::make( TransparencyAttrib::M_dual ), 1 );
                         }  
 
 			if ( ( contents & CONTENTS_SKY ) != 0 )
 			{
 				// Draw 2D skybox faces first, and don't write depth
-				faceroot.set_bin( "background", 0 );
-				faceroot.set_depth_write( false );
+				state = state->set_attrib( CullBinAttrib::make( "background", 0 ) );
+				state = state->set_attrib( DepthWriteAttrib::make( DepthWriteAttrib::M_off ) );
 			}
 
                         if ( has_lighting )
                         {
                                 if ( face->bumped_lightmap && bspmat->has_keyvalue( "$bumpmap" ) )
                                 {
-					faceroot.set_texture( TextureStages::get_bumped_lightmap(),
-						lminfo.palette_entry->palette->palette_tex );
+					texattr = DCAST( TextureAttrib, texattr->add_on_stage( TextureStages::get_bumped_lightmap(),
+						lminfo.palette_entry->palette->palette_tex ) );
                                 }
                                 else
                                 {
-                                        faceroot.set_texture( TextureStages::get_lightmap(),
-						lminfo.palette_entry->palette->palette_tex );
+					texattr = DCAST( TextureAttrib, texattr->add_on_stage( TextureStages::get_lightmap(),
+						lminfo.palette_entry->palette->palette_tex ) );
                                 }
                         }
 
-                        faceroot.wrt_reparent_to( modelroot );
-
                         if ( bspmat->has_keyvalue( "$envmap" ) )
                         {
-                                PT( Texture ) etex = nullptr;
                                 std::string envmap = bspmat->get_keyvalue( "$envmap" );
                                 if ( envmap == "env_cubemap" )
                                 {
                                         // material wants us to use a cubemap_tex embedded in the level.
                                         // find the closest one to the center of the face.
+					LPoint3 centroid( 0 );
+					for ( int j = 0; j < face->numedges; j++ )
+					{
+						int surf_edge = _bspdata->dsurfedges[face->firstedge + j];
+						const dedge_t *edge = &_bspdata->dedges[surf_edge >= 0 ? surf_edge : -surf_edge];
+						const float *vpos = _bspdata->dvertexes[edge->v[surf_edge >= 0 ? 0 : 1]].point;
+						centroid += LVector3( vpos[0], vpos[1], vpos[2] );
+					}
+					centroid /= face->numedges;
                                         centroid /= 16.0; // move from hammer space into panda space
-                                        cubemap_t *cm = find_closest_cubemap(
-                                                LPoint3( centroid[0], centroid[1], centroid[2] ) );
+                                        cubemap_t *cm = find_closest_cubemap( centroid );
                                         if ( cm )
                                         {
-                                                faceroot.set_texture( TextureStages::get_cubemap(),
-                                                                      cm->cubemap_tex );
+						texattr = DCAST( TextureAttrib, texattr->add_on_stage( TextureStages::get_cubemap(),
+							cm->cubemap_tex ) );
                                         }
                                 }
                         }
 
-                        faceroot.set_attrib( BSPMaterialAttrib::make( bspmat ) );
+			if ( texattr->get_num_on_stages() != 0 )
+			{
+				state = state->set_attrib( texattr );
+			}
 
-                        NodePathCollection gn_npc = faceroot.find_all_matches( "**/+GeomNode" );
-                        for ( int i = 0; i < gn_npc.get_num_paths(); i++ )
-                        {
-                                NodePath gnnp = gn_npc.get_path( i );
-                                PT( GeomNode ) gn = DCAST( GeomNode, gnnp.node() );
-                                for ( int j = 0; j < gn->get_num_geoms(); j++ )
-                                {
-                                        PT( Geom ) geom = gn->modify_geom( j );
-                                        geom->set_bounds_type( BoundingVolume::BT_box );
-                                        gn->set_geom( j, geom );
-                                }
-                        }
+			state = state->set_attrib( BSPMaterialAttrib::make( bspmat ) );
 
-                        if ( skip )
-                        {
-                                faceroot.hide();
-                        }
+			std::pair<int, const RenderState *> key( modelnum, state.p() );
+			auto itr = batch_index.find( key );
+			if ( itr == batch_index.end() )
+			{
+				itr = batch_index.insert( std::make_pair( key, batches.size() ) ).first;
+				facebatch_t batch;
+				batch.modelnum = modelnum;
+				batch.state = state;
+				batches.push_back( batch );
+			}
+			batches[itr->second].faces.push_back( facenum );
                 }
         }
 
+	std::string cache_key = get_face_geometry_key( batches );
+	pvector<PT( GeomNode )> batch_nodes;
+	if ( read_face_geometry_cache( cache_key, batches.size(), batch_nodes ) )
+	{
+		bspfile_cat.info()
+			<< "Using cached face geometry\n";
+	}
+	else
+	{
+		batch_nodes.resize( batches.size() );
+		for ( size_t i = 0; i < batches.size(); i++ )
+		{
+			batch_nodes[i] = new GeomNode( "brushfaces" );
+			build_face_geoms( batches[i].faces, face_vertnormalindices, batch_nodes[i] );
+		}
+
+		write_face_geometry_cache( cache_key, batch_nodes );
+	}
+
+	// Each model gets one GeomNode with a Geom for each of its faces.
+	pvector<PT( GeomNode )> model_nodes( _bspdata->nummodels );
+	for ( size_t i = 0; i < batches.size(); i++ )
+	{
+		const facebatch_t &batch = batches[i];
+		PT( GeomNode ) &gn = model_nodes[batch.modelnum];
+		if ( gn == nullptr )
+		{
+			gn = new GeomNode( "brushfaces" );
+			_model_data[batch.modelnum].model_root.attach_new_node( gn );
+		}
+
+		GeomNode *batch_node = batch_nodes[i];
+		for ( int j = 0; j < batch_node->get_num_geoms(); j++ )
+		{
+			gn->add_geom( batch_node->modify_geom( j ), batch.state );
+		}
+	}
+
         bspfile_cat.info()
                 << "Finished making faces.\n";
 }
@@ -1011,7 +1419,7 @@ LColor color_from_rgb_scalar( vec_t *color )
                        1.0 );
 }
 
-LColor color_from_value( const string &value, bool scale, bool gamma )
+LColor color_from_value( const std::string &value, bool scale, bool gamma )
 {
         double r, g, b, s;
         sscanf( value.c_str(), "%lf %lf %lf %lf", &r, &g, &b, &s );
@@ -1291,8 +1699,8 @@ void BSPLoader::load_static_props()
                                                                 continue;
                                                         }
                                                         Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                        if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                             tex->get_name().find( "drop-shadow" ) != string::npos )
+                                                        if ( tex->get_name().find( "square_drop_shadow" ) != std::string::npos ||
+                                                             tex->get_name().find( "drop-shadow" ) != std::string::npos )
                                                         {
                                                                 // don't apply vertex lighting to a shadow model
                                                                 shadow_skip = true;
@@ -1366,8 +1774,8 @@ void BSPLoader::load_static_props()
                                                         continue;
                                                 }
                                                 Texture *tex = tattr->get_on_texture( tattr->get_on_stage( 0 ) );
-                                                if ( tex->get_name().find( "square_drop_shadow" ) != string::npos ||
-                                                     tex->get_name().find( "drop-shadow" ) != string::npos )
+                                                if ( tex->get_name().find( "square_drop_shadow" ) != std::string::npos ||
+                                                     tex->get_name().find( "drop-shadow" ) != std::string::npos )
                                                 {
                                                         np.remove_node();
                                                 }
@@ -1473,38 +1881,113 @@ bool BSPLoader::is_cluster_visible( int curr_cluster, int cluster ) const
         return dat != 0;
 }
 
-void BSPLoader::update_leaf( int leaf )
+void BSPLoader::add_visible_leaf( visdata_t *vis, int leaf )
 {
-	LightMutexHolder holder( _leaf_aabb_lock );
-
-	_curr_leaf_idx = leaf;
-	_visible_leaf_bboxs.clear();
-	_visible_leafs.clear();
-
-	// Add ourselves to the visible list.
-	_visible_leaf_bboxs.push_back( { _leaf_bboxs[leaf], _bspdata->dleafs[leaf].flags } );
-	_visible_leafs.push_back( leaf );
-
-	if ( _vis_leafs )
+	const BoundingBox *bbox = _leaf_bboxs[leaf];
+	const LPoint3 &mins = bbox->get_minq();
+	const LPoint3 &maxs = bbox->get_maxq();
+	for ( int i = 0; i < 3; i++ )
 	{
-		_leaf_visnp[leaf].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+		vis->visible_leaf_mins[i].push_back( mins[i] );
+		vis->visible_leaf_maxs[i].push_back( maxs[i] );
 	}
+	vis->visible_leaf_flags.push_back( _bspdata->dleafs[leaf].flags );
+	vis->visible_leafs.push_back( leaf );
+}
 
-	for ( int i = 1; i < _bspdata->dmodels[0].visleafs + 1; i++ )
+/**
+ * Recomputes the bounds and flags of the visible leafs below the indicated
+ * node, and of every node below it.
+ */
+void BSPLoader::update_node_vis( visdata_t *vis, int nodenum )
+{
+	nodevisdata_t &nvis = vis->node_vis[nodenum];
+	nvis.mins.set( FLT_MAX, FLT_MAX, FLT_MAX );
+	nvis.maxs.set( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	nvis.flags = 0;
+	nvis.visible = false;
+
+	const dnode_t *node = &_bspdata->dnodes[nodenum];
+	for ( int i = 0; i < 2; i++ )
 	{
-		if ( i == leaf )
+		int child = node->children[i];
+		LPoint3 child_mins, child_maxs;
+		int child_flags;
+
+		if ( child >= 0 )
 		{
-			continue;
+			update_node_vis( vis, child );
+			const nodevisdata_t &cvis = vis->node_vis[child];
+			if ( !cvis.visible )
+				continue;
+			child_mins = cvis.mins;
+			child_maxs = cvis.maxs;
+			child_flags = cvis.flags;
 		}
-		const dleaf_t *pleaf = &_bspdata->dleafs[i];
-		if ( is_cluster_visible( leaf, i ) )
+		else
 		{
-			if ( _vis_leafs )
+			int leaf = -1 - child;
+			if ( leaf < 1 || leaf > _bspdata->dmodels[0].visleafs ||
+			     ( leaf != vis->leaf && !is_cluster_visible( vis->leaf, leaf ) ) )
+				continue;
+			child_mins = _leaf_bboxs[leaf]->get_minq();
+			child_maxs = _leaf_bboxs[leaf]->get_maxq();
+			child_flags = _bspdata->dleafs[leaf].flags;
+		}
+
+		for ( int j = 0; j < 3; j++ )
+		{
+			nvis.mins[j] = std::min( nvis.mins[j], child_mins[j] );
+			nvis.maxs[j] = std::max( nvis.maxs[j], child_maxs[j] );
+		}
+		nvis.flags |= child_flags;
+		nvis.visible = true;
+	}
+}
+
+/**
+ * Publishes the indicated visibility snapshot, so the cull traversals start
+ * reading it instead of the previous one.  The caller must be holding
+ * _leaf_aabb_lock.
+ */
+void BSPLoader::publish_visdata( visdata_t *vis )
+{
+	// Cull traversals that are still reading the previous snapshot hold
+	// their own reference to it.
+	LightMutexHolder holder( _visdata_lock );
+	_curr_visdata = vis;
+}
+
+void BSPLoader::update_leaf( int leaf )
+{
+	LightMutexHolder holder( _leaf_aabb_lock );
+
+	_curr_leaf_idx = leaf;
+
+	PT( visdata_t ) vis = new visdata_t;
+	vis->leaf = leaf;
+
+	// Add ourselves to the visible list.
+	add_visible_leaf( vis, leaf );
+
+	if ( _vis_leafs )
+	{
+		_leaf_visnp[leaf].set_color_scale( LColor( 0, 1, 0, 1 ), 1 );
+	}
+
+	for ( int i = 1; i < _bspdata->dmodels[0].visleafs + 1; i++ )
+	{
+		if ( i == leaf )
+		{
+			continue;
+		}
+		if ( is_cluster_visible( leaf, i ) )
+		{
+			if ( _vis_leafs )
 			{
 				_leaf_visnp[i].set_color_scale( LColor( 0, 0, 1, 1 ), 1 );
 			}
-			_visible_leaf_bboxs.push_back( { _leaf_bboxs[i], pleaf->flags } );
-			_visible_leafs.push_back( i );
+			add_visible_leaf( vis, i );
 		}
 		else
 		{
@@ -1514,6 +1997,31 @@ void BSPLoader::update_leaf( int leaf )
 			}
 		}
 	}
+
+	// Pad with inside-out boxes that can't intersect anything.
+	while ( vis->visible_leaf_flags.size() & 3 )
+	{
+		for ( int i = 0; i < 3; i++ )
+		{
+			vis->visible_leaf_mins[i].push_back( FLT_MAX );
+			vis->visible_leaf_maxs[i].push_back( -FLT_MAX );
+		}
+		vis->visible_leaf_flags.push_back( 0 );
+	}
+
+	vis->node_vis.resize( _bspdata->numnodes );
+	if ( _bspdata->numnodes > 0 )
+	{
+		update_node_vis( vis, _bspdata->dmodels[0].headnode[0] );
+	}
+
+	vis->has_world_geoms = leaf >= 0 && leaf < (int)_leaf_world_geoms.size();
+	if ( vis->has_world_geoms )
+	{
+		vis->world_geoms = _leaf_world_geoms[leaf];
+	}
+
+	publish_visdata( vis );
 }
 
 void BSPLoader::update_visibility( const LPoint3 &pos )
@@ -1539,10 +2047,10 @@ void BSPLoader::read_materials_file()
         {
                 return;
         }
-        string data = vfs->read_file( _materials_file, true );
+        std::string data = vfs->read_file( _materials_file, true );
 
-        string texname = "";
-        string material = "";
+        std::string texname = "";
+        std::string material = "";
         bool in_texname = true;
 
         for ( size_t i = 0; i < data.length(); i++ )
@@ -1623,32 +2131,57 @@ bool BSPLoader::read( const Filename &file, bool is_transition )
                 << "Reading " << file.get_fullpath() << "...\n";
         nassertr( vfs->exists( file ), false );
 
-        string data;
-        nassertr( vfs->read_file( file, data, true ), false );
-        int length = data.length();
-        char *buffer = new char[length + 1];
-        memcpy( buffer, data.c_str(), length );
-        _bspdata = LoadBSPImage( (dheader_t *)buffer );
+        _bspdata = nullptr;
+
+        if ( bsp_mmap_load )
+        {
+                // If the file lives on disk, or uncompressed inside of a multifile,
+                // map it directly instead of reading it all into memory.
+                PT( VirtualFile ) vfile = vfs->get_file( file );
+                SubfileInfo info;
+                if ( vfile != nullptr && vfile->get_system_info( info ) && !info.is_empty() )
+                {
+                        _bspdata = LoadBSPFileMapped( info.get_filename().to_os_specific().c_str(),
+                                                      (size_t)info.get_start(), (size_t)info.get_size() );
+                }
+
+                if ( _bspdata == nullptr && bspfile_cat.is_debug() )
+                {
+                        bspfile_cat.debug()
+                                << "Couldn't map " << file.get_fullpath() << ", reading it instead\n";
+                }
+        }
+
+        if ( _bspdata == nullptr )
+        {
+                std::string data;
+                nassertr( vfs->read_file( file, data, true ), false );
+                int length = data.length();
+                char *buffer = new char[length + 1];
+                memcpy( buffer, data.c_str(), length );
+                _bspdata = LoadBSPImage( (dheader_t *)buffer );
+        }
 
         _map_file = file;
 
         ParseEntities( _bspdata );
 
         _leaf_aabb_lock.acquire();
-	_leaf_pvs.resize( MAX_MAP_LEAFS );
+	_leaf_pvs.resize( _bspdata->numleafs );
 	_has_pvs_data = false;
-        _leaf_bboxs.resize( MAX_MAP_LEAFS );
+        _leaf_bboxs.resize( _bspdata->numleafs );
         // Decompress the per leaf visibility data.
+        int pvs_row = ( _bspdata->dmodels[0].visleafs + 7 ) / 8;
         for ( int i = 0; i < _bspdata->dmodels[0].visleafs + 1; i++ )
         {
                 dleaf_t *leaf = &_bspdata->dleafs[i];
 
-                uint8_t *pvs = new uint8_t[( MAX_MAP_LEAFS + 7 ) / 8];
-                memset( pvs, 0, ( _bspdata->dmodels[0].visleafs + 7 ) / 8 );
+                uint8_t *pvs = new uint8_t[pvs_row];
+                memset( pvs, 0, pvs_row );
 
                 if ( leaf->visofs != -1 )
                 {
-                        DecompressVis( _bspdata, &_bspdata->dvisdata[leaf->visofs], pvs, ( MAX_MAP_LEAFS + 7 ) / 8 );
+                        DecompressVis( _bspdata, &_bspdata->dvisdata[leaf->visofs], pvs, pvs_row );
                         _has_pvs_data = true;
                 }
 
@@ -1738,6 +2271,189 @@ void BSPLoader::setup_raytrace_environment()
 			}
 		}
 	}
+
+	// Commit everything at once.
+	_trace->get_scene()->update();
+}
+
+// State shared with the threads that batch the world Geoms of each leaf.
+struct leafbatchwork_t
+{
+        size_t num_words;
+        size_t num_geom_words;
+        pvector<PT( Geom )> geoms;
+        pvector<CPT( RenderState )> states;
+        // Leafs touched by each world Geom, num_words per Geom.
+        pvector<uint64_t> geom_leafs;
+        // Leafs potentially visible from each leaf, num_words per leaf.
+        pvector<uint64_t> leaf_pvs;
+        // World Geoms potentially visible from each leaf, num_geom_words per leaf.
+        pvector<uint64_t> leaf_visible;
+        // Leafs that can see exactly the same Geoms share a batch.
+        vector_int leaf_class;
+        vector_int class_leaf;
+        // Output, one slot per class.
+        pvector<GeomNode::Geoms> class_geoms;
+};
+
+typedef void ( *leafbatchfunc_t )( leafbatchwork_t *lbw, int work );
+
+// One parallel pass over the leaf batch work.
+struct leafbatchpass_t
+{
+        leafbatchwork_t *lbw;
+        leafbatchfunc_t func;
+        AtomicAdjust::Integer count;
+        AtomicAdjust::Integer next;
+};
+
+/**
+ * Does the work items of the pass that no other thread has taken yet.
+ */
+static void run_leaf_batch_pass( leafbatchpass_t *pass )
+{
+        AtomicAdjust::Integer work = AtomicAdjust::get( pass->next );
+        while ( work < pass->count )
+        {
+                AtomicAdjust::Integer orig = AtomicAdjust::compare_and_exchange( pass->next, work, work + 1 );
+                if ( orig != work )
+                {
+                        work = orig;
+                        continue;
+                }
+
+                pass->func( pass->lbw, (int)work );
+
+                work = AtomicAdjust::get( pass->next );
+        }
+}
+
+static AsyncTask::DoneStatus leaf_batch_task( GenericAsyncTask *task, void *data )
+{
+        run_leaf_batch_pass( (leafbatchpass_t *)data );
+        return AsyncTask::DS_done;
+}
+
+/**
+ * Calls func for each of count work items, spread across the leaf batch
+ * threads.  Returns when all of them are done.
+ */
+static void run_leaf_batch( leafbatchwork_t *lbw, int count, leafbatchfunc_t func )
+{
+        leafbatchpass_t pass;
+        pass.lbw = lbw;
+        pass.func = func;
+        pass.count = count;
+        AtomicAdjust::set( pass.next, 0 );
+
+        int num_threads = std::min( bsp_leaf_batch_threads.get_value(), count );
+        if ( num_threads > 1 && Thread::is_threading_supported() )
+        {
+                AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+                AsyncTaskChain *chain = mgr->find_task_chain( "bspLeafBatch" );
+                if ( chain == nullptr )
+                {
+                        chain = mgr->make_task_chain( "bspLeafBatch" );
+                        chain->set_num_threads( bsp_leaf_batch_threads.get_value() );
+                        chain->set_frame_sync( false );
+                }
+
+                for ( int i = 0; i < num_threads; i++ )
+                {
+                        PT( GenericAsyncTask ) task = new GenericAsyncTask( "bspLeafBatch", leaf_batch_task, &pass );
+                        task->set_task_chain( "bspLeafBatch" );
+                        mgr->add( task );
+                }
+                chain->wait_for_tasks();
+        }
+        else
+        {
+                run_leaf_batch_pass( &pass );
+        }
+}
+
+/**
+ * Finds the world Geoms potentially visible from one leaf.
+ */
+static void find_leaf_visible_geoms( leafbatchwork_t *lbw, int work )
+{
+        int leafnum = work + 1;
+        const uint64_t *pvs = &lbw->leaf_pvs[(size_t)leafnum * lbw->num_words];
+        uint64_t *visible = &lbw->leaf_visible[(size_t)leafnum * lbw->num_geom_words];
+
+        for ( size_t geomnum = 0; geomnum < lbw->geoms.size(); geomnum++ )
+        {
+                const uint64_t *leafs = &lbw->geom_leafs[geomnum * lbw->num_words];
+                for ( size_t i = 0; i < lbw->num_words; i++ )
+                {
+                        if ( ( leafs[i] & pvs[i] ) != 0 )
+                        {
+                                visible[geomnum >> 6] |= (uint64_t)1 << ( geomnum & 63 );
+                                break;
+                        }
+                }
+        }
+}
+
+/**
+ * Combines the world Geoms visible from one class of leafs into one Geom per
+ * state.  The combined Geoms index straight into the world's vertex data, so
+ * a batch only owns its index list.
+ */
+static void build_leaf_class_batch( leafbatchwork_t *lbw, int classnum )
+{
+        int leafnum = lbw->class_leaf[classnum];
+        const uint64_t *visible = &lbw->leaf_visible[(size_t)leafnum * lbw->num_geom_words];
+
+        typedef std::pair<const RenderState *, const GeomVertexData *> batchkey_t;
+        pmap<batchkey_t, size_t> batch_index;
+        pvector<batchkey_t> batch_keys;
+        pvector<PT( GeomTriangles )> batch_tris;
+
+        for ( size_t geomnum = 0; geomnum < lbw->geoms.size(); geomnum++ )
+        {
+                if ( ( visible[geomnum >> 6] & ( (uint64_t)1 << ( geomnum & 63 ) ) ) == 0 )
+                {
+                        continue;
+                }
+
+                const Geom *geom = lbw->geoms[geomnum];
+                batchkey_t key( lbw->states[geomnum], geom->get_vertex_data() );
+                auto itr = batch_index.find( key );
+                if ( itr == batch_index.end() )
+                {
+                        itr = batch_index.insert( pmap<batchkey_t, size_t>::value_type( key, batch_keys.size() ) ).first;
+                        batch_keys.push_back( key );
+                        batch_tris.push_back( new GeomTriangles( GeomEnums::UH_static ) );
+                }
+
+                GeomTriangles *tris = batch_tris[itr->second];
+                for ( int i = 0; i < geom->get_num_primitives(); i++ )
+                {
+                        CPT( GeomPrimitive ) prim = geom->get_primitive( i )->decompose();
+                        if ( !prim->is_of_type( GeomTriangles::get_class_type() ) )
+                        {
+                                continue;
+                        }
+                        int num_vertices = prim->get_num_vertices();
+                        for ( int j = 0; j < num_vertices; j++ )
+                        {
+                                tris->add_vertex( prim->get_vertex( j ) );
+                        }
+                }
+        }
+
+        PT( GeomNode ) lgn = new GeomNode( "leafnode" );
+        for ( size_t i = 0; i < batch_keys.size(); i++ )
+        {
+                PT( Geom ) geom = new Geom( batch_keys[i].second );
+                geom->add_primitive( batch_tris[i] );
+                geom->set_bounds_type( BoundingVolume::BT_box );
+                lgn->add_geom( geom, batch_keys[i].first );
+        }
+
+        // We've created a batched list of Geoms to render when we are in these leafs.
+        lbw->class_geoms[classnum] = lgn->get_geoms();
 }
 
 void BSPLoader::do_optimizations()
@@ -1765,18 +2481,6 @@ void BSPLoader::do_optimizations()
                 {
                 	// For non zero models, the origin matters, so we will only flatten the children.
                         mdlnode->set_preserve_transform( ModelNode::PT_local );
-                	NodePathCollection mdlroots = mdlroot.find_all_matches("**/+ModelNode");
-                        
-                	for ( int j = 0; j < mdlroots.get_num_paths(); j++ )
-                	{
-                                // Apply my transform to the GeomNode
-                                NodePath np = mdlroots.get_path( j );
-                                NodePath gnp = np.find( "**/+GeomNode" );
-                                gnp.set_transform( np.get_transform() );
-                                gnp.reparent_to( mdlroot );
-                                np.remove_node();
-                                flatten_node( gnp );
-                	}
                         flatten_node( mdlroot );
 
                         // Now restore the bmodel's origin
@@ -1812,65 +2516,128 @@ void BSPLoader::do_optimizations()
 
                 // Another very important optimization is to try and flatten all faces together that are in the same PVS
                 // For each leaf, we will combine all potentially visible Geoms into as few batches as possible.
-                // This means that we will be duplicating Geoms (and lose a lot of view frustum culling on worldspawn, but
-                // it is worth it due to fewer batches).
+                // The batches only own index lists into the world's vertex data, and leafs that see the same
+                // Geoms share them.  We lose a lot of view frustum culling on worldspawn, but it is worth it
+                // due to fewer batches.
 
                 NodePath worldspawn = get_model( 0 );
                 NodePath npgn = worldspawn.find( "**/+GeomNode" );
                 PT( GeomNode ) gn = DCAST( GeomNode, npgn.node() );
                 int num_geoms = gn->get_num_geoms();
-                CPT( RenderState ) node_state = npgn.get_net_state();
 
                 int numvisleafs = _bspdata->dmodels[0].visleafs + 1;
 
-                // List of potentially visible Geoms in each leaf
-                // ( concatenation of Geoms in that leaf + Geoms of leafs in PVS )
-                _leaf_world_geoms.clear();
-                _leaf_world_geoms.resize( numvisleafs + 1 );
+                leafbatchwork_t work;
+                work.num_words = ( numvisleafs + 63 ) / 64;
+                work.geoms.resize( num_geoms );
+                work.states.resize( num_geoms );
+                work.geom_leafs.resize( (size_t)num_geoms * work.num_words, 0 );
+                work.leaf_pvs.resize( (size_t)numvisleafs * work.num_words, 0 );
+                work.num_geom_words = ( num_geoms + 63 ) / 64;
+                work.leaf_visible.resize( (size_t)numvisleafs * work.num_geom_words, 0 );
 
                 _leaf_aabb_lock.acquire();
 
-                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
+                // Find out which leafs each world Geom touches, once.  A Geom is
+                // potentially visible from a leaf if any leaf it touches is in
+                // that leaf's PVS, which is then just an AND of two bitsets.
+                for ( int geomnum = 0; geomnum < num_geoms; geomnum++ )
                 {
-                        // Build a list of worldspawn Geoms that we can render from this leaf.
-                        // We will then flatten those Geoms into as few batches as possible.
+                        // Make the Geom unique now, the batching threads only read it.
+                        work.geoms[geomnum] = gn->modify_geom( geomnum );
+                        work.states[geomnum] = gn->get_geom_state( geomnum );
 
-                        PT( GeomNode ) lgn = new GeomNode( "leafnode" );
-                        NodePath leafnode( lgn );
+                        // We are going to assume that world Geoms are already in world space
+                        // ( and they definitely should be )
+                        CPT( GeometricBoundingVolume ) geom_gbv = work.geoms[geomnum]->get_bounds()
+                                ->as_geometric_bounding_volume();
 
-                        for ( int geomnum = 0; geomnum < num_geoms; geomnum++ )
+                        uint64_t *leafs = &work.geom_leafs[(size_t)geomnum * work.num_words];
+                        for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
                         {
-                                const Geom *geom = gn->get_geom( geomnum );
-
-                                // We are going to assume that world Geoms are already in world space
-                                // ( and they definitely should be )
-                                CPT( GeometricBoundingVolume ) geom_gbv = geom->get_bounds()
-                                        ->as_geometric_bounding_volume();
-
-                                for ( size_t pvsidx = 1; pvsidx < numvisleafs; pvsidx++ )
+                                if ( _leaf_bboxs[leafnum]->contains( geom_gbv ) != BoundingVolume::IF_no_intersection )
                                 {
-                                        if ( !is_cluster_visible( leafnum, pvsidx ) )
-                                                continue;
-
-                                        BoundingBox *leaf_bounds = _leaf_bboxs[pvsidx];
+                                        leafs[leafnum >> 6] |= (uint64_t)1 << ( leafnum & 63 );
+                                }
+                        }
+                }
 
-                                        if ( leaf_bounds->contains( geom_gbv ) != BoundingVolume::IF_no_intersection )
+                // Same as is_cluster_visible(), as a bitset per leaf.
+                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
+                {
+                        uint64_t *pvs = &work.leaf_pvs[(size_t)leafnum * work.num_words];
+                        pvs[leafnum >> 6] |= (uint64_t)1 << ( leafnum & 63 );
+                        if ( _has_pvs_data )
+                        {
+                                for ( int pvsidx = 1; pvsidx < numvisleafs; pvsidx++ )
+                                {
+                                        if ( _leaf_pvs[leafnum][( pvsidx - 1 ) >> 3] & ( 1 << ( ( pvsidx - 1 ) & 7 ) ) )
                                         {
-                                                lgn->add_geom( gn->modify_geom( geomnum ), gn->get_geom_state( geomnum ) );
-                                                break;
+                                                pvs[pvsidx >> 6] |= (uint64_t)1 << ( pvsidx & 63 );
                                         }
                                 }
                         }
+                }
 
-                        // aggressively combine all geoms visibible from this leaf
-                        leafnode.clear_model_nodes();
-                        leafnode.flatten_strong();
+                _leaf_aabb_lock.release();
 
-                        // We've created a batched list of Geoms to render when we are in this leaf.
-                        _leaf_world_geoms[leafnum] = lgn->get_geoms();
+                // Each leaf fills in its own row.
+                run_leaf_batch( &work, numvisleafs - 1, find_leaf_visible_geoms );
+
+                // Leafs that see the same Geoms (leafs with the same PVS, at least)
+                // get the same batch, instead of each owning a copy of it.
+                pmap<size_t, vector_int> classes_by_hash;
+                work.leaf_class.resize( numvisleafs + 1, -1 );
+                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
+                {
+                        const uint64_t *visible = &work.leaf_visible[(size_t)leafnum * work.num_geom_words];
+                        size_t hash = 0;
+                        for ( size_t i = 0; i < work.num_geom_words; i++ )
+                        {
+                                hash = size_t_hash::add_hash( hash, (size_t)( visible[i] ^ ( visible[i] >> 32 ) ) );
+                        }
+
+                        vector_int &candidates = classes_by_hash[hash];
+                        for ( size_t i = 0; i < candidates.size(); i++ )
+                        {
+                                const uint64_t *other = &work.leaf_visible[(size_t)work.class_leaf[candidates[i]] * work.num_geom_words];
+                                if ( memcmp( visible, other, work.num_geom_words * sizeof( uint64_t ) ) == 0 )
+                                {
+                                        work.leaf_class[leafnum] = candidates[i];
+                                        break;
+                                }
+                        }
+
+                        if ( work.leaf_class[leafnum] == -1 )
+                        {
+                                work.leaf_class[leafnum] = (int)work.class_leaf.size();
+                                candidates.push_back( work.leaf_class[leafnum] );
+                                work.class_leaf.push_back( leafnum );
+                        }
                 }
 
+                work.class_geoms.resize( work.class_leaf.size() );
+                run_leaf_batch( &work, (int)work.class_leaf.size(), build_leaf_class_batch );
+
+                bspfile_cat.info()
+                        << numvisleafs - 1 << " leafs share " << work.class_leaf.size() << " world batches\n";
+
+                pvector<GeomNode::Geoms> leaf_geoms;
+                leaf_geoms.resize( numvisleafs + 1 );
+                for ( int leafnum = 1; leafnum < numvisleafs; leafnum++ )
+                {
+                        leaf_geoms[leafnum] = work.class_geoms[work.leaf_class[leafnum]];
+                }
+
+                _leaf_aabb_lock.acquire();
+                _leaf_world_geoms.swap( leaf_geoms );
                 _leaf_aabb_lock.release();
+
+                if ( _curr_leaf_idx >= 0 )
+                {
+                        // Republish the current leaf with its new batch.
+                        update_leaf( _curr_leaf_idx );
+                }
         }
 
         for ( int entnum = 0; entnum < _bspdata->numentities; entnum++ )
@@ -2131,14 +2898,19 @@ void BSPLoader::cleanup( bool is_transition )
         _materials.clear();
 
         _leaf_aabb_lock.acquire();
+	for ( size_t i = 0; i < _leaf_pvs.size(); i++ )
+	{
+		delete[] _leaf_pvs[i];
+	}
 	_leaf_pvs.clear();
         _leaf_world_geoms.clear();
-        _visible_leafs.clear();
         _leaf_bboxs.clear();
-        _visible_leaf_bboxs.clear();
+        _curr_leaf_idx = -1;
+        publish_visdata( nullptr );
         _leaf_aabb_lock.release();
 
         _has_pvs_data = false;
+        AtomicAdjust::inc( _net_bounds_generation );
 
 	cleanup_entities( is_transition );
 
@@ -2178,6 +2950,7 @@ BSPLoader::BSPLoader() :
 	_want_lightmaps( true ),
 	_curr_leaf_idx( -1 ),
 	_leaf_aabb_lock( "leafAABBMutex" ),
+	_visdata_lock( "visdataMutex" ),
 	_gamma( DEFAULT_GAMMA ),
 	_amb_probe_mgr( this ),
 	_decal_mgr( this ),
@@ -2191,6 +2964,8 @@ BSPLoader::BSPLoader() :
 	_bspdata( nullptr ),
 	_colldata( nullptr ),
 	_trace( new BSPTrace( this ) ),
+	_line_batch_lock( "lineBatchMutex" ),
+	_line_batch_chain( nullptr ),
 	_physics_world( nullptr )
 {
 }
@@ -2293,32 +3068,157 @@ BSPLoader *BSPLoader::get_global_ptr()
 	return _global_ptr;
 }
 
+/**
+ * Descends the BSP tree from the indicated node, skipping every subtree that
+ * has no visible leafs, or whose visible leafs don't overlap the box or lack
+ * the required flags.
+ */
+bool BSPLoader::pvs_node_test( const visdata_t *vis, int nodenum, const LPoint3 &mins, const LPoint3 &maxs,
+			       unsigned int required_leaf_flags ) const
+{
+	const nodevisdata_t &nvis = vis->node_vis[nodenum];
+	if ( !nvis.visible ||
+	     ( required_leaf_flags != 0 && ( nvis.flags & required_leaf_flags ) == 0 ) ||
+	     nvis.mins[0] > maxs[0] || nvis.maxs[0] < mins[0] ||
+	     nvis.mins[1] > maxs[1] || nvis.maxs[1] < mins[1] ||
+	     nvis.mins[2] > maxs[2] || nvis.maxs[2] < mins[2] )
+	{
+		return false;
+	}
+
+	const dnode_t *node = &_bspdata->dnodes[nodenum];
+	for ( int i = 0; i < 2; i++ )
+	{
+		int child = node->children[i];
+		if ( child >= 0 )
+		{
+			if ( pvs_node_test( vis, child, mins, maxs, required_leaf_flags ) )
+				return true;
+			continue;
+		}
+
+		int leaf = -1 - child;
+		if ( leaf < 1 || leaf > _bspdata->dmodels[0].visleafs ||
+		     ( leaf != vis->leaf && !is_cluster_visible( vis->leaf, leaf ) ) )
+			continue;
+		if ( required_leaf_flags != 0 && ( _bspdata->dleafs[leaf].flags & required_leaf_flags ) == 0 )
+			continue;
+
+		const LPoint3 &leaf_mins = _leaf_bboxs[leaf]->get_minq();
+		const LPoint3 &leaf_maxs = _leaf_bboxs[leaf]->get_maxq();
+		if ( leaf_mins[0] <= maxs[0] && leaf_maxs[0] >= mins[0] &&
+		     leaf_mins[1] <= maxs[1] && leaf_maxs[1] >= mins[1] &&
+		     leaf_mins[2] <= maxs[2] && leaf_maxs[2] >= mins[2] )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /**
  * Checks if the specified bounding volume intersects any
  * of the potentially visible leaf bounding boxes.
  *
+ * Finite volumes are tested by their axis-aligned bounds.  This is exact for
+ * boxes and slightly conservative for anything else.  Small visible sets are
+ * tested four leafs at a time, large ones by descending the BSP tree.
+ *
  * required_leaf_flags - What flags should be set on the leaf for it to pass?
  */
 bool BSPLoader::pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags )
 {
-        LightMutexHolder holder( _leaf_aabb_lock );
+        CPT( visdata_t ) vis = get_visdata();
+        return pvs_bounds_test( vis, bounds, required_leaf_flags );
+}
 
-        size_t num_aabbs = _visible_leaf_bboxs.size();
-        for ( size_t i = 0; i < num_aabbs; i++ )
+/**
+ * Checks the bounding volume against the visible leafs of the indicated
+ * visibility snapshot.
+ */
+bool BSPLoader::pvs_bounds_test( const visdata_t *vis, const GeometricBoundingVolume *bounds,
+                                 unsigned int required_leaf_flags ) const
+{
+        if ( vis == nullptr || bounds->is_empty() )
         {
-		const visibleleafdata_t &data = _visible_leaf_bboxs[i];
+                return false;
+        }
 
-		if ( required_leaf_flags != 0 && ( data.flags & required_leaf_flags ) == 0 )
-		{
-			// Leaf doesn't have a flag set that is needed for the test to pass.
-			continue;
-		}
+        const FiniteBoundingVolume *fbv = bounds->as_finite_bounding_volume();
+        if ( fbv == nullptr )
+        {
+                // Infinite volumes intersect every leaf.
+                for ( size_t i = 0; i < vis->visible_leafs.size(); i++ )
+                {
+                        int leaf = vis->visible_leafs[i];
+                        if ( required_leaf_flags != 0 && ( _bspdata->dleafs[leaf].flags & required_leaf_flags ) == 0 )
+                        {
+                                // Leaf doesn't have a flag set that is needed for the test to pass.
+                                continue;
+                        }
+
+                        if ( _leaf_bboxs[leaf]->contains( bounds ) != BoundingVolume::IF_no_intersection )
+                        {
+                                return true;
+                        }
+                }
+
+                return false;
+        }
+
+        LPoint3 mins = fbv->get_min();
+        LPoint3 maxs = fbv->get_max();
+
+        if ( (int)vis->visible_leafs.size() > bsp_pvs_tree_threshold && !vis->node_vis.empty() )
+        {
+                return pvs_node_test( vis, _bspdata->dmodels[0].headnode[0], mins, maxs, required_leaf_flags );
+        }
+
+        const float *leaf_mins[3] = { vis->visible_leaf_mins[0].data(), vis->visible_leaf_mins[1].data(),
+                                      vis->visible_leaf_mins[2].data() };
+        const float *leaf_maxs[3] = { vis->visible_leaf_maxs[0].data(), vis->visible_leaf_maxs[1].data(),
+                                      vis->visible_leaf_maxs[2].data() };
+        return pvs_leaf_boxes_test( leaf_mins, leaf_maxs, vis->visible_leaf_flags.data(),
+                                    vis->visible_leaf_flags.size(), mins, maxs, required_leaf_flags );
+}
+
+bool pvs_leaf_boxes_test( const float *const leaf_mins[3], const float *const leaf_maxs[3],
+                          const int *leaf_flags, size_t count,
+                          const LPoint3 &mins, const LPoint3 &maxs,
+                          unsigned int required_leaf_flags )
+{
+        fltx4 bmins[3] = { ReplicateX4( mins[0] ), ReplicateX4( mins[1] ), ReplicateX4( mins[2] ) };
+        fltx4 bmaxs[3] = { ReplicateX4( maxs[0] ), ReplicateX4( maxs[1] ), ReplicateX4( maxs[2] ) };
+
+        for ( size_t i = 0; i < count; i += 4 )
+        {
+                fltx4 hit = CmpLeSIMD( LoadUnalignedSIMD( leaf_mins[0] + i ), bmaxs[0] );
+                hit = AndSIMD( hit, CmpGeSIMD( LoadUnalignedSIMD( leaf_maxs[0] + i ), bmins[0] ) );
+                hit = AndSIMD( hit, CmpLeSIMD( LoadUnalignedSIMD( leaf_mins[1] + i ), bmaxs[1] ) );
+                hit = AndSIMD( hit, CmpGeSIMD( LoadUnalignedSIMD( leaf_maxs[1] + i ), bmins[1] ) );
+                hit = AndSIMD( hit, CmpLeSIMD( LoadUnalignedSIMD( leaf_mins[2] + i ), bmaxs[2] ) );
+                hit = AndSIMD( hit, CmpGeSIMD( LoadUnalignedSIMD( leaf_maxs[2] + i ), bmins[2] ) );
+
+                int mask = TestSignSIMD( hit );
+                if ( mask == 0 )
+                {
+                        continue;
+                }
 
-                if (data.bbox->contains( bounds ) != BoundingVolume::IF_no_intersection )
+                if ( required_leaf_flags == 0 )
                 {
                         // Bounds intersected one of the potentially visible leafs.
                         return true;
                 }
+
+                for ( int j = 0; j < 4; j++ )
+                {
+                        if ( ( mask & ( 1 << j ) ) != 0 && ( leaf_flags[i + j] & required_leaf_flags ) != 0 )
+                        {
+                                return true;
+                        }
+                }
         }
 
         // No intersections.
@@ -2339,6 +3239,66 @@ CPT( GeometricBoundingVolume ) BSPLoader::make_net_bounds( const TransformState
         return gbv;
 }
 
+/**
+ * Transforms the bounding volume by the net transform and tests it against
+ * the potentially visible leafs, like make_net_bounds() followed by
+ * pvs_bounds_test().  The result is remembered for the rest of the frame, so
+ * the other cameras that render the same node or Geom don't redo the work.
+ */
+bool BSPLoader::pvs_net_bounds_test( const TransformState *net_transform, const GeometricBoundingVolume *original,
+                                     unsigned int required_leaf_flags )
+{
+        // Every cull thread has its own cache, so the cameras that one thread
+        // culls share results without any locking between threads.
+        static thread_local netboundscache_t cache;
+
+        int frame = ClockObject::get_global_clock()->get_frame_count();
+        AtomicAdjust::Integer generation = AtomicAdjust::get( _net_bounds_generation );
+        CPT( visdata_t ) vis = get_visdata();
+
+        if ( cache.loader != this || generation != cache.generation ||
+             frame != cache.frame || vis != cache.vis )
+        {
+                cache.entries.clear();
+                cache.loader = this;
+                cache.generation = generation;
+                cache.frame = frame;
+                cache.vis = vis;
+        }
+
+        netboundskey_t key;
+        key.bounds = original;
+        key.net_transform = net_transform;
+        key.required_leaf_flags = required_leaf_flags;
+
+        auto itr = cache.entries.find( key );
+        if ( itr != cache.entries.end() )
+        {
+                net_bounds_hit_collector.add_level( 1 );
+                return itr->second.result;
+        }
+
+        net_bounds_miss_collector.add_level( 1 );
+
+        net_bounds_xform_collector.start();
+        CPT( GeometricBoundingVolume ) net_bounds = make_net_bounds( net_transform, original );
+        net_bounds_xform_collector.stop();
+
+        bool result = pvs_bounds_test( vis, net_bounds, required_leaf_flags );
+
+        if ( cache.entries.size() >= (size_t)bsp_net_bounds_cache_size.get_value() )
+        {
+                return result;
+        }
+
+        netboundsentry_t &entry = cache.entries[key];
+        entry.bounds = original;
+        entry.net_transform = net_transform;
+        entry.result = result;
+
+        return result;
+}
+
 /**
  * Traces a line along the BSP tree. Returns true if the line traced
  * all the way to the end, false if the line intersected a face.
@@ -2350,8 +3310,7 @@ bool BSPLoader::trace_line( const LPoint3 &start, const LPoint3 &end )
                 return true;
         }
 
-	RayTraceHitResult res = _trace->get_scene()->trace_line( ( start + LPoint3( 0, 0, 0.05 ) ) * 16, end * 16, TRACETYPE_WORLD );
-	return !res.has_hit();
+	return !_trace->get_scene()->test_line_occluded( ( start + LPoint3( 0, 0, 0.05 ) ) * 16, end * 16, TRACETYPE_WORLD );
 }
 
 /**
@@ -2374,6 +3333,184 @@ LPoint3 BSPLoader::clip_line( const LPoint3 &start, const LPoint3 &end )
 	return clipped;
 }
 
+// Number of lines a thread takes from the batch at a time.  Big enough for
+// Embree to trace them in full packets.
+static const AtomicAdjust::Integer line_batch_chunk = 64;
+
+/**
+ * Copies the lines into the batch, moved into trace space the same way
+ * trace_line() does it.  Returns false if there is nothing to trace.
+ */
+bool BSPLoader::setup_line_batch( const CPTA_LVecBase3 &start, const CPTA_LVecBase3 &end )
+{
+        nassertr( start.size() == end.size(), false );
+
+        size_t count = start.size();
+        _line_batch.start.resize( count );
+        _line_batch.end.resize( count );
+        for ( size_t i = 0; i < count; i++ )
+        {
+                _line_batch.start[i] = ( start[i] + LPoint3( 0, 0, 0.05 ) ) * 16;
+                _line_batch.end[i] = end[i] * 16;
+        }
+        AtomicAdjust::set( _line_batch.next_line, 0 );
+
+        return count != 0;
+}
+
+/**
+ * Traces the chunks of the line batch that no other thread has taken yet.
+ */
+void BSPLoader::run_line_batch()
+{
+        RayTraceScene *scene = _trace->get_scene();
+        AtomicAdjust::Integer num_lines = (AtomicAdjust::Integer)_line_batch.start.size();
+
+        AtomicAdjust::Integer first = AtomicAdjust::get( _line_batch.next_line );
+        while ( first < num_lines )
+        {
+                AtomicAdjust::Integer orig = AtomicAdjust::compare_and_exchange(
+                        _line_batch.next_line, first, first + line_batch_chunk );
+                if ( orig != first )
+                {
+                        first = orig;
+                        continue;
+                }
+
+                int count = (int)( std::min( first + line_batch_chunk, num_lines ) - first );
+                if ( _line_batch.occluded )
+                {
+                        scene->test_lines_occluded( &_line_batch.start[first], &_line_batch.end[first], count,
+                                                    TRACETYPE_WORLD, _line_batch.occluded + first );
+                }
+                else
+                {
+                        scene->trace_lines( &_line_batch.start[first], &_line_batch.end[first], count,
+                                            TRACETYPE_WORLD, _line_batch.results + first );
+                }
+
+                first = AtomicAdjust::get( _line_batch.next_line );
+        }
+}
+
+AsyncTask::DoneStatus BSPLoader::line_batch_task( GenericAsyncTask *task, void *data )
+{
+        ( (BSPLoader *)data )->run_line_batch();
+        return AsyncTask::DS_done;
+}
+
+/**
+ * Traces the whole line batch, spread across the line batch threads if there
+ * is more than a chunk of it.
+ */
+void BSPLoader::trace_line_batch()
+{
+        int num_chunks = (int)( ( _line_batch.start.size() + line_batch_chunk - 1 ) / line_batch_chunk );
+        int num_threads = std::min( bsp_line_batch_threads.get_value(), num_chunks );
+        if ( num_threads > 1 && Thread::is_threading_supported() )
+        {
+                AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
+                if ( _line_batch_chain == nullptr )
+                {
+                        _line_batch_chain = mgr->make_task_chain( "bspLineBatch" );
+                        _line_batch_chain->set_num_threads( bsp_line_batch_threads.get_value() );
+                        _line_batch_chain->set_frame_sync( false );
+                }
+
+                for ( int i = 0; i < num_threads; i++ )
+                {
+                        PT( GenericAsyncTask ) task = new GenericAsyncTask( "bspLineBatch", line_batch_task, this );
+                        task->set_task_chain( "bspLineBatch" );
+                        mgr->add( task );
+                }
+                _line_batch_chain->wait_for_tasks();
+        }
+        else
+        {
+                run_line_batch();
+        }
+}
+
+/**
+ * Batched version of trace_line(), for doing a lot of line-of-sight tests at
+ * once.  start and end must be the same length.  The returned array has a 1
+ * for each line that is clear, and a 0 for each line that is blocked.
+ */
+PTA_uchar BSPLoader::trace_lines( CPTA_LVecBase3 start, CPTA_LVecBase3 end )
+{
+        PTA_uchar clear = PTA_uchar::empty_array( start.size() );
+        if ( !_active_level )
+        {
+                for ( size_t i = 0; i < clear.size(); i++ )
+                {
+                        clear[i] = 1;
+                }
+                return clear;
+        }
+
+        LightMutexHolder holder( _line_batch_lock );
+
+        if ( !setup_line_batch( start, end ) )
+        {
+                return clear;
+        }
+
+        std::unique_ptr<bool[]> occluded( new bool[clear.size()] );
+        _line_batch.occluded = occluded.get();
+        _line_batch.results = nullptr;
+        trace_line_batch();
+        _line_batch.occluded = nullptr;
+
+        for ( size_t i = 0; i < clear.size(); i++ )
+        {
+                clear[i] = occluded[i] ? 0 : 1;
+        }
+
+        return clear;
+}
+
+/**
+ * Batched version of clip_line().  start and end must be the same length.
+ * Returns how far along each line it got before it hit the world, from 0 to
+ * 1, instead of the clipped endpoints.
+ */
+PTA_stdfloat BSPLoader::clip_lines( CPTA_LVecBase3 start, CPTA_LVecBase3 end )
+{
+        PTA_stdfloat fractions = PTA_stdfloat::empty_array( start.size() );
+        for ( size_t i = 0; i < fractions.size(); i++ )
+        {
+                fractions[i] = 1.0f;
+        }
+
+        if ( !_active_level )
+        {
+                return fractions;
+        }
+
+        LightMutexHolder holder( _line_batch_lock );
+
+        if ( !setup_line_batch( start, end ) )
+        {
+                return fractions;
+        }
+
+        pvector<RayTraceHitResult> results( fractions.size() );
+        _line_batch.occluded = nullptr;
+        _line_batch.results = results.data();
+        trace_line_batch();
+        _line_batch.results = nullptr;
+
+        for ( size_t i = 0; i < fractions.size(); i++ )
+        {
+                if ( results[i].has_hit() )
+                {
+                        fractions[i] = results[i].get_hit_fraction();
+                }
+        }
+
+        return fractions;
+}
+
 int BSPLoader::get_brush_triangle_model_fast( BulletRigidBodyNode *rbnode, int triangle_idx )
 {
 	auto nodeitr = _brush_collision_data.find( rbnode );
@@ -26,9 +26,17 @@
 #include <renderAttrib.h>
 #include <boundingBox.h>
 #include <lightReMutex.h>
+#include <lightMutexHolder.h>
+#include <atomicAdjust.h>
+#include <referenceCount.h>
+#include <geomNode.h>
 #include <graphicsWindow.h>
 #include <bulletWorld.h>
 #include <bulletRigidBodyNode.h>
+#include <vector_int.h>
+#include <pta_uchar.h>
+#include <pta_stdfloat.h>
+#include <pta_LVecBase3.h>
 
 #include "lightmap_palettes.h"
 #include "ambient_probes.h"
@@ -56,9 +64,6 @@ struct bspdata_t;
 struct dmodel_t;
 #endif
 
-class EggVertex;
-class EggVertexPool;
-class EggPolygon;
 class Geom;
 class GeomNode;
 class BSPLoader;
@@ -85,11 +90,11 @@ PUBLISHED:
                 FACETYPE_FLOOR,
         };
 
-	static CPT( RenderAttrib ) make( const string &face_material, int face_type );
+	static CPT( RenderAttrib ) make( const std::string &face_material, int face_type );
 	static CPT( RenderAttrib ) make_default();
         static CPT( RenderAttrib ) make_ignore_pvs();
 
-	INLINE string get_material() const
+	INLINE std::string get_material() const
         {
                 return _material;
         }
@@ -109,7 +114,7 @@ public:
 	virtual int compare_to_impl( const RenderAttrib *other ) const;
 
 private:
-	string _material;
+	std::string _material;
         int _face_type;
         bool _ignore_pvs;
 
@@ -163,6 +168,15 @@ struct dface_lightmap_info_t
 	LightmapPaletteDirectory::LightmapFacePaletteEntry *palette_entry;
 };
 
+// Faces of a brush model that render with the same state.  They are
+// built into shared vertex data, with one Geom per face.
+struct facebatch_t
+{
+	int modelnum;
+	CPT( RenderState ) state;
+	vector_int faces;
+};
+
 struct brush_collision_data_t
 {
 	std::string material;
@@ -184,6 +198,16 @@ struct brush_model_data_t
 	}
 };
 
+#ifndef CPPPARSER
+// Tests the box against count leaf boxes, stored as structure-of-arrays and
+// padded to a multiple of four, four leafs at a time.  Only leafs with one of
+// the required flags count, unless there are no required flags.
+extern EXPCL_PANDABSP bool pvs_leaf_boxes_test( const float *const leaf_mins[3], const float *const leaf_maxs[3],
+                                                const int *leaf_flags, size_t count,
+                                                const LPoint3 &mins, const LPoint3 &maxs,
+                                                unsigned int required_leaf_flags );
+#endif
+
 /**
  * Loads and handles the operations of PBSP files.
  */
@@ -279,6 +303,8 @@ PUBLISHED:
 
         bool trace_line( const LPoint3 &start, const LPoint3 &end );
         LPoint3 clip_line( const LPoint3 &start, const LPoint3 &end );
+        PTA_uchar trace_lines( CPTA_LVecBase3 start, CPTA_LVecBase3 end );
+        PTA_stdfloat clip_lines( CPTA_LVecBase3 start, CPTA_LVecBase3 end );
 
 	NodePath get_model( int modelnum ) const;
 
@@ -294,6 +320,8 @@ PUBLISHED:
         bool pvs_bounds_test( const GeometricBoundingVolume *bounds, unsigned int required_leaf_flags = 0u );
         CPT( GeometricBoundingVolume ) make_net_bounds( const TransformState *net_transform,
                                                         const GeometricBoundingVolume *original );
+        bool pvs_net_bounds_test( const TransformState *net_transform, const GeometricBoundingVolume *original,
+                                  unsigned int required_leaf_flags = 0u );
 
         INLINE bool has_active_level() const
         {
@@ -396,7 +424,15 @@ protected:
 
 	void setup_raytrace_environment();
 
+	class visdata_t;
+
 	void update_leaf( int leaf );
+	void add_visible_leaf( visdata_t *vis, int leaf );
+	void update_node_vis( visdata_t *vis, int nodenum );
+	bool pvs_node_test( const visdata_t *vis, int nodenum, const LPoint3 &mins, const LPoint3 &maxs,
+			    unsigned int required_leaf_flags ) const;
+	bool pvs_bounds_test( const visdata_t *vis, const GeometricBoundingVolume *bounds,
+			      unsigned int required_leaf_flags ) const;
         
         void make_faces();
 
@@ -419,15 +455,21 @@ protected:
 
         CPT( BSPMaterial ) try_load_texref( texref_t *tref );
 
-        PT( EggVertex ) make_vertex( EggVertexPool *vpool, EggPolygon *poly,
-                                     dedge_t *edge, texinfo_t *texinfo,
-                                     dface_t *face, int k, Texture *tex );
-        PT( EggVertex ) make_vertex_ai( EggVertexPool *vpool, EggPolygon *poly, dedge_t *edge, int k );
-
         cubemap_t *find_closest_cubemap( const LPoint3 &pos );
 
 	void init_dface_lightmap_info( dface_lightmap_info_t *info, int facenum );
 
+	std::string get_face_geometry_key( const pvector<facebatch_t> &batches ) const;
+	bool read_face_geometry_cache( const std::string &key, size_t num_batches,
+				       pvector<PT( GeomNode )> &batch_nodes );
+	void write_face_geometry_cache( const std::string &key, const pvector<PT( GeomNode )> &batch_nodes );
+	void build_face_geoms( const vector_int &faces, const vector_int &face_vertnormalindices, GeomNode *gn );
+
+	bool setup_line_batch( const CPTA_LVecBase3 &start, const CPTA_LVecBase3 &end );
+	void run_line_batch();
+	static AsyncTask::DoneStatus line_batch_task( GenericAsyncTask *task, void *data );
+	void trace_line_batch();
+
 protected:
         bspdata_t *_bspdata;
         BSPShaderGenerator *_shgen;
@@ -442,7 +484,7 @@ protected:
         bool _wireframe;
 	Filename _materials_file;
         PN_stdfloat _gamma;
-	typedef pmap<string, string> Tex2Mat;
+	typedef pmap<std::string, std::string> Tex2Mat;
 	Tex2Mat _materials;
 	GraphicsWindow *_win;
 	bool _has_pvs_data;
@@ -456,19 +498,66 @@ protected:
 
 	PT( BSPTrace ) _trace;
 
-	struct visibleleafdata_t
+	// The lines of a trace_lines() or clip_lines() call, already in trace
+	// space.  They are traced a chunk at a time by the line batch threads,
+	// and only one of occluded or results is filled in.
+	struct linebatch_t
+	{
+		pvector<LPoint3> start;
+		pvector<LPoint3> end;
+		bool *occluded;
+		RayTraceHitResult *results;
+		AtomicAdjust::Integer next_line;
+	};
+	linebatch_t _line_batch;
+	LightMutex _line_batch_lock;
+	PT( AsyncTaskChain ) _line_batch_chain;
+
+	// Per BSP node: the bounds and flags of the visible leafs below it.
+	// Nodes with no visible leafs below them are culled as a whole.
+	struct nodevisdata_t
 	{
-		BoundingBox *bbox;
+		LPoint3 mins;
+		LPoint3 maxs;
 		int flags;
+		bool visible;
+	};
+	// Everything the cull traversals need to know about the current leaf.
+	// update_leaf() builds a new one and publishes it whole, and it is never
+	// modified after that, so readers don't have to lock it while they use it.
+	class visdata_t : public ReferenceCount
+	{
+	public:
+		int leaf;
+		pvector<int> visible_leafs;
+		// Bounds of the visible leafs as structure-of-arrays, padded out to a
+		// multiple of four with empty boxes, so they can be tested four at a time.
+		pvector<float> visible_leaf_mins[3];
+		pvector<float> visible_leaf_maxs[3];
+		vector_int visible_leaf_flags;
+		pvector<nodevisdata_t> node_vis;
+		// The world batch for the leaf, if the world has been batched yet.
+		GeomNode::Geoms world_geoms;
+		bool has_world_geoms;
 	};
-	pvector<visibleleafdata_t> _visible_leaf_bboxs;
-        pvector<int> _visible_leafs;
+	// Readers hold a reference to the snapshot for as long as they use it,
+	// so a replaced snapshot goes away when the last reader lets go of it.
+	INLINE CPT( visdata_t ) get_visdata() const
+	{
+		LightMutexHolder holder( _visdata_lock );
+		return _curr_visdata;
+	}
+	void publish_visdata( visdata_t *vis );
+	// The published snapshot.  _visdata_lock is only held long enough to
+	// take or replace the reference.
+	PT( visdata_t ) _curr_visdata;
+	mutable LightMutex _visdata_lock;
 	int _curr_leaf_idx;
         Filename _map_file;
 
 	std::unordered_map<const dface_t *, const dmodel_t *> _dface_dmodels;
         pmap<texref_t *, CPT( BSPMaterial )> _texref_materials;
-        vector<uint8_t *> _leaf_pvs;
+        std::vector<uint8_t *> _leaf_pvs;
 	pvector<NodePath> _leaf_visnp;
 	pvector<PT( BoundingBox )> _leaf_bboxs;
 	pvector<brush_model_data_t> _model_data;
@@ -480,7 +569,7 @@ protected:
 	
         UpdateSeq _generated_shader_seq;
 
-	typedef unordered_map<int, brush_collision_data_t> TriangleIndex2BSPCollisionData_t;
+	typedef std::unordered_map<int, brush_collision_data_t> TriangleIndex2BSPCollisionData_t;
 	typedef pmap<PT( BulletRigidBodyNode ), TriangleIndex2BSPCollisionData_t> BSPCollisionData_t;
 	BSPCollisionData_t _brush_collision_data;
 
@@ -497,10 +586,46 @@ protected:
 
         static BSPLoader *_global_ptr;
 
-        // While BSPLoader updates the visible leaf AABBs on the App thread,
-        // BSPGeomNode needs to access them from the Cull thread.
-        // So we'll use a mutex.
+        // Serializes the threads that build and publish visibility snapshots.
+        // Readers of the current snapshot don't need it.
         LightMutex _leaf_aabb_lock;
+
+        // Results of pvs_net_bounds_test() for the current frame and visibility
+        // snapshot, so every camera pass of a frame can reuse them.  Each cull
+        // thread keeps its own, see pvs_net_bounds_test().  The entries hold on
+        // to the bounds and transform so the pointers in the key stay unique.
+        struct netboundskey_t
+        {
+                const BoundingVolume *bounds;
+                const TransformState *net_transform;
+                unsigned int required_leaf_flags;
+
+                INLINE bool operator < ( const netboundskey_t &other ) const
+                {
+                        if ( bounds != other.bounds )
+                                return bounds < other.bounds;
+                        if ( net_transform != other.net_transform )
+                                return net_transform < other.net_transform;
+                        return required_leaf_flags < other.required_leaf_flags;
+                }
+        };
+        struct netboundsentry_t
+        {
+                CPT( BoundingVolume ) bounds;
+                CPT( TransformState ) net_transform;
+                bool result;
+        };
+        struct netboundscache_t
+        {
+                const BSPLoader *loader;
+                AtomicAdjust::Integer generation;
+                int frame;
+                CPT( visdata_t ) vis;
+                pmap<netboundskey_t, netboundsentry_t> entries;
+        };
+        // Bumped by cleanup(), so the cache of every thread lets go of the
+        // level's bounds and visibility the next time it is used.
+        static AtomicAdjust::Integer _net_bounds_generation;
 };
 
 extern EXPCL_PANDABSP LColor color_from_value( const std::string &value, bool scale = true, bool gamma = false );
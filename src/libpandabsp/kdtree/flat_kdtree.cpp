@@ -0,0 +1,141 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file flat_kdtree.cpp
+ */
+
+#include "flat_kdtree.h"
+
+#include <algorithm>
+#include <float.h>
+
+INLINE static float node_dist_sq( const float *a, const float *b )
+{
+	float dx = a[0] - b[0];
+	float dy = a[1] - b[1];
+	float dz = a[2] - b[2];
+	return dx * dx + dy * dy + dz * dz;
+}
+
+/**
+ * Builds the tree from the indicated points.  The indices returned by the
+ * queries are indices into this array.
+ */
+void FlatKDTree::build( const pvector<LPoint3> &points )
+{
+	_nodes.resize( points.size() );
+	for ( size_t i = 0; i < points.size(); i++ )
+	{
+		node_t &node = _nodes[i];
+		node.pos[0] = (float)points[i][0];
+		node.pos[1] = (float)points[i][1];
+		node.pos[2] = (float)points[i][2];
+		node.index = (int)i;
+		node.axis = 0;
+	}
+
+	r_build( 0, (int)_nodes.size() );
+}
+
+void FlatKDTree::clear()
+{
+	_nodes.clear();
+}
+
+/**
+ * Splits the range on its widest axis, putting the median point in the
+ * middle of it, and recurses into the halves on either side.
+ */
+void FlatKDTree::r_build( int lo, int hi )
+{
+	if ( hi - lo <= 1 )
+	{
+		return;
+	}
+
+	float mins[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float maxs[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for ( int i = lo; i < hi; i++ )
+	{
+		for ( int j = 0; j < 3; j++ )
+		{
+			mins[j] = std::min( mins[j], _nodes[i].pos[j] );
+			maxs[j] = std::max( maxs[j], _nodes[i].pos[j] );
+		}
+	}
+
+	int axis = 0;
+	for ( int j = 1; j < 3; j++ )
+	{
+		if ( maxs[j] - mins[j] > maxs[axis] - mins[axis] )
+		{
+			axis = j;
+		}
+	}
+
+	int mid = ( lo + hi ) >> 1;
+	std::nth_element( _nodes.begin() + lo, _nodes.begin() + mid, _nodes.begin() + hi,
+			  [axis]( const node_t &a, const node_t &b )
+	{
+		return a.pos[axis] < b.pos[axis];
+	} );
+	_nodes[mid].axis = axis;
+
+	r_build( lo, mid );
+	r_build( mid + 1, hi );
+}
+
+/**
+ * Returns the index of the point closest to the indicated position, or -1 if
+ * the tree is empty.  If dist_sq is not null, it is filled in with the
+ * squared distance to that point.
+ */
+int FlatKDTree::find_nearest( const LPoint3 &pos, float *dist_sq ) const
+{
+	float fpos[3] = { (float)pos[0], (float)pos[1], (float)pos[2] };
+	int best = -1;
+	float best_dist_sq = FLT_MAX;
+	r_find_nearest( 0, (int)_nodes.size(), fpos, best, best_dist_sq );
+
+	if ( dist_sq != nullptr )
+	{
+		*dist_sq = best_dist_sq;
+	}
+
+	return best == -1 ? -1 : _nodes[best].index;
+}
+
+void FlatKDTree::r_find_nearest( int lo, int hi, const float *pos, int &best, float &best_dist_sq ) const
+{
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) >> 1;
+		const node_t &node = _nodes[mid];
+
+		float d = node_dist_sq( node.pos, pos );
+		if ( d < best_dist_sq )
+		{
+			best_dist_sq = d;
+			best = mid;
+		}
+
+		float diff = pos[node.axis] - node.pos[node.axis];
+		if ( diff < 0.0f )
+		{
+			r_find_nearest( lo, mid, pos, best, best_dist_sq );
+			if ( diff * diff >= best_dist_sq )
+				return;
+			lo = mid + 1;
+		}
+		else
+		{
+			r_find_nearest( mid + 1, hi, pos, best, best_dist_sq );
+			if ( diff * diff >= best_dist_sq )
+				return;
+			hi = mid;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+/**
+ * PANDA3D BSP LIBRARY
+ *
+ * Copyright (c) Brian Lach <brianlach72@gmail.com>
+ * All rights reserved.
+ *
+ * @file flat_kdtree.h
+ */
+
+#ifndef FLAT_KDTREE_H
+#define FLAT_KDTREE_H
+
+#include "config_bsp.h"
+
+#include <referenceCount.h>
+#include <pvector.h>
+#include <luse.h>
+
+/**
+ * A static 3D kd-tree for finding the point closest to a position, used for
+ * the ambient probes and cubemaps.
+ *
+ * The tree is stored implicitly in a single array: the node of the range
+ * [lo, hi) is at the middle of that range, and its children are the halves
+ * on either side of it.  There are no child pointers to chase, and queries
+ * don't allocate anything.
+ */
+class EXPCL_PANDABSP FlatKDTree : public ReferenceCount
+{
+public:
+	void build( const pvector<LPoint3> &points );
+	void clear();
+
+	INLINE int get_num_points() const
+	{
+		return (int)_nodes.size();
+	}
+
+	int find_nearest( const LPoint3 &pos, float *dist_sq = nullptr ) const;
+
+private:
+	struct node_t
+	{
+		float pos[3];
+		// Index of the point in the array that the tree was built from.
+		int index;
+		int axis;
+	};
+
+	void r_build( int lo, int hi );
+	void r_find_nearest( int lo, int hi, const float *pos, int &best, float &best_dist_sq ) const;
+
+	pvector<node_t> _nodes;
+};
+
+#endif // FLAT_KDTREE_H
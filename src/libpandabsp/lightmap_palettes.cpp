@@ -14,6 +14,8 @@
 #include "bsploader.h"
 #include "TexturePacker.h"
 
+#include <texture.h>
+
 #include <bitset>
 #include <cstdio>
 
@@ -28,11 +30,20 @@ static const int max_palette = 1024;
 //#define LMPALETTE_SPLIT
 
 LightmapPalettizer::LightmapPalettizer( const BSPLoader *loader ) :
-        _loader( loader )
+        _data( loader->get_bspdata() )
+{
+}
+
+LightmapPalettizer::LightmapPalettizer( bspdata_t *data ) :
+        _data( data )
 {
 }
 
-INLINE PNMImage lightmap_img_for_face( const BSPLoader *loader, const dface_t *face, int lmnum = 0, bool bounced = false )
+/**
+ * Decodes a lightmap of the face into 16-bit texels, top row first.
+ */
+INLINE void decode_face_lightmap( bspdata_t *data, const dface_t *face, pvector<unsigned short> &texels,
+                                  int lmnum = 0, bool bounced = false )
 {
         int width = face->lightmap_size[0] + 1;
         int height = face->lightmap_size[1] + 1;
@@ -41,43 +52,42 @@ INLINE PNMImage lightmap_img_for_face( const BSPLoader *loader, const dface_t *f
         if ( num_luxels <= 0 )
         {
                 lightmapPalettizer_cat.warning()
-                        << "Face has 0 size lightmap, will appear fullbright" << std::endl;
-                PNMImage img( 16, 16 );
-                img.fill( 1.0 );
-                return img;
+                        << "Face has 0 size lightmap, will appear black" << std::endl;
+                texels.clear();
+                return;
         }
 
-        PNMImage img( width, height );
-	img.fill( 0 );
-	img.set_color_space( ColorSpace::CS_linear );
-	img.set_maxval( USHRT_MAX ); // ensure we get 16-bit color depth
+        const colorrgbexp32_t *samples;
+        if ( !bounced )
+                samples = SampleLightmap( data, face, 0, 0, lmnum );
+        else
+                samples = SampleBouncedLightmap( data, face, 0 );
 
-        int luxel = 0;
+        // Luxels are in linear-space.
+        texels.resize( num_luxels * 3 );
+        ColorRGBExp32ToTexels16( samples, num_luxels, 1.0f / 255.0f, texels.data() );
+}
 
-        for ( int y = 0; y < height; y++ )
+/**
+ * Returns the lightmap palettes of the level.  They come straight from the
+ * pages that p3rad packed into the BSP file, if it has them, otherwise the
+ * lightmaps are packed now.
+ */
+LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
+{
+        LightmapPaletteDirectory dir;
+        if ( load_lightmap_pages( dir ) )
         {
-                for ( int x = 0; x < width; x++ )
-                {
-                        colorrgbexp32_t *sample;
-                        if ( !bounced )
-                                sample = SampleLightmap( loader->get_bspdata(), face, luxel, 0, lmnum );
-                        else
-                                sample = SampleBouncedLightmap( loader->get_bspdata(), face, luxel );
-
-			// Luxel is in linear-space.
-			LVector3 luxel_col;
-			ColorRGBExp32ToVector( *sample, luxel_col );
-			luxel_col /= 255.0f;
-
-                        img.set_xel( x, y, luxel_col );
-                        luxel++;
-                }
+                return dir;
         }
 
-        return img;
+        return pack_lightmaps();
 }
 
-LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
+/**
+ * Packs the lightmaps of every face into palettes.
+ */
+LightmapPaletteDirectory LightmapPalettizer::pack_lightmaps()
 {
         LightmapPaletteDirectory dir;
 
@@ -87,9 +97,9 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
         result_vec.push_back( pal );
 
         // First step, build sources.
-        for ( int facenum = 0; facenum < _loader->get_bspdata()->numfaces; facenum++ )
+        for ( int facenum = 0; facenum < _data->numfaces; facenum++ )
         {
-                dface_t *face = _loader->get_bspdata()->dfaces + facenum;
+                dface_t *face = _data->dfaces + facenum;
                 if ( face->lightofs == -1 )
                 {
                         // Face does not have a lightmap.
@@ -98,25 +108,27 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
                 LightmapSource src;
                 src.facenum = facenum;
-                src.lightmap_img[0] = lightmap_img_for_face( _loader, face, 0, true ); // bounced lightmap
+                src.width = face->lightmap_size[0] + 1;
+                src.height = face->lightmap_size[1] + 1;
+                decode_face_lightmap( _data, face, src.lightmap[0], 0, true ); // bounced lightmap
                 if ( face->bumped_lightmap )
                 {
                         for ( int n = 0; n < NUM_BUMP_VECTS + 1; n++ )
                         {
-                                src.lightmap_img[n + 1] = lightmap_img_for_face( _loader, face, n );
+                                decode_face_lightmap( _data, face, src.lightmap[n + 1], n );
                         }
                 }
                 else
                 {
-                        src.lightmap_img[1] = lightmap_img_for_face( _loader, face, 0 );
+                        decode_face_lightmap( _data, face, src.lightmap[1], 0 );
                 }
                 
-                _sources.push_back( src );
+                _sources.push_back( std::move( src ) );
         }
 
         for ( size_t i = 0; i < _sources.size(); i++ )
         {
-                dface_t *face = _loader->get_bspdata()->dfaces + _sources[i].facenum;
+                dface_t *face = _data->dfaces + _sources[i].facenum;
 
 #ifdef LMPALETTE_SPLIT
                 bool any_fit = false;
@@ -162,91 +174,47 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
                 PT( LightmapPaletteDirectory::LightmapPaletteEntry ) entry = new LightmapPaletteDirectory::LightmapPaletteEntry;
 
-                for ( int n = 0; n < NUM_LIGHTMAPS; n++ )
-                {
-                        pal->palette_img[n] = PNMImage( width, height );
-			pal->palette_img[n].set_color_space( ColorSpace::CS_linear );
-			pal->palette_img[n].set_maxval( USHRT_MAX );
-                        pal->palette_img[n].fill( 0.0 );
-                }
-
                 entry->palette_tex = new Texture;
                 entry->palette_tex->setup_2d_texture_array( width, height, NUM_LIGHTMAPS, Texture::T_unsigned_short, Texture::F_rgb );
                 entry->palette_tex->set_minfilter( SamplerState::FT_linear_mipmap_linear );
                 entry->palette_tex->set_magfilter( SamplerState::FT_linear );
 
+                // Copy the lightmaps straight into the RAM image of the array
+                // texture, one layer after the other.
+                size_t layer_texels = (size_t)width * height * 3;
+                PTA_uchar image = PTA_uchar::empty_array( layer_texels * NUM_LIGHTMAPS * sizeof( unsigned short ) );
+                unsigned short *texels = (unsigned short *)image.p();
+
                 for ( size_t j = 0; j < pal->sources.size(); j++ )
                 {
                         LightmapSource *src = pal->sources[j];
-                        int xshift, yshift, lmwidth, lmheight;
-                        bool rotated;
                         TextureLocation tloc = pal->packer->getTextureLocation( j );
-                        xshift = tloc.get_x();
-                        yshift = tloc.get_y();
-                        lmwidth = tloc.get_width();
-                        lmheight = tloc.get_height();
-                        rotated = tloc.get_rotated();
 
                         PT( LightmapPaletteDirectory::LightmapFacePaletteEntry ) face_entry = new LightmapPaletteDirectory::LightmapFacePaletteEntry;
                         face_entry->palette = entry;
-                        face_entry->flipped = rotated;
-                        face_entry->xshift = xshift;
-                        face_entry->yshift = yshift;
+                        face_entry->flipped = tloc.get_rotated();
+                        face_entry->xshift = tloc.get_x();
+                        face_entry->yshift = tloc.get_y();
                         face_entry->palette_size[0] = width;
                         face_entry->palette_size[1] = height;
 
-                        // Bounced
-                        for ( int y = 0; y < lmheight; y++ )
+                        for ( int n = 0; n < NUM_LIGHTMAPS; n++ )
                         {
-                                for ( int x = 0; x < lmwidth; x++ )
+                                if ( src->lightmap[n].empty() )
                                 {
-                                        pal->palette_img[0].set_xel( x + xshift, y + yshift,
-                                                rotated ? src->lightmap_img[0].get_xel( y, x ) :
-                                                src->lightmap_img[0].get_xel( x, y ) );
+                                        continue;
                                 }
-                        }
 
-                        if ( _loader->get_bspdata()->dfaces[src->facenum].bumped_lightmap )
-                        {
-                                for ( int n = 0; n < NUM_BUMP_VECTS + 1; n++ )
-                                {
-                                        for ( int y = 0; y < lmheight; y++ )
-                                        {
-                                                for ( int x = 0; x < lmwidth; x++ )
-                                                {
-                                                        pal->palette_img[n + 1].set_xel( x + xshift, y + yshift,
-                                                                                     rotated ? src->lightmap_img[n + 1].get_xel( y, x ) :
-                                                                                     src->lightmap_img[n + 1].get_xel( x, y ) );
-                                                }
-                                        }
-                                }
-                                
-                        }
-                        else
-                        {
-                                for ( int y = 0; y < lmheight; y++ )
-                                {
-                                        for ( int x = 0; x < lmwidth; x++ )
-                                        {
-                                                pal->palette_img[1].set_xel( x + xshift, y + yshift,
-                                                                             rotated ? src->lightmap_img[1].get_xel( y, x ) :
-                                                                             src->lightmap_img[1].get_xel( x, y ) );
-                                        }
-                                }
+                                BlitTexels16( src->lightmap[n].data(), src->width, src->height,
+                                              texels + n * layer_texels, width, height,
+                                              face_entry->xshift, face_entry->yshift, face_entry->flipped );
                         }
-                        
-                        
 
-                        
                         dir.face_index[src->facenum] = face_entry;
                         dir.face_entries.push_back( face_entry );
                 }
 
-                // load all palette images into our array texture
-                for ( int n = 0; n < NUM_LIGHTMAPS; n++ )
-                {
-                        entry->palette_tex->load( pal->palette_img[n], n, 0 );
-                }
+                entry->palette_tex->set_ram_image( image );
 
                 dir.entries.push_back( entry );
 
@@ -256,3 +224,144 @@ LightmapPaletteDirectory LightmapPalettizer::palettize_lightmaps()
 
         return dir;
 }
+
+/**
+ * Fills in the directory from the lightmap pages of the BSP file.  The texels
+ * are already laid out the way the texture wants them, so they are handed to
+ * it as they are.  Returns false if the file doesn't have (usable) pages.
+ */
+bool LightmapPalettizer::load_lightmap_pages( LightmapPaletteDirectory &dir ) const
+{
+        if ( _data->lightmappages.empty() ||
+             (int)_data->lightmappageinfos.size() != _data->numfaces )
+        {
+                return false;
+        }
+
+        for ( size_t i = 0; i < _data->lightmappages.size(); i++ )
+        {
+                const dlightmappage_t *page = &_data->lightmappages[i];
+
+                size_t size = (size_t)page->width * page->height * page->num_layers * 3 * sizeof( unsigned short );
+                if ( page->width <= 0 || page->height <= 0 || page->num_layers != NUM_LIGHTMAPS ||
+                     page->dataofs < 0 || page->dataofs + size > _data->lightmappagedata.size() )
+                {
+                        lightmapPalettizer_cat.warning()
+                                << "Lightmap page " << i << " is invalid, packing the lightmaps instead\n";
+                        dir.entries.clear();
+                        return false;
+                }
+
+                PT( LightmapPaletteDirectory::LightmapPaletteEntry ) entry = new LightmapPaletteDirectory::LightmapPaletteEntry;
+                entry->palette_tex = new Texture;
+                entry->palette_tex->setup_2d_texture_array( page->width, page->height, page->num_layers,
+                                                            Texture::T_unsigned_short, Texture::F_rgb );
+                entry->palette_tex->set_minfilter( SamplerState::FT_linear_mipmap_linear );
+                entry->palette_tex->set_magfilter( SamplerState::FT_linear );
+
+                PTA_uchar image = PTA_uchar::empty_array( size );
+                memcpy( image.p(), _data->lightmappagedata + page->dataofs, size );
+                entry->palette_tex->set_ram_image( image );
+
+                dir.entries.push_back( entry );
+        }
+
+        for ( int facenum = 0; facenum < _data->numfaces; facenum++ )
+        {
+                const dlightmappageinfo_t *info = &_data->lightmappageinfos[facenum];
+                if ( info->page < 0 || info->page >= (int)dir.entries.size() )
+                {
+                        continue;
+                }
+
+                LightmapPaletteDirectory::LightmapPaletteEntry *entry = dir.entries[info->page];
+
+                PT( LightmapPaletteDirectory::LightmapFacePaletteEntry ) face_entry = new LightmapPaletteDirectory::LightmapFacePaletteEntry;
+                face_entry->palette = entry;
+                face_entry->flipped = ( info->flags & LIGHTMAPPAGEINFO_FLIPPED ) != 0;
+                face_entry->xshift = info->offset[0];
+                face_entry->yshift = info->offset[1];
+                face_entry->palette_size[0] = entry->palette_tex->get_x_size();
+                face_entry->palette_size[1] = entry->palette_tex->get_y_size();
+
+                dir.face_index[facenum] = face_entry;
+                dir.face_entries.push_back( face_entry );
+        }
+
+        return true;
+}
+
+/**
+ * Stores the palettes of the directory in the lightmap page lumps of the BSP
+ * file, so the game can load them with load_lightmap_pages().  Returns false
+ * if a palette isn't in the format the pages are stored in.
+ */
+bool LightmapPalettizer::write_lightmap_pages( const LightmapPaletteDirectory &dir )
+{
+        _data->lightmappages.clear();
+        _data->lightmappageinfos.clear();
+        _data->lightmappagedata.clear();
+
+        pmap<const LightmapPaletteDirectory::LightmapPaletteEntry *, int> page_index;
+
+        for ( size_t i = 0; i < dir.entries.size(); i++ )
+        {
+                Texture *tex = dir.entries[i]->palette_tex;
+                CPTA_uchar image = tex->get_ram_image();
+
+                dlightmappage_t page;
+                page.width = tex->get_x_size();
+                page.height = tex->get_y_size();
+                page.num_layers = tex->get_z_size();
+                page.dataofs = (int)_data->lightmappagedata.size();
+
+                size_t size = (size_t)page.width * page.height * page.num_layers * 3 * sizeof( unsigned short );
+                if ( tex->get_component_type() != Texture::T_unsigned_short ||
+                     tex->get_num_components() != 3 || image.size() != size )
+                {
+                        lightmapPalettizer_cat.error()
+                                << "Lightmap palette " << i << " is not 16-bit RGB, not writing lightmap pages\n";
+                        _data->lightmappages.clear();
+                        _data->lightmappagedata.clear();
+                        return false;
+                }
+
+                _data->lightmappagedata.resize( page.dataofs + size );
+                memcpy( _data->lightmappagedata + page.dataofs, image.p(), size );
+                _data->lightmappages.push_back( page );
+
+                page_index[dir.entries[i]] = (int)i;
+        }
+
+        _data->lightmappageinfos.resize( _data->numfaces );
+        for ( int facenum = 0; facenum < _data->numfaces; facenum++ )
+        {
+                dlightmappageinfo_t *info = &_data->lightmappageinfos[facenum];
+                info->page = -1;
+                info->offset[0] = info->offset[1] = 0;
+                info->flags = 0;
+
+                auto fitr = dir.face_index.find( facenum );
+                if ( fitr == dir.face_index.end() || fitr->second == nullptr )
+                {
+                        continue;
+                }
+
+                const LightmapPaletteDirectory::LightmapFacePaletteEntry *face_entry = fitr->second;
+                auto pitr = page_index.find( face_entry->palette );
+                if ( pitr == page_index.end() )
+                {
+                        continue;
+                }
+
+                info->page = pitr->second;
+                info->offset[0] = (unsigned short)face_entry->xshift;
+                info->offset[1] = (unsigned short)face_entry->yshift;
+                if ( face_entry->flipped )
+                {
+                        info->flags |= LIGHTMAPPAGEINFO_FLIPPED;
+                }
+        }
+
+        return true;
+}
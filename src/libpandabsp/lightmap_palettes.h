@@ -24,9 +24,10 @@
 
 class BSPLoader;
 class TexturePacker;
+struct bspdata_t;
 
 //#define NUM_LIGHTMAPS 1 + ((NUM_BUMP_VECTS + 1) * 2)
-#define NUM_LIGHTMAPS 1 + (NUM_BUMP_VECTS + 1)
+#define NUM_LIGHTMAPS ( 1 + ( NUM_BUMP_VECTS + 1 ) )
 
 struct LightmapPaletteDirectory
 {
@@ -51,29 +52,16 @@ struct LightmapPaletteDirectory
 struct LightmapSource
 {
         int facenum;
-        PNMImage lightmap_img[NUM_LIGHTMAPS];
-
-        LightmapSource()
-        {
-                for ( int i = 0; i < NUM_LIGHTMAPS; i++ )
-                {
-                        lightmap_img[i] = PNMImage( 1, 1 );
-                }
-        }
+        int width, height;
+        // The decoded texels of each lightmap, top row first.  Empty if the
+        // face doesn't have that lightmap.
+        pvector<unsigned short> lightmap[NUM_LIGHTMAPS];
 };
 
 struct Palette
 {
         pvector<LightmapSource *> sources;
-        PNMImage palette_img[NUM_LIGHTMAPS];
         TexturePacker *packer;
-        Palette()
-        {
-                for ( int i = 0; i < NUM_LIGHTMAPS; i++ )
-                {
-                        palette_img[i] = PNMImage( 1, 1 );
-                }
-        }
 };
 
 NotifyCategoryDeclNoExport(lightmapPalettizer);
@@ -97,10 +85,15 @@ class EXPCL_PANDABSP LightmapPalettizer
 {
 public:
         LightmapPalettizer( const BSPLoader *loader );
+        LightmapPalettizer( bspdata_t *data );
         LightmapPaletteDirectory palettize_lightmaps();
+        LightmapPaletteDirectory pack_lightmaps();
+
+        bool load_lightmap_pages( LightmapPaletteDirectory &dir ) const;
+        bool write_lightmap_pages( const LightmapPaletteDirectory &dir );
 
 private:
-        const BSPLoader *_loader;
+        bspdata_t *_data;
         pvector<LightmapSource> _sources;
 };
 
@@ -28,7 +28,7 @@ CBaseEntity *Py_BSPLoader::get_c_entity( const int entnum ) const
 	return nullptr;
 }
 
-PyObject *Py_BSPLoader::find_all_entities( const string &classname )
+PyObject *Py_BSPLoader::find_all_entities( const std::string &classname )
 {
 	PyObject *list = PyList_New( 0 );
 
@@ -107,7 +107,7 @@ void Py_BSPLoader::link_cent_to_pyent( int entnum, PyObject *pyent )
 	}
 }
 
-PyObject *Py_BSPLoader::get_py_entity_by_target_name( const string &targetname ) const
+PyObject *Py_BSPLoader::get_py_entity_by_target_name( const std::string &targetname ) const
 {
 	for ( size_t i = 0; i < _entities.size(); i++ )
 	{
@@ -117,7 +117,7 @@ PyObject *Py_BSPLoader::get_py_entity_by_target_name( const string &targetname )
 		PyObject *pyent = def.py_entity;
 		if ( !pyent )
 			continue;
-		string tname = def.c_entity->get_entity_value( "targetname" );
+		std::string tname = def.c_entity->get_entity_value( "targetname" );
 		if ( tname == targetname )
 		{
 			Py_INCREF( pyent );
@@ -175,7 +175,7 @@ void Py_BSPLoader::spawn_entities()
 
 //============================================================================================
 
-PyObject *Py_CL_BSPLoader::make_pyent( PyObject *py_ent, const string &classname )
+PyObject *Py_CL_BSPLoader::make_pyent( PyObject *py_ent, const std::string &classname )
 {
 	if ( _entity_to_class.find( classname ) != _entity_to_class.end() )
 	{
@@ -195,7 +195,7 @@ PyObject *Py_CL_BSPLoader::make_pyent( PyObject *py_ent, const string &classname
 	return nullptr;
 }
 
-void Py_CL_BSPLoader::link_entity_to_class( const string &entname, PyTypeObject *type )
+void Py_CL_BSPLoader::link_entity_to_class( const std::string &entname, PyTypeObject *type )
 {
 	_entity_to_class[entname] = type;
 }
@@ -248,9 +248,9 @@ void Py_CL_BSPLoader::load_entities()
 	{
 		entity_t *ent = &_bspdata->entities[entnum];
 
-		string classname = ValueForKey( ent, "classname" );
+		std::string classname = ValueForKey( ent, "classname" );
 		const char *psz_classname = classname.c_str();
-		string id = ValueForKey( ent, "id" );
+		std::string id = ValueForKey( ent, "id" );
 
 		vec_t origin[3];
 		GetVectorDForKey( ent, "origin", origin );
@@ -258,7 +258,7 @@ void Py_CL_BSPLoader::load_entities()
 		vec_t angles[3];
 		GetVectorDForKey( ent, "angles", angles );
 
-		string targetname = ValueForKey( ent, "targetname" );
+		std::string targetname = ValueForKey( ent, "targetname" );
 
 		if ( !strncmp( classname.c_str(), "trigger_", 8 ) ||
 			!strncmp( classname.c_str(), "func_water", 10 ) )
@@ -393,7 +393,7 @@ void Py_AI_BSPLoader::set_server_entity_dispatcher( PyObject *dispatch )
 	_sv_ent_dispatch = dispatch;
 }
 
-void Py_AI_BSPLoader::link_server_entity_to_class( const string &name, PyTypeObject *type )
+void Py_AI_BSPLoader::link_server_entity_to_class( const std::string &name, PyTypeObject *type )
 {
 	_svent_to_class[name] = type;
 }
@@ -404,9 +404,9 @@ void Py_AI_BSPLoader::load_entities()
 	{
 		entity_t *ent = &_bspdata->entities[entnum];
 
-		string classname = ValueForKey( ent, "classname" );
+		std::string classname = ValueForKey( ent, "classname" );
 		const char *psz_classname = classname.c_str();
-		string id = ValueForKey( ent, "id" );
+		std::string id = ValueForKey( ent, "id" );
 
 		vec_t origin[3];
 		GetVectorDForKey( ent, "origin", origin );
@@ -414,7 +414,7 @@ void Py_AI_BSPLoader::load_entities()
 		vec_t angles[3];
 		GetVectorDForKey( ent, "angles", angles );
 
-		string targetname = ValueForKey( ent, "targetname" );
+		std::string targetname = ValueForKey( ent, "targetname" );
 
 		if ( _svent_to_class.find( classname ) != _svent_to_class.end() )
 		{
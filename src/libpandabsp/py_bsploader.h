@@ -24,7 +24,7 @@
 class Py_BSPLoader : public BSPLoader
 {
 PUBLISHED:
-	PyObject *find_all_entities( const string &classname );
+	PyObject *find_all_entities( const std::string &classname );
 
 	int get_num_entities() const; //
 	PyObject *get_entity( int n ) const; //
@@ -32,7 +32,7 @@ PUBLISHED:
 	CBaseEntity *get_c_entity( const int entnum ) const; //
 	void get_entity_keyvalues( PyObject *list, const int entnum ); //
 	void link_cent_to_pyent( int entum, PyObject *pyent ); //
-	PyObject *get_py_entity_by_target_name( const string &targetname ) const; //
+	PyObject *get_py_entity_by_target_name( const std::string &targetname ) const; //
 
 	void spawn_entities();
 
@@ -49,8 +49,8 @@ class Py_CL_BSPLoader : public Py_BSPLoader
 PUBLISHED:
 	Py_CL_BSPLoader();
 
-	void link_entity_to_class( const string &entname, PyTypeObject *type );
-	PyObject *make_pyent( PyObject *pyent, const string &classname );
+	void link_entity_to_class( const std::string &entname, PyTypeObject *type );
+	PyObject *make_pyent( PyObject *pyent, const std::string &classname );
 
 protected:
 	virtual void load_geometry();
@@ -61,7 +61,7 @@ private:
 	// for purely client-sided, non networked entities
 	//
 	// utilized only by the client
-	pmap<string, PyTypeObject *> _entity_to_class;
+	pmap<std::string, PyTypeObject *> _entity_to_class;
 };
 
 class Py_AI_BSPLoader : public Py_BSPLoader
@@ -74,7 +74,7 @@ PUBLISHED:
 	void mark_entity_preserved( int n, bool preserved = true );
 
 	void set_server_entity_dispatcher( PyObject *dispatcher );
-	void link_server_entity_to_class( const string &name, PyTypeObject *type );
+	void link_server_entity_to_class( const std::string &name, PyTypeObject *type );
 
 	INLINE void set_transition_landmark( const std::string &name,
 					     const LVector3 &origin,
@@ -105,7 +105,7 @@ private:
 	//
 	// utilized only by the AI
 	PyObject *_sv_ent_dispatch;
-	pmap<string, PyTypeObject *> _svent_to_class;
+	pmap<std::string, PyTypeObject *> _svent_to_class;
 
 	NodePath _transition_source_landmark;
 	NodePath _transition_dest_landmark;
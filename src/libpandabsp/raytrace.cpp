@@ -2,6 +2,8 @@
 
 #include <geomVertexReader.h>
 
+#include <algorithm>
+
 #include <embree3/rtcore.h>
 
 NotifyCategoryDef( raytrace, "" );
@@ -42,6 +44,10 @@ RayTraceGeometry::RayTraceGeometry( int type, const std::string &name ) :
         rtcSetGeometryMask( _geometry, BitMask32::all_on().get_word() );
         _geom_id = 0;
         _rtscene = nullptr;
+        _instance_scene = nullptr;
+        _instance = nullptr;
+        _instance_id = 0;
+        _instance_needs_commit = false;
         _last_trans = nullptr;
 
         set_cull_callback();
@@ -66,15 +72,24 @@ void RayTraceGeometry::update_rtc_transform( const TransformState *ts )
         {
                 _last_trans = ts;
 
-                const LMatrix4 &mat = _last_trans->get_mat();
+                // Only the instance of dynamic geometry can be moved.
+                if ( _instance == nullptr )
+                        return;
+
+                const LMatrix4f mat = LCAST( float, _last_trans->get_mat() );
 
-                rtcSetGeometryTransform( _geometry, 0, RTC_FORMAT_FLOAT4X4_ROW_MAJOR, mat.get_data() );
-                rtcCommitGeometry( _geometry );
+                // Panda's row-vector matrices are laid out in memory the same
+                // way as Embree's column-major ones.
+                rtcSetGeometryTransform( _instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, mat.get_data() );
+                rtcCommitGeometry( _instance );
                 if ( _rtscene )
                         _rtscene->_scene_needs_rebuild = true;
 
-                raytrace_cat.debug()
-                        << "Updated geometry transform\n";
+                if ( raytrace_cat.is_debug() )
+                {
+                        raytrace_cat.debug()
+                                << "Updated geometry transform\n";
+                }
         }
 }
 
@@ -112,8 +127,11 @@ void RayTraceTriangleMesh::add_triangle( const LPoint3 &p1, const LPoint3 &p2, c
         tri.v3 = idx + 2;
         _tris.push_back( tri );
 
-        raytrace_cat.debug()
-                << "Added triangle [" << p1 << ", " << p2 << ", " << p3 << "]\n";
+        if ( raytrace_cat.is_debug() )
+        {
+                raytrace_cat.debug()
+                        << "Added triangle [" << p1 << ", " << p2 << ", " << p3 << "]\n";
+        }
 }
 
 void RayTraceTriangleMesh::add_triangles_from_geom( const Geom *geom, const TransformState *ts )
@@ -181,23 +199,65 @@ void RayTraceTriangleMesh::build()
 
 //==================================================================//
 
-RayTraceScene::RayTraceScene()
+RayTraceScene::RayTraceScene() :
+        _scene_needs_rebuild( false ),
+        _static_needs_commit( false ),
+        _next_geom_id( 0 )
 {
         nassertv( RayTrace::get_device() != nullptr );
+
         _scene = rtcNewScene( RayTrace::get_device() );
+        // There are only a few instances up here, and they move.
+        rtcSetSceneFlags( _scene, RTC_SCENE_FLAG_DYNAMIC );
+
+        _static_scene = rtcNewScene( RayTrace::get_device() );
+
+        _static_instance = rtcNewGeometry( RayTrace::get_device(), RTC_GEOMETRY_TYPE_INSTANCE );
+        rtcSetGeometryInstancedScene( _static_instance, _static_scene );
+        rtcSetGeometryTransform( _static_instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR,
+                                 LMatrix4f::ident_mat().get_data() );
+        rtcCommitGeometry( _static_instance );
+        _static_instance_id = rtcAttachGeometry( _scene, _static_instance );
+
         raytrace_cat.debug()
                 << "Made new raytrace scene\n";
 }
 
 RayTraceScene::~RayTraceScene()
 {
+        remove_all();
+
         if ( _scene )
                 rtcReleaseScene( _scene );
+        if ( _static_instance )
+                rtcReleaseGeometry( _static_instance );
+        if ( _static_scene )
+                rtcReleaseScene( _static_scene );
 }
 
+unsigned int RayTraceScene::alloc_geom_id()
+{
+        // Reuse the IDs of removed geometry, Embree wants them compact.
+        if ( !_free_geom_ids.empty() )
+        {
+                unsigned int geom_id = _free_geom_ids.back();
+                _free_geom_ids.pop_back();
+                return geom_id;
+        }
+
+        return _next_geom_id++;
+}
+
+/**
+ * Adds geometry that never moves.  It goes into the static scene, with the
+ * rest of the level, and its transform is never looked at.
+ */
 void RayTraceScene::add_geometry( RayTraceGeometry *geom )
 {
-        unsigned int geom_id = rtcAttachGeometry( _scene, geom->get_geometry() );
+        nassertv( geom->_rtscene == nullptr );
+
+        unsigned int geom_id = alloc_geom_id();
+        rtcAttachGeometryByID( _static_scene, geom->get_geometry(), geom_id );
         RTCError err = rtcGetDeviceError( RayTrace::get_device() );
         raytrace_cat.debug()
                 << "add_geometry: rtcError: " << err << "\n";
@@ -206,55 +266,165 @@ void RayTraceScene::add_geometry( RayTraceGeometry *geom )
         _geoms[geom_id] = geom;
         raytrace_cat.debug()
                 << "Attached geometry " << geom_id << "\n";
+        _static_needs_commit = true;
+}
+
+/**
+ * Adds geometry that follows the net transform of its node around.  Only
+ * dynamic geometry is checked for movement in update().
+ */
+void RayTraceScene::add_dynamic_geometry( RayTraceGeometry *geom )
+{
+        nassertv( geom->_rtscene == nullptr );
+
+        unsigned int geom_id = alloc_geom_id();
+
+        geom->_instance_scene = rtcNewScene( RayTrace::get_device() );
+        rtcAttachGeometryByID( geom->_instance_scene, geom->get_geometry(), geom_id );
+        geom->_instance_needs_commit = true;
+
+        geom->_instance = rtcNewGeometry( RayTrace::get_device(), RTC_GEOMETRY_TYPE_INSTANCE );
+        rtcSetGeometryInstancedScene( geom->_instance, geom->_instance_scene );
+        geom->_geom_id = geom_id;
+        geom->_rtscene = this;
+        geom->_last_trans = nullptr;
+        geom->update_rtc_transform( NodePath( geom ).get_net_transform() );
+        geom->_instance_id = rtcAttachGeometry( _scene, geom->_instance );
+
+        _geoms[geom_id] = geom;
+        _dynamic_geoms.push_back( geom );
+        raytrace_cat.debug()
+                << "Attached dynamic geometry " << geom_id << "\n";
         _scene_needs_rebuild = true;
 }
 
-void RayTraceScene::remove_geometry( RayTraceGeometry *geom )
+void RayTraceScene::detach_geometry( RayTraceGeometry *geom )
 {
-        rtcDetachGeometry( _scene, geom->_geom_id );
+        if ( geom->_instance != nullptr )
+        {
+                rtcDetachGeometry( _scene, geom->_instance_id );
+                rtcReleaseGeometry( geom->_instance );
+                rtcReleaseScene( geom->_instance_scene );
+                geom->_instance = nullptr;
+                geom->_instance_scene = nullptr;
+                geom->_instance_id = 0;
+                geom->_instance_needs_commit = false;
+                _scene_needs_rebuild = true;
+        }
+        else
+        {
+                rtcDetachGeometry( _static_scene, geom->_geom_id );
+                _static_needs_commit = true;
+        }
+
         geom->_geom_id = 0;
         geom->_rtscene = nullptr;
-        _geoms.remove( geom->_geom_id );
+        geom->_last_trans = nullptr;
+}
+
+void RayTraceScene::remove_geometry( RayTraceGeometry *geom )
+{
+        nassertv( geom->_rtscene == this );
+
+        unsigned int geom_id = geom->_geom_id;
+        if ( geom->_instance != nullptr )
+        {
+                auto itr = std::find( _dynamic_geoms.begin(), _dynamic_geoms.end(), geom );
+                if ( itr != _dynamic_geoms.end() )
+                        _dynamic_geoms.erase( itr );
+        }
+
+        detach_geometry( geom );
+
+        _geoms.remove( geom_id );
+        _free_geom_ids.push_back( geom_id );
 }
 
 void RayTraceScene::remove_all()
 {
-        for ( size_t i = 0; i < _geoms.size(); i++ )
+        for ( size_t i = 0; i < _geoms.get_num_entries(); i++ )
         {
-                RayTraceGeometry *geom = _geoms[i];
-                rtcDetachGeometry( _scene, geom->_geom_id );
-                geom->_geom_id = 0;
-                geom->_rtscene = nullptr;
+                detach_geometry( _geoms.get_data( i ) );
         }
 
         _geoms.clear();
+        _dynamic_geoms.clear();
+        _free_geom_ids.clear();
+        _next_geom_id = 0;
 }
 
 void RayTraceScene::set_build_quality( int quality )
 {
-        rtcSetSceneBuildQuality( _scene, (RTCBuildQuality)quality );
+        // The top-level scene is rebuilt whenever something moves, it stays
+        // at the default quality.
+        rtcSetSceneBuildQuality( _static_scene, (RTCBuildQuality)quality );
 }
 
+/**
+ * Picks up the movement of dynamic geometry and commits whatever changed.
+ * Static geometry costs nothing here.
+ */
 void RayTraceScene::update()
 {
         nassertv( _scene != nullptr );
 
-        size_t num_geoms = _geoms.size();
-        for ( size_t i = 0; i < num_geoms; i++ )
+        size_t num_dynamic = _dynamic_geoms.size();
+        for ( size_t i = 0; i < num_dynamic; i++ )
         {
-                RayTraceGeometry *geom = _geoms[i];
+                RayTraceGeometry *geom = _dynamic_geoms[i];
+                if ( geom->_instance_needs_commit )
+                {
+                        rtcCommitScene( geom->_instance_scene );
+                        geom->_instance_needs_commit = false;
+                        _scene_needs_rebuild = true;
+                }
                 geom->update_rtc_transform( NodePath( geom ).get_net_transform() );
         }
 
-        if ( _scene_needs_rebuild )
+        if ( _static_needs_commit )
         {
                 raytrace_cat.info()
-                        << "Committing scene\n";
+                        << "Committing static scene\n";
+                rtcCommitScene( _static_scene );
+                _static_needs_commit = false;
+                // The instance of it has to be committed again too.
+                _scene_needs_rebuild = true;
+        }
+
+        if ( _scene_needs_rebuild )
+        {
                 rtcCommitScene( _scene );
                 _scene_needs_rebuild = false;
         }
 }
 
+/**
+ * Hits on dynamic geometry come back with the normal in the space of the
+ * geometry, this puts it back in world space.
+ */
+LVector3 RayTraceScene::get_world_normal( unsigned int inst_id, unsigned int geom_id, const LVector3 &normal )
+{
+        if ( inst_id == _static_instance_id || inst_id == RTC_INVALID_GEOMETRY_ID )
+        {
+                return normal;
+        }
+
+        int idx = _geoms.find( geom_id );
+        if ( idx == -1 )
+        {
+                return normal;
+        }
+
+        const RayTraceGeometry *geom = _geoms.get_data( idx );
+        if ( geom->_last_trans == nullptr )
+        {
+                return normal;
+        }
+
+        // Fine for the rotations and uniform scales that things move with.
+        return geom->_last_trans->get_mat().xform_vec( normal );
+}
+
 RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3 &dir,
         float distance, const BitMask32 &mask )
 {
@@ -278,6 +448,8 @@ RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3
         ray.dir_z = dir[2];
         ray.tnear = 0;
         ray.tfar = distance;
+        ray.time = 0;
+        ray.id = 0;
         ray.flags = 0;
         ALIGN_16BYTE RTCRayHit rhit;
         rhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
@@ -296,8 +468,8 @@ RayTraceHitResult RayTraceScene::trace_ray( const LPoint3 &start, const LVector3
 
         // Store the results
         result.hit_fraction = rhit.ray.tfar / distance;
-        result.hit_normal = LVector3( rhit.hit.Ng_x,
-                rhit.hit.Ng_y, rhit.hit.Ng_z );
+        result.hit_normal = get_world_normal( rhit.hit.instID[0], rhit.hit.geomID,
+                LVector3( rhit.hit.Ng_x, rhit.hit.Ng_y, rhit.hit.Ng_z ) );
         result.hit_uv = LVector2( rhit.hit.u, rhit.hit.v );
         result.geom_id = rhit.hit.geomID;
         result.prim_id = rhit.hit.primID;
@@ -339,6 +511,8 @@ void RayTraceScene::trace_four_rays( const FourVectors &start, const FourVectors
         StoreAlignedUIntSIMD( rhit4.ray.mask, mask );
         StoreAlignedSIMD( rhit4.ray.tnear, Four_Zeros );
         StoreAlignedSIMD( rhit4.ray.tfar, distance );
+        StoreAlignedSIMD( rhit4.ray.time, Four_Zeros );
+        StoreAlignedUIntSIMD( rhit4.ray.id, Four_Zeros );
         StoreAlignedUIntSIMD( rhit4.ray.flags, Four_Zeros );
         
         rtcIntersect4( Four_NegativeOnes_NonSIMD, _scene, &ctx, &rhit4 );
@@ -350,4 +524,151 @@ void RayTraceScene::trace_four_rays( const FourVectors &start, const FourVectors
         //res->hit = CmpLtSIMD( res->hit_fraction, Four_Ones );
 }
 
+bool RayTraceScene::test_ray_occluded( const LPoint3 &start, const LVector3 &dir,
+        float distance, const BitMask32 &mask )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+        ALIGN_16BYTE RTCRay ray;
+        ray.mask = mask.get_word();
+        ray.org_x = start[0];
+        ray.org_y = start[1];
+        ray.org_z = start[2];
+        ray.dir_x = dir[0];
+        ray.dir_y = dir[1];
+        ray.dir_z = dir[2];
+        ray.tnear = 0;
+        ray.tfar = distance;
+        ray.time = 0;
+        ray.id = 0;
+        ray.flags = 0;
+
+        rtcOccluded1( _scene, &ctx, &ray );
+
+        // tfar is set to -inf when something is in the way.
+        return ray.tfar < 0.0f;
+}
+
+u32x4 RayTraceScene::test_four_rays_occluded( const FourVectors &start, const FourVectors &direction,
+        const fltx4 &distance, const u32x4 &mask )
+{
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+
+        ALIGN_16BYTE RTCRay4 ray4;
+        StoreAlignedSIMD( ray4.org_x, start.x );
+        StoreAlignedSIMD( ray4.org_y, start.y );
+        StoreAlignedSIMD( ray4.org_z, start.z );
+        StoreAlignedSIMD( ray4.dir_x, direction.x );
+        StoreAlignedSIMD( ray4.dir_y, direction.y );
+        StoreAlignedSIMD( ray4.dir_z, direction.z );
+        StoreAlignedUIntSIMD( ray4.mask, mask );
+        StoreAlignedSIMD( ray4.tnear, Four_Zeros );
+        StoreAlignedSIMD( ray4.tfar, distance );
+        StoreAlignedSIMD( ray4.time, Four_Zeros );
+        StoreAlignedUIntSIMD( ray4.id, Four_Zeros );
+        StoreAlignedUIntSIMD( ray4.flags, Four_Zeros );
+
+        rtcOccluded4( Four_NegativeOnes_NonSIMD, _scene, &ctx, &ray4 );
+
+        // tfar is set to -inf in the lanes where something is in the way.
+        return CmpLtSIMD( LoadAlignedSIMD( ray4.tfar ), Four_Zeros );
+}
+
+INLINE static void make_line_ray( RTCRay &ray, const LPoint3 &start, const LPoint3 &end, unsigned int mask )
+{
+        LVector3 dir = end - start;
+        float distance = dir.length();
+        dir.normalize();
+
+        ray.org_x = start[0];
+        ray.org_y = start[1];
+        ray.org_z = start[2];
+        ray.dir_x = dir[0];
+        ray.dir_y = dir[1];
+        ray.dir_z = dir[2];
+        ray.tnear = 0;
+        ray.tfar = distance;
+        ray.mask = mask;
+        ray.time = 0;
+        ray.id = 0;
+        ray.flags = 0;
+}
+
+/**
+ * Traces count lines, from start[i] to end[i], and stores the closest hit of
+ * each one in results[i].  The lines don't need to have anything to do with
+ * each other.
+ */
+void RayTraceScene::trace_lines( const LPoint3 *start, const LPoint3 *end, int count,
+        unsigned int mask, RayTraceHitResult *results )
+{
+        if ( count <= 0 )
+        {
+                return;
+        }
+
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        pvector<RTCRayHit> rays( count );
+        pvector<float> distances( count );
+        for ( int i = 0; i < count; i++ )
+        {
+                RTCRayHit &rhit = rays[i];
+                make_line_ray( rhit.ray, start[i], end[i], mask );
+                rhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+                rhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+                distances[i] = rhit.ray.tfar;
+        }
+
+        rtcIntersect1M( _scene, &ctx, rays.data(), count, sizeof( RTCRayHit ) );
+
+        for ( int i = 0; i < count; i++ )
+        {
+                const RTCRayHit &rhit = rays[i];
+                RayTraceHitResult &result = results[i];
+                result.hit_fraction = rhit.ray.tfar / distances[i];
+                result.hit_normal = get_world_normal( rhit.hit.instID[0], rhit.hit.geomID,
+                        LVector3( rhit.hit.Ng_x, rhit.hit.Ng_y, rhit.hit.Ng_z ) );
+                result.hit_uv = LVector2( rhit.hit.u, rhit.hit.v );
+                result.geom_id = rhit.hit.geomID;
+                result.prim_id = rhit.hit.primID;
+                result.hit = result.hit_fraction < 1.0f;
+        }
+}
+
+/**
+ * Finds out which of count lines, from start[i] to end[i], are blocked by
+ * something.  occluded[i] is set to true if the line is blocked.
+ */
+void RayTraceScene::test_lines_occluded( const LPoint3 *start, const LPoint3 *end, int count,
+        unsigned int mask, bool *occluded )
+{
+        if ( count <= 0 )
+        {
+                return;
+        }
+
+        RTCIntersectContext ctx;
+        rtcInitIntersectContext( &ctx );
+        ctx.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        pvector<RTCRay> rays( count );
+        for ( int i = 0; i < count; i++ )
+        {
+                make_line_ray( rays[i], start[i], end[i], mask );
+        }
+
+        rtcOccluded1M( _scene, &ctx, rays.data(), count, sizeof( RTCRay ) );
+
+        for ( int i = 0; i < count; i++ )
+        {
+                occluded[i] = rays[i].tfar < 0.0f;
+        }
+}
+
 //==================================================================//
\ No newline at end of file
@@ -107,6 +107,7 @@ PUBLISHED:
         ~RayTraceScene();
 
         void add_geometry( RayTraceGeometry *geom );
+        void add_dynamic_geometry( RayTraceGeometry *geom );
         void remove_geometry( RayTraceGeometry *geom );
         void remove_all();
 
@@ -125,6 +126,16 @@ PUBLISHED:
         RayTraceHitResult trace_ray( const LPoint3 &origin, const LVector3 &direction,
                 float distance, const BitMask32 &mask );
 
+        // These only find out if anything is in the way, which is cheaper
+        // than finding the closest hit.
+        INLINE bool test_line_occluded( const LPoint3 &start, const LPoint3 &end, const BitMask32 &mask )
+        {
+                LVector3 delta = end - start;
+                return test_ray_occluded( start, delta.normalized(), delta.length(), mask );
+        }
+        bool test_ray_occluded( const LPoint3 &origin, const LVector3 &direction,
+                float distance, const BitMask32 &mask );
+
         void set_build_quality( int quality );
 
         void update();
@@ -153,13 +164,40 @@ public:
         }
         void trace_four_rays( const FourVectors &origin, const FourVectors &direction,
                 const fltx4 &distance, const u32x4 &mask, RayTraceHitResult4 *res );
+        u32x4 test_four_rays_occluded( const FourVectors &origin, const FourVectors &direction,
+                const fltx4 &distance, const u32x4 &mask );
 #endif
 
+        // Streams of lines, handed to Embree all at once so it can trace them
+        // in the widest packets the CPU supports.
+        void trace_lines( const LPoint3 *start, const LPoint3 *end, int count,
+                unsigned int mask, RayTraceHitResult *results );
+        void test_lines_occluded( const LPoint3 *start, const LPoint3 *end, int count,
+                unsigned int mask, bool *occluded );
+
 private:
+        unsigned int alloc_geom_id();
+        void detach_geometry( RayTraceGeometry *geom );
+        LVector3 get_world_normal( unsigned int inst_id, unsigned int geom_id, const LVector3 &normal );
+
+        // The top-level scene only holds instances: one of the static scene,
+        // and one for each piece of dynamic geometry.  Moving something only
+        // rebuilds this small scene, never the one with the level in it.
         RTCScene _scene;
         bool _scene_needs_rebuild;
 
+        RTCScene _static_scene;
+        RTCGeometry _static_instance;
+        unsigned int _static_instance_id;
+        bool _static_needs_commit;
+
+        // Geometry IDs are unique across the static and dynamic scenes, so
+        // the ID of a hit says which geometry it was regardless of instance.
         SimpleHashMap<unsigned int, RayTraceGeometry *, int_hash> _geoms;
+        pvector<unsigned int> _free_geom_ids;
+        unsigned int _next_geom_id;
+
+        pvector<RayTraceGeometry *> _dynamic_geoms;
 
         friend class RayTraceGeometry;
 };
@@ -174,6 +212,10 @@ PUBLISHED:
                 _geometry( nullptr ),
                 _geom_id( 0 ),
                 _rtscene( nullptr ),
+                _instance_scene( nullptr ),
+                _instance( nullptr ),
+                _instance_id( 0 ),
+                _instance_needs_commit( false ),
                 _last_trans( nullptr )
         {
         }
@@ -215,6 +257,13 @@ protected:
         unsigned int _mask;
         RayTraceScene *_rtscene;
 
+        // Dynamic geometry is in a scene of its own, instanced into the
+        // top-level scene with the net transform of the node.
+        RTCScene _instance_scene;
+        RTCGeometry _instance;
+        unsigned int _instance_id;
+        bool _instance_needs_commit;
+
         CPT(TransformState) _last_trans;
 
         friend class RayTraceScene;
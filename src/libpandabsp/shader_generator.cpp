@@ -45,11 +45,20 @@
 #include <colorScaleAttrib.h>
 #include <cullBinAttrib.h>
 #include <lens.h>
+#include <configVariableFilename.h>
+#include <thread.h>
+
+#include <fstream>
+#include <algorithm>
 
 using namespace std;
 
 static LightMutex cubemap_mutex( "CubemapMutex" );
 static LightMutex synthesize_mutex( "SynthesizeMutex" );
+static LightMutex compile_mutex( "ShaderCompileMutex" );
+// Shader::make() keeps a table of the shaders it has made and doesn't lock it,
+// so every call to it, and to ShaderAttrib::make(), holds this.
+static LightMutex shader_make_mutex( "ShaderMakeMutex" );
 
 static PStatCollector findmatshader_collector( "*:Munge:BSPShaderGen:FindMatShader" );
 static PStatCollector lookup_collector( "*:Munge:BSPShaderGen:Lookup" );
@@ -72,6 +81,20 @@ ConfigVariableColor ambient_light_identifier( "pssm-ambient-light-identifier", L
 ConfigVariableColor ambient_light_min( "pssm-ambient-light-min", LColor( 0, 0, 0, 1 ) );
 ConfigVariableDouble ambient_light_scale( "pssm-ambient-light-scale", 1.0 );
 
+static ConfigVariableBool shader_async_compile
+( "shader-async-compile", true,
+  PRC_DESC( "Generates new shader permutations in the background instead of when "
+            "they're first needed, drawing with a fallback shader until they're ready.  "
+            "The GLSL compile itself still happens on the draw thread, when the GSG "
+            "prepares the shader at the start of the next frame." ) );
+static ConfigVariableInt shader_compile_threads
+( "shader-compile-threads", 2,
+  PRC_DESC( "Number of threads that generate shader permutations in the background." ) );
+static ConfigVariableFilename shader_cache_dir
+( "shader-cache-dir", "$USER_APPDATA/libpandabsp/shadercache",
+  PRC_DESC( "Directory where the shader permutations that were used are remembered, so "
+            "they can be compiled ahead of time next time.  Empty disables it." ) );
+
 TypeHandle BSPShaderGenerator::_type_handle;
 PT( Texture ) BSPShaderGenerator::_identity_cubemap = nullptr;
 
@@ -90,7 +113,12 @@ BSPShaderGenerator::BSPShaderGenerator( GraphicsOutput *output, GraphicsStateGua
 	_sunlight( NodePath() ),
 	_has_shadow_sunlight( false ),
 	_shader_quality( SHADERQUALITY_HIGH ),
-	_fog( nullptr )
+	_fog( nullptr ),
+	_compile_chain( nullptr ),
+	_shaders_compiled( false ),
+	_scratch_perms( new ShaderPermutations ),
+	_synthesize_generation( 0 ),
+	_synthesized_sweep_size( 1024 )
 {
 	_pta_fogdata = PTA_LVecBase4f::empty_array( 2 );
 	_exposure_adjustment = PTA_float::empty_array( 1 );
@@ -193,9 +221,19 @@ BSPShaderGenerator::BSPShaderGenerator( GraphicsOutput *output, GraphicsStateGua
         }
 }
 
+BSPShaderGenerator::~BSPShaderGenerator()
+{
+	// The compile jobs point back at us and at our GSG.
+	if ( _compile_chain != nullptr )
+	{
+		_compile_chain->wait_for_tasks();
+	}
+}
+
 void BSPShaderGenerator::set_shader_quality( int quality )
 {
         _shader_quality = quality;
+        invalidate_synthesized_shaders();
         _gsg->mark_rehash_generated_shaders();
 }
 
@@ -207,7 +245,9 @@ void BSPShaderGenerator::set_shader_quality( int quality )
 void BSPShaderGenerator::add_shader( PT( ShaderSpec ) shader )
 {
         _shaders[shader->get_name()] = shader;
-	//shader->precache();
+        invalidate_synthesized_shaders();
+
+        load_shader_cache( shader );
 }
 
 void BSPShaderGenerator::set_sun_light( const NodePath &np )
@@ -217,11 +257,13 @@ void BSPShaderGenerator::set_sun_light( const NodePath &np )
                 if ( !_sunlight.is_empty() )
                         _sunlight.clear();
                 _has_shadow_sunlight = false;
+                invalidate_synthesized_shaders();
                 _pssm_rig->reparent_to( NodePath() );
                 return;
         }
 
         _sunlight = np;
+        invalidate_synthesized_shaders();
 
         DirectionalLight *dlight = DCAST( DirectionalLight, _sunlight.node() );
         _sun_vector = -dlight->get_direction();
@@ -240,6 +282,7 @@ void BSPShaderGenerator::update()
                 if ( _sunlight.is_empty() & _has_shadow_sunlight )
                 {
                         _has_shadow_sunlight = false;
+                        invalidate_synthesized_shaders();
                         _pssm_rig->reparent_to( NodePath() );
                 }
 
@@ -260,6 +303,81 @@ void BSPShaderGenerator::update()
 
 		_pta_fogdata[1][3] = 1.0f;//self->_fog->get_linear
 	}
+
+	bool shaders_compiled;
+	{
+		LightMutexHolder holder( synthesize_mutex );
+		shaders_compiled = _shaders_compiled;
+		_shaders_compiled = false;
+	}
+	if ( shaders_compiled )
+	{
+		// States that were drawn with the fallback shader pick up the
+		// permutations that are ready now.
+		_gsg->mark_rehash_generated_shaders();
+	}
+}
+
+INLINE static bool use_async_compile()
+{
+	return shader_async_compile.get_value() &&
+		shader_compile_threads.get_value() > 0 &&
+		Thread::is_threading_supported();
+}
+
+static CPT( ShaderAttrib ) find_generated_shader( const ShaderSpec *spec, const CPT( ShaderPermutations ) &perms )
+{
+#ifdef SHADER_PERMS_UNORDERED_MAP
+	auto itr = spec->_generated_shaders.find( perms );
+	if ( itr != spec->_generated_shaders.end() )
+	{
+		return itr->second;
+	}
+#else
+	int itr = spec->_generated_shaders.find( perms );
+	if ( itr != -1 )
+	{
+		return spec->_generated_shaders.get_data( itr );
+	}
+#endif
+
+	return nullptr;
+}
+
+/**
+ * Returns the disk cache file of the permutations.  It is named after a hash
+ * of the shader's source and the permutations, so editing the shader makes
+ * its old entries stale.
+ */
+static Filename get_shader_cache_filename( const ShaderSpec *spec, const ShaderPermutations *perms )
+{
+	size_t key = string_hash::add_hash( spec->get_source_hash(), perms->permutations );
+
+	std::ostringstream name;
+	name << std::hex << key << ".perm";
+
+	return Filename( Filename( shader_cache_dir.get_value(), spec->get_name() ), name.str() );
+}
+
+static void write_shader_cache( const ShaderSpec *spec, const ShaderPermutations *perms )
+{
+	if ( shader_cache_dir.get_value().empty() )
+	{
+		return;
+	}
+
+	Filename filename = get_shader_cache_filename( spec, perms );
+	if ( filename.exists() )
+	{
+		return;
+	}
+
+	filename.make_dir();
+	std::ofstream out;
+	if ( filename.open_write( out ) )
+	{
+		out << perms->permutations;
+	}
 }
 
 CPT( RenderAttrib ) apply_node_inputs( const RenderState *rs, CPT( RenderAttrib ) shattr )
@@ -313,6 +431,75 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
 {
 	LightMutexHolder holder( synthesize_mutex );
 
+	if ( !cache_shaders )
+	{
+		bool fallback;
+		return do_synthesize_shader( rs, anim, fallback );
+	}
+
+	// A rehash asks for the shader of every state again, though only the
+	// ones that were drawn with the fallback can get a different one.
+	AtomicAdjust::Integer generation = AtomicAdjust::get( _synthesize_generation );
+	synthesizedkey_t key;
+	key.state = rs;
+	key.anim = anim;
+
+	lookup_collector.start();
+	SynthesizedShaders::const_iterator itr = _synthesized_shaders.find( key );
+	if ( itr != _synthesized_shaders.end() &&
+	     itr->second.generation == generation &&
+	     !itr->second.state.was_deleted() )
+	{
+		lookup_collector.stop();
+		return itr->second.attr;
+	}
+	lookup_collector.stop();
+
+	bool fallback;
+	CPT( ShaderAttrib ) attr = do_synthesize_shader( rs, anim, fallback );
+	if ( fallback || attr == nullptr )
+	{
+		_synthesized_shaders.erase( key );
+		return attr;
+	}
+
+	if ( _synthesized_shaders.size() >= _synthesized_sweep_size )
+	{
+		// Forget the states that are gone or were synthesized before
+		// something that affects every shader changed.
+		for ( SynthesizedShaders::iterator sitr = _synthesized_shaders.begin(); sitr != _synthesized_shaders.end(); )
+		{
+			if ( sitr->second.generation != generation || sitr->second.state.was_deleted() )
+			{
+				sitr = _synthesized_shaders.erase( sitr );
+			}
+			else
+			{
+				++sitr;
+			}
+		}
+		_synthesized_sweep_size = std::max( (size_t)1024, _synthesized_shaders.size() * 2 );
+	}
+
+	synthesized_t &entry = _synthesized_shaders[key];
+	entry.state = rs;
+	entry.attr = attr;
+	entry.generation = generation;
+
+	return attr;
+}
+
+/**
+ * Builds the permutations of the state and returns its shader, making it if
+ * it wasn't made before.  fallback is set if the shader is only the fallback
+ * to draw with until the real one is compiled.  The synthesize mutex must be
+ * held.
+ */
+CPT( ShaderAttrib ) BSPShaderGenerator::do_synthesize_shader( const RenderState *rs,
+	const GeomVertexAnimationSpec &anim, bool &fallback )
+{
+	fallback = false;
+
         findmatshader_collector.start();
 
         // First figure out which shader to use.
@@ -360,7 +547,10 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
 
         findmatshader_collector.stop();
 
-	PT( ShaderPermutations ) permutations = new ShaderPermutations;
+	// Fill in the permutations we keep around for this, so there's nothing
+	// to allocate unless it turns out to be a permutation we don't have.
+	ShaderPermutations *permutations = _scratch_perms;
+	permutations->clear();
         ShaderSpec *spec;
 
         spec = _shaders[shader_name];
@@ -375,54 +565,304 @@ CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_shader( const RenderState *rs
 
         if ( cache_shaders )
         {
-		PStatTimer timer( lookup_collector );
-#ifdef SHADER_PERMS_UNORDERED_MAP
-                auto itr = spec->_generated_shaders.find( permutations );
-                if ( itr != spec->_generated_shaders.end() )
-                {
-			CPT( ShaderAttrib ) shattr = itr->second;
-#else
-		int itr = spec->_generated_shaders.find( permutations );
-		if ( itr != -1 )
-		{
-			CPT( ShaderAttrib ) shattr = spec->_generated_shaders.get_data( itr );
-#endif
-                        shattr = DCAST( ShaderAttrib, apply_node_inputs( rs, shattr ) );
+		lookup_collector.start();
+		CPT( ShaderAttrib ) shattr = find_generated_shader( spec, permutations );
+		lookup_collector.stop();
 
-                        return shattr;
+		if ( shattr != nullptr )
+		{
+                        return DCAST( ShaderAttrib, apply_node_inputs( rs, shattr ) );
                 }
+
+		// A permutation that was warmed up only needs its ShaderAttrib,
+		// making the Shader is just a lookup now.
+		bool warmed = spec->_warmed_shaders.find( permutations->get_hash() ) != spec->_warmed_shaders.end();
+
+		if ( !warmed && use_async_compile() && shader_name != DEFAULT_SHADER )
+		{
+			// Don't stall the frame on a permutation we haven't seen yet.
+			// Compile it in the background and draw with the fallback
+			// shader until it's ready.
+			CPT( ShaderAttrib ) fallback_attr = synthesize_fallback( rs, anim );
+			if ( fallback_attr != nullptr )
+			{
+				if ( spec->_pending_shaders.insert( permutations->get_hash() ).second )
+				{
+					queue_compile( spec, new ShaderPermutations( *permutations ), false );
+				}
+				fallback = true;
+				return fallback_attr;
+			}
+		}
         }
 
+	// It's a new one, so it needs its own copy of the permutations.
+	PT( ShaderPermutations ) new_permutations = new ShaderPermutations( *permutations );
+
 	synthesize_collector.start();
-	CPT( Shader ) shader = make_shader( spec, permutations );
+	CPT( ShaderAttrib ) attr = make_shader_attrib( spec, new_permutations );
 	synthesize_collector.stop();
 
-        nassertr( shader != nullptr, nullptr );
+        nassertr( attr != nullptr, nullptr );
+
+        if ( cache_shaders )
+	{
+                spec->_generated_shaders[new_permutations] = attr;
+		spec->_warmed_shaders.erase( new_permutations->get_hash() );
+	}
 
 	make_attrib_collector.start();
+        CPT( RenderAttrib ) shattr = apply_node_inputs( rs, attr );
+	make_attrib_collector.stop();
+
+        return DCAST( ShaderAttrib, shattr );
+}
+
+/**
+ * Returns the shader to draw with while the real one for the state is being
+ * compiled: the default shader with only what's needed to put the geometry
+ * in the right place.  Returns nullptr if there is no default shader.  The
+ * synthesize mutex must be held.
+ */
+CPT( ShaderAttrib ) BSPShaderGenerator::synthesize_fallback( const RenderState *rs,
+	const GeomVertexAnimationSpec &anim )
+{
+	auto itr = _shaders.find( DEFAULT_SHADER );
+	if ( itr == _shaders.end() )
+	{
+		return nullptr;
+	}
+
+	ShaderSpec *spec = itr->second;
 
-        CPT( RenderAttrib ) shattr = ShaderAttrib::make( shader );
+	PT( ShaderPermutations ) permutations = new ShaderPermutations;
+	spec->ShaderSpec::setup_permutations( *permutations, nullptr, rs, anim, this );
+	ShaderSpec::add_hw_skinning( anim, *permutations );
+	ShaderSpec::add_alpha_test( rs, *permutations );
+	ShaderSpec::add_aux_bits( rs, *permutations );
+	permutations->complete();
+
+	CPT( ShaderAttrib ) shattr = find_generated_shader( spec, permutations );
+	if ( shattr == nullptr )
+	{
+		shattr = make_shader_attrib( spec, permutations );
+		nassertr( shattr != nullptr, nullptr );
+		spec->_generated_shaders[permutations] = shattr;
+	}
+
+	return DCAST( ShaderAttrib, apply_node_inputs( rs, shattr ) );
+}
+
+/**
+ * Makes the ShaderAttrib for the permutations, with the inputs and flags that
+ * come from them but none of the node's inputs.  This is what gets cached.
+ */
+CPT( ShaderAttrib ) BSPShaderGenerator::make_shader_attrib( const ShaderSpec *spec, const ShaderPermutations *perms )
+{
+	CPT( Shader ) shader = make_shader( spec, perms );
+
+        nassertr( shader != nullptr, nullptr );
+
+        CPT( RenderAttrib ) shattr;
+	{
+		LightMutexHolder holder( shader_make_mutex );
+		shattr = ShaderAttrib::make( shader );
+	}
 
         // Add any inputs from the permutations.
-        shattr = DCAST( ShaderAttrib, shattr )->set_shader_inputs( permutations->inputs );
+        shattr = DCAST( ShaderAttrib, shattr )->set_shader_inputs( perms->inputs );
         // Also any flags.
-	size_t nflags = permutations->flag_indices.size();
+	size_t nflags = perms->flag_indices.size();
 	for ( size_t i = 0; i < nflags; i++ )
 	{
-		shattr = DCAST( ShaderAttrib, shattr )->set_flag( permutations->flag_indices[i], true );
+		shattr = DCAST( ShaderAttrib, shattr )->set_flag( perms->flag_indices[i], true );
 	}
 
-        CPT( ShaderAttrib ) attr = DCAST( ShaderAttrib, shattr );
+        return DCAST( ShaderAttrib, shattr );
+}
 
-        if ( cache_shaders )
-                spec->_generated_shaders[permutations] = attr;
+/**
+ * Hands the permutations to the shader compile threads.
+ */
+void BSPShaderGenerator::queue_compile( ShaderSpec *spec, ShaderPermutations *perms, bool warm_only )
+{
+	compilejob_t *job = new compilejob_t;
+	job->generator = this;
+	job->spec = spec;
+	job->perms = perms;
+	job->warm_only = warm_only;
+
+	if ( !use_async_compile() )
+	{
+		run_compile_job( job );
+		return;
+	}
 
-        shattr = apply_node_inputs( rs, shattr );
-        attr = DCAST( ShaderAttrib, shattr );
+	AsyncTaskManager *mgr = AsyncTaskManager::get_global_ptr();
 
-	make_attrib_collector.stop();
+	{
+		LightMutexHolder holder( compile_mutex );
+		if ( _compile_chain == nullptr )
+		{
+			_compile_chain = mgr->make_task_chain( "shaderCompile" );
+			_compile_chain->set_num_threads( shader_compile_threads.get_value() );
+			_compile_chain->set_thread_priority( TP_low );
+			_compile_chain->set_frame_sync( false );
+		}
+	}
 
-        return attr;
+	PT( GenericAsyncTask ) task = new GenericAsyncTask( "shaderCompile", compile_task, job );
+	task->set_task_chain( "shaderCompile" );
+	mgr->add( task );
+}
+
+void BSPShaderGenerator::run_compile_job( compilejob_t *job )
+{
+	CPT( Shader ) shader;
+	CPT( ShaderAttrib ) attr;
+	if ( job->warm_only )
+	{
+		shader = make_shader( job->spec, job->perms );
+	}
+	else
+	{
+		attr = make_shader_attrib( job->spec, job->perms );
+		if ( attr != nullptr )
+		{
+			shader = attr->get_shader();
+		}
+	}
+
+	if ( shader != nullptr )
+	{
+		// Only the shader source is made on this thread.  Panda compiles and
+		// links the GLSL program on the draw thread, when the GSG prepares the
+		// queued shader at the start of the next frame, so that frame still
+		// pays for the compile.  It is paid before anything is drawn with it
+		// and without holding up the cull thread, though.
+		( (Shader *)shader.p() )->prepare( job->generator->_gsg->get_prepared_objects() );
+		write_shader_cache( job->spec, job->perms );
+	}
+
+	{
+		LightMutexHolder holder( synthesize_mutex );
+		if ( attr != nullptr )
+		{
+			job->spec->_generated_shaders[job->perms] = attr;
+		}
+		else if ( shader != nullptr )
+		{
+			job->spec->_warmed_shaders.insert( job->perms->get_hash() );
+		}
+		job->spec->_pending_shaders.erase( job->perms->get_hash() );
+		job->generator->_shaders_compiled = true;
+	}
+
+	delete job;
+}
+
+AsyncTask::DoneStatus BSPShaderGenerator::compile_task( GenericAsyncTask *task, void *data )
+{
+	run_compile_job( (compilejob_t *)data );
+	return AsyncTask::DS_done;
+}
+
+/**
+ * Queues the permutations to be made and prepared ahead of time, unless they
+ * already are or are on the way.
+ */
+void BSPShaderGenerator::queue_warm( ShaderSpec *spec, ShaderPermutations *perms )
+{
+	{
+		LightMutexHolder holder( synthesize_mutex );
+		size_t hash = perms->get_hash();
+		if ( find_generated_shader( spec, perms ) != nullptr ||
+		     spec->_warmed_shaders.find( hash ) != spec->_warmed_shaders.end() ||
+		     !spec->_pending_shaders.insert( hash ).second )
+		{
+			return;
+		}
+	}
+
+	queue_compile( spec, perms, true );
+}
+
+/**
+ * Queues up the permutations that the shader used before, according to the
+ * disk cache, so they are compiled before they are needed.  Entries made
+ * from an older version of the shader's source are removed.
+ */
+void BSPShaderGenerator::load_shader_cache( ShaderSpec *spec )
+{
+	if ( shader_cache_dir.get_value().empty() || !use_async_compile() )
+	{
+		return;
+	}
+
+	Filename dir( shader_cache_dir.get_value(), spec->get_name() );
+	vector_string files;
+	if ( !dir.scan_directory( files ) )
+	{
+		return;
+	}
+
+	for ( size_t i = 0; i < files.size(); i++ )
+	{
+		Filename filename( dir, files[i] );
+		if ( filename.get_extension() != "perm" )
+		{
+			continue;
+		}
+
+		std::ifstream in;
+		if ( !filename.open_read( in ) )
+		{
+			continue;
+		}
+		std::ostringstream contents;
+		contents << in.rdbuf();
+		in.close();
+
+		PT( ShaderPermutations ) perms = new ShaderPermutations;
+		perms->permutations = contents.str();
+		perms->complete();
+
+		if ( get_shader_cache_filename( spec, perms ).get_basename() != files[i] )
+		{
+			filename.unlink();
+			continue;
+		}
+
+		queue_warm( spec, perms );
+	}
+}
+
+/**
+ * Generates every precache combo of every shader that was added, spread across
+ * the shader compile threads, and waits for all of them to finish.  The GSG
+ * compiles the queued shaders when it starts the next frame.
+ */
+void BSPShaderGenerator::precache_shaders()
+{
+	pvector<PT( ShaderPermutations )> perms;
+	for ( auto itr = _shaders.begin(); itr != _shaders.end(); ++itr )
+	{
+		perms.clear();
+		itr->second->get_precache_permutations( perms );
+
+		bspShaderGenerator_cat.info()
+			<< "Precaching " << perms.size() << " static combos for shader " << itr->first << "\n";
+
+		for ( size_t i = 0; i < perms.size(); i++ )
+		{
+			queue_warm( itr->second, perms[i] );
+		}
+	}
+
+	if ( _compile_chain != nullptr )
+	{
+		_compile_chain->wait_for_tasks();
+	}
 }
 
 void BSPShaderGenerator::set_identity_cubemap( Texture *tex )
@@ -470,5 +910,12 @@ CPT( Shader ) BSPShaderGenerator::make_shader( const ShaderSpec *spec, const Sha
 			<< spec->_pixel.after_defines;
 	}
 
-	return Shader::make( Shader::SL_GLSL, vshader.str(), fshader.str(), gshader.str() );
+	// The source is put together on the calling thread, only making the
+	// Shader itself is serialized.
+	std::string vertex = vshader.str();
+	std::string fragment = fshader.str();
+	std::string geometry = gshader.str();
+
+	LightMutexHolder holder( shader_make_mutex );
+	return Shader::make( Shader::SL_GLSL, vertex, fragment, geometry );
 }
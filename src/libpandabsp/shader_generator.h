@@ -14,11 +14,14 @@
 
 #include <shaderGenerator.h>
 #include <genericAsyncTask.h>
+#include <asyncTaskChain.h>
 #include <nodePath.h>
 #include <weakNodePath.h>
 #include <configVariableColor.h>
 #include <camera.h>
 #include <fog.h>
+#include <weakPointerTo.h>
+#include <atomicAdjust.h>
 
 #include "shader_spec.h"
 #include "planar_reflections.h"
@@ -75,6 +78,7 @@ class EXPCL_PANDABSP BSPShaderGenerator : public ShaderGenerator
 {
 PUBLISHED:
         BSPShaderGenerator( GraphicsOutput *output, GraphicsStateGuardian *gsg, const NodePath &camera, const NodePath &render );
+        virtual ~BSPShaderGenerator();
 
         virtual CPT( ShaderAttrib ) synthesize_shader( const RenderState *rs,
                                                        const GeomVertexAnimationSpec &anim );
@@ -121,11 +125,13 @@ PUBLISHED:
 	{
 		_fog = fog;
 		_render.set_fog( _fog );
+		invalidate_synthesized_shaders();
 	}
 	INLINE void clear_fog()
 	{
 		_fog = nullptr;
 		_render.clear_fog();
+		invalidate_synthesized_shaders();
 	}
 	INLINE Fog *get_fog() const
 	{
@@ -163,6 +169,8 @@ PUBLISHED:
 
 	static CPT( Shader ) make_shader( const ShaderSpec *spec, const ShaderPermutations *perms );
 
+        void precache_shaders();
+
         void update();
 
 private:
@@ -172,6 +180,59 @@ private:
                 int index;
         };
 
+        // A permutation being compiled on the shader compile threads.  The
+        // destructor waits for the jobs, so they don't hold a reference to the
+        // generator.
+        struct compilejob_t
+        {
+                BSPShaderGenerator *generator;
+                PT( ShaderSpec ) spec;
+                PT( ShaderPermutations ) perms;
+                // Only make the shader and have the GSG prepare it, for
+                // precaching.  There's no RenderState to make a ShaderAttrib for.
+                bool warm_only;
+        };
+
+        // The shader synthesized for a state, so a rehash doesn't have to
+        // build the permutations of every state again.  The state is keyed by
+        // its address, and the weak pointer tells if the address was reused.
+        struct synthesizedkey_t
+        {
+                const RenderState *state;
+                GeomVertexAnimationSpec anim;
+
+                INLINE bool operator < ( const synthesizedkey_t &other ) const
+                {
+                        if ( state != other.state )
+                        {
+                                return state < other.state;
+                        }
+                        return anim < other.anim;
+                }
+        };
+        struct synthesized_t
+        {
+                WCPT( RenderState ) state;
+                CPT( ShaderAttrib ) attr;
+                AtomicAdjust::Integer generation;
+        };
+        typedef pmap<synthesizedkey_t, synthesized_t> SynthesizedShaders;
+
+        // Called when something every state's shader depends on changes.
+        INLINE void invalidate_synthesized_shaders()
+        {
+                AtomicAdjust::inc( _synthesize_generation );
+        }
+
+        CPT( ShaderAttrib ) do_synthesize_shader( const RenderState *rs, const GeomVertexAnimationSpec &anim, bool &fallback );
+        CPT( ShaderAttrib ) synthesize_fallback( const RenderState *rs, const GeomVertexAnimationSpec &anim );
+        void queue_compile( ShaderSpec *spec, ShaderPermutations *perms, bool warm_only );
+        void queue_warm( ShaderSpec *spec, ShaderPermutations *perms );
+        void load_shader_cache( ShaderSpec *spec );
+        static void run_compile_job( compilejob_t *job );
+        static AsyncTask::DoneStatus compile_task( GenericAsyncTask *task, void *data );
+        static CPT( ShaderAttrib ) make_shader_attrib( const ShaderSpec *spec, const ShaderPermutations *perms );
+
         pmap<std::string, PT( ShaderSpec )> _shaders;
 
         PT( Texture ) _pssm_split_texture_array;
@@ -196,6 +257,21 @@ private:
         NodePath _render;
 	PT( PlanarReflections ) _planar_reflections;
 
+        PT( AsyncTaskChain ) _compile_chain;
+        // Set when a background compile finished, so the states get their
+        // shaders again.
+        bool _shaders_compiled;
+
+        // Reused by synthesize_shader() to build the permutations of each
+        // state.  Guarded by the synthesize mutex.
+        PT( ShaderPermutations ) _scratch_perms;
+
+        // Guarded by the synthesize mutex, except for the generation.
+        SynthesizedShaders _synthesized_shaders;
+        AtomicAdjust::Integer _synthesize_generation;
+        // Size at which the dead entries are swept out.
+        size_t _synthesized_sweep_size;
+
         static PT( Texture ) _identity_cubemap;
 
 public:
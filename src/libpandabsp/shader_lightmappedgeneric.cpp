@@ -42,7 +42,7 @@ LightmappedGenericSpec::LightmappedGenericSpec() :
 {
 }
 
-string get_texcoord( int n )
+std::string get_texcoord( int n )
 {
         std::ostringstream ss;
         ss << "p3d_MultiTexCoord" << n;
@@ -59,7 +59,8 @@ TypeHandle ShaderSpec::_type_handle;
 ShaderSpec::ShaderSpec( const std::string &name, const Filename &vert_file,
                         const Filename &pixel_file, const Filename &geom_file ) :
         ReferenceCount(),
-        Namable( name )
+        Namable( name ),
+        _source_hash( 0 )
 {
         read_shader_files( vert_file, pixel_file, geom_file );
 }
@@ -72,6 +73,11 @@ void ShaderSpec::read_shader_files( const Filename &vert_file,
         _vertex.read( vert_file );
         _pixel.read( pixel_file );
         _geom.read( geom_file );
+
+        _source_hash = 0;
+        _source_hash = string_hash::add_hash( _source_hash, _vertex.full_source );
+        _source_hash = string_hash::add_hash( _source_hash, _pixel.full_source );
+        _source_hash = string_hash::add_hash( _source_hash, _geom.full_source );
 }
 
 ShaderConfig *ShaderSpec::get_shader_config( const BSPMaterial *mat )
@@ -278,32 +284,69 @@ bool ShaderSpec::add_alpha_test( const RenderState *rs, ShaderPermutations &perm
 	return false;
 }
 
-void ShaderSpec::r_precache( ShaderPrecacheCombos &combos )
+/**
+ * Returns true if the combo values in indices match one of the skip
+ * conditions.
+ */
+static bool should_skip_combo( const ShaderPrecacheCombos &combos, const int *indices )
 {
-	size_t n = combos.combos.size();
+	for ( size_t i = 0; i < combos.skips.size(); i++ )
+	{
+		const ShaderPrecacheComboSkipCondition_t &skip = combos.skips[i];
+		bool match = !skip.conditions.empty();
+		for ( size_t j = 0; j < skip.conditions.size() && match; j++ )
+		{
+			const ShaderPrecacheComboCondition_t &cond = skip.conditions[j];
+			match = false;
+			for ( size_t k = 0; k < combos.combos.size(); k++ )
+			{
+				if ( combos.combos[k].combo_name == cond.combo_name )
+				{
+					match = ( combos.combos[k].min_val + indices[k] ) == cond.val;
+					break;
+				}
+			}
+		}
+
+		if ( match )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
 
-	int *indices = new int[n];
-	memset( indices, 0, sizeof( int ) * n );
+/**
+ * Fills in the permutations of every combination of the shader's precache
+ * combos.
+ */
+void ShaderSpec::get_precache_permutations( pvector<PT( ShaderPermutations )> &result )
+{
+	ShaderPrecacheCombos combos;
+	add_precache_combos( combos );
+
+	size_t n = combos.combos.size();
 
-	int permutations = 0;
+	pvector<int> indices( n, 0 );
 
 	while ( 1 )
 	{
-		ShaderPermutations perms;
-		perms.local_object();
-		for ( int i = 0; i < n; i++ )
+		if ( !should_skip_combo( combos, indices.data() ) )
 		{
-			if ( combos.combos[i].is_bool && combos.combos[i].min_val + indices[n] == 0 )
-				continue;
-			perms.add_permutation( combos.combos[i].combo_name,
-					       combos.combos[i].min_val + indices[n] );
+			PT( ShaderPermutations ) perms = new ShaderPermutations;
+			for ( size_t i = 0; i < n; i++ )
+			{
+				int val = combos.combos[i].min_val + indices[i];
+				if ( combos.combos[i].is_bool && val == 0 )
+					continue;
+				perms->add_permutation( combos.combos[i].combo_name.c_str(), val );
+			}
+			perms->complete();
+			result.push_back( perms );
 		}
 
-		BSPShaderGenerator::make_shader( this, &perms );
-		permutations++;
-		std::cout << "\tCompiled " << permutations << " permutations\n";
-
-		int next = n - 1;
+		int next = (int)n - 1;
 		while ( next >= 0 && indices[next] + 1 >= ( combos.combos[next].max_val - combos.combos[next].min_val ) + 1 )
 		{
 			next--;
@@ -311,39 +354,30 @@ void ShaderSpec::r_precache( ShaderPrecacheCombos &combos )
 
 		if ( next < 0 )
 		{
-			delete[] indices;
 			return;
 		}
-			
 
 		indices[next]++;
 
-		for (int i = next + 1; i < n; i++ )
+		for ( size_t i = next + 1; i < n; i++ )
 		{
 			indices[i] = 0;
 		}
 	}
-
 }
 
 void ShaderSpec::precache()
 {
-	ShaderPrecacheCombos combos;
-	add_precache_combos( combos );
+	pvector<PT( ShaderPermutations )> perms;
+	get_precache_permutations( perms );
 
-	int total_combos = 0;
-	for ( size_t i = 0; i < combos.combos.size(); i++ )
+	std::cout << "Precaching " << perms.size() << " static combos for shader " << get_name() << std::endl;
+
+	for ( size_t i = 0; i < perms.size(); i++ )
 	{
-		int possibilities = ( combos.combos[i].max_val - combos.combos[i].min_val ) + 1;
-		if ( total_combos == 0 )
-			total_combos += possibilities;
-		else
-			total_combos *= possibilities;
+		BSPShaderGenerator::make_shader( this, perms[i] );
+		std::cout << "\tCompiled " << ( i + 1 ) << " permutations\n";
 	}
-
-	std::cout << "Precaching " << total_combos << " static combos for shader " << get_name() << std::endl;
-
-	r_precache( combos );
 }
 
 void ShaderSpec::add_precache_combos( ShaderPrecacheCombos &combos )
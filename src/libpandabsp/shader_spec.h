@@ -15,10 +15,12 @@
 #include <referenceCount.h>
 #include <namable.h>
 #include <pmap.h>
+#include <pset.h>
 #include <shaderAttrib.h>
 #include <geomVertexAnimationSpec.h>
 
 #include <unordered_map>
+#include <cstdio>
 
 #include "config_bsp.h"
 
@@ -102,7 +104,8 @@ public:
 #endif
 
 public:
-	std::ostringstream permutations_stream;
+	// The #defines of the permutations, appended straight into a string that
+	// keeps its memory when the object is cleared and reused.
 	std::string permutations;
 
 	int flags;
@@ -118,26 +121,96 @@ PUBLISHED:
 		ReferenceCount()
 	{
 		// This should be enough for most shaders
+		permutations.reserve( 1024 );
 		inputs.reserve( 32 );
 		flag_indices.reserve( 32 );
 		hash = 0u;
 		flags = 0;
 	}
 
-        template<class T>
-        INLINE void add_permutation( const std::string &key, const T &value )
-        {
-		permutations_stream << "#define " << key << " " << value << "\n";
-        }
+	INLINE ShaderPermutations( const ShaderPermutations &copy ) :
+		ReferenceCount(),
+		permutations( copy.permutations ),
+		flags( copy.flags ),
+		flag_indices( copy.flag_indices ),
+		inputs( copy.inputs ),
+		hash( copy.hash )
+	{
+	}
+
+	/**
+	 * Empties out the permutations so the object can be filled in again,
+	 * without giving back any of the memory.
+	 */
+	INLINE void clear()
+	{
+		permutations.clear();
+		flags = 0;
+		flag_indices.clear();
+		inputs.clear();
+		hash = 0u;
+	}
+
+	INLINE void add_permutation( const char *key, const char *value = "1" )
+	{
+		permutations += "#define ";
+		permutations += key;
+		permutations += ' ';
+		permutations += value;
+		permutations += '\n';
+	}
+
+	INLINE void add_permutation( const char *key, const std::string &value )
+	{
+		add_permutation( key, value.c_str() );
+	}
+
+	// One overload for each integer type, so that no integer argument is
+	// ambiguous between the integer and floating point versions.
+	INLINE void add_permutation( const char *key, int value )
+	{
+		add_permutation( key, (long long)value );
+	}
+
+	INLINE void add_permutation( const char *key, unsigned int value )
+	{
+		add_permutation( key, (unsigned long long)value );
+	}
+
+	INLINE void add_permutation( const char *key, long value )
+	{
+		add_permutation( key, (long long)value );
+	}
 
-	INLINE void add_permutation( const std::string &key, const std::string &value = "1" )
+	INLINE void add_permutation( const char *key, unsigned long value )
 	{
-		add_permutation<std::string>( key, value );
+		add_permutation( key, (unsigned long long)value );
+	}
+
+	INLINE void add_permutation( const char *key, long long value )
+	{
+		char buf[32];
+		snprintf( buf, sizeof( buf ), "%lld", value );
+		add_permutation( key, buf );
+	}
+
+	INLINE void add_permutation( const char *key, unsigned long long value )
+	{
+		char buf[32];
+		snprintf( buf, sizeof( buf ), "%llu", value );
+		add_permutation( key, buf );
+	}
+
+	INLINE void add_permutation( const char *key, double value )
+	{
+		// Same formatting as an ostream, so the text doesn't change.
+		char buf[32];
+		snprintf( buf, sizeof( buf ), "%g", value );
+		add_permutation( key, buf );
 	}
 
 	INLINE void complete()
 	{
-		permutations = permutations_stream.str();
 		hash = string_hash::add_hash( hash, permutations );
 		hash = int_hash::add_hash( hash, flags );
 	}
@@ -195,6 +268,12 @@ public:
 
 	virtual void add_precache_combos( ShaderPrecacheCombos &combos );
 	virtual void precache();
+	void get_precache_permutations( pvector<PT( ShaderPermutations )> &result );
+
+	INLINE size_t get_source_hash() const
+	{
+		return _source_hash;
+	}
 
         ShaderConfig *get_shader_config( const BSPMaterial *mat );
         virtual PT( ShaderConfig ) make_new_config() = 0;
@@ -217,11 +296,20 @@ public:
 	typedef SimpleHashMap<CPT( ShaderPermutations ), CPT( ShaderAttrib ), ShaderPermutationHashMethod> GeneratedShaders;
 #endif
         GeneratedShaders _generated_shaders;
+	// Hashes of the permutations that are being compiled in the background.
+	pset<size_t> _pending_shaders;
+	// Hashes of the permutations that were precached or came from the disk
+	// cache.  Their Shader has been made and prepared already, so there's no
+	// need to draw with the fallback while making the ShaderAttrib.
+	pset<size_t> _warmed_shaders;
         
         ShaderSource _vertex;
         ShaderSource _pixel;
         ShaderSource _geom;
 
+	// Hash of the source of all of the stages, for the disk cache.
+	size_t _source_hash;
+
         static TypeHandle get_class_type()
         {
                 return _type_handle;
@@ -236,8 +324,6 @@ public:
         }
 
 private:
-	void r_precache( ShaderPrecacheCombos &combos );
-
         static TypeHandle _type_handle;
 };
 
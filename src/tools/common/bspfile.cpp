@@ -7,6 +7,7 @@
 #include "scriplib.h"
 #include "blockmem.h"
 #include <string>
+#include <cstddef>
 
 //=============================================================================
 
@@ -340,16 +341,17 @@ static void     SwapBSPFile( bspdata_t *data, const bool todisk )
 //  CopyLump
 //      balh
 // =====================================================================================
-static int      CopyLump( int lump, void* dest, int size, const dheader_t* const header )
+template<class T>
+static int CopyLump( int lump, lumpdata_t<T> &dest, const dheader_t* const header, byte* const base, const bool map_lump )
 {
         int             length, ofs;
 
         length = header->lumps[lump].filelen;
         ofs = header->lumps[lump].fileofs;
 
-        if ( length % size )
+        if ( length % sizeof( T ) )
         {
-                Error( "LoadBSPFile: odd lump size for lump %i, length %i, size %i", lump, length, size );
+                Error( "LoadBSPFile: odd lump size for lump %i, length %i, size %i", lump, length, (int)sizeof( T ) );
         }
 
         //special handling for tex and lightdata to keep things from exploding - KGP
@@ -358,39 +360,28 @@ static int      CopyLump( int lump, void* dest, int size, const dheader_t* const
         //        hlassume( g_max_map_texref > length, assume_MAX_MAP_MIPTEX );
         //}
 
-        memcpy( dest, (byte*)header + ofs, length );
+        if ( map_lump && ( (size_t)( base + ofs ) % alignof( T ) ) == 0 )
+        {
+                // Point straight into the mapped file, no copy.
+                dest.set_view( (T *)( base + ofs ), length / sizeof( T ) );
+        }
+        else
+        {
+                dest.resize( length / sizeof( T ) );
+                memcpy( dest.data(), base + ofs, length );
+        }
 
-        return length / size;
+        return length / sizeof( T );
 }
 
-template<class T>
-static int CopyLump( int lump, pvector<T> &dest, const dheader_t* const header )
-{
-        dest.resize( header->lumps[lump].filelen / sizeof( T ) );
-        return CopyLump( lump, dest.data(), sizeof( T ), header );
-}
-
-
 // =====================================================================================
-//  LoadBSPFile
-//      balh
+//  SwapBSPHeader
+//      swaps the header and makes sure it's a bsp we can read
 // =====================================================================================
-bspdata_t            *LoadBSPFile( const char* const filename )
-{
-        dheader_t* header;
-        LoadFile( filename, (char**)&header );
-        return LoadBSPImage( header );
-}
-
-// =====================================================================================
-//  LoadBSPImage
-//      balh
-// =====================================================================================
-bspdata_t            *LoadBSPImage( dheader_t* const header )
+static void     SwapBSPHeader( dheader_t* const header )
 {
         unsigned int     i;
 
-        // swap the header
         for ( i = 0; i < sizeof( dheader_t ) / 4; i++ )
         {
                 ( (int*)header )[i] = LittleLong( ( (int*)header )[i] );
@@ -401,52 +392,85 @@ bspdata_t            *LoadBSPImage( dheader_t* const header )
                 Error( "Not a valid PBSP file. Ident of file is %i, not %i", header->ident, PBSP_MAGIC );
         }
 
-        if ( header->version != BSPVERSION )
+        if ( header->version != BSPVERSION && header->version != BSPVERSION_NOLIGHTMAPPAGES )
         {
                 Error( "BSP is version %i, not %i", header->version, BSPVERSION );
         }
+}
 
-        bspdata_t *data = new bspdata_t;
+// =====================================================================================
+//  BSPHeaderSize
+//      size of the header at the start of a bsp image, older versions have fewer lumps
+// =====================================================================================
+static size_t   BSPHeaderSize( const byte* const base )
+{
+        int             version;
 
-        data->nummodels = CopyLump( LUMP_MODELS, data->dmodels, sizeof( dmodel_t ), header );
-        data->numvertexes = CopyLump( LUMP_VERTEXES, data->dvertexes, sizeof( dvertex_t ), header );
-        data->numplanes = CopyLump( LUMP_PLANES, data->dplanes, sizeof( dplane_t ), header );
-        data->numleafs = CopyLump( LUMP_LEAFS, data->dleafs, sizeof( dleaf_t ), header );
-        data->numnodes = CopyLump( LUMP_NODES, data->dnodes, sizeof( dnode_t ), header );
-        data->numtexinfo = CopyLump( LUMP_TEXINFO, data->texinfo, sizeof( texinfo_t ), header );
-        data->numfaces = CopyLump( LUMP_FACES, data->dfaces, sizeof( dface_t ), header );
-        //data->numorigfaces = CopyLump( LUMP_ORIGFACES, data->dorigfaces, sizeof( dface_t ), header );
-        data->nummarksurfaces = CopyLump( LUMP_MARKSURFACES, data->dmarksurfaces, sizeof( data->dmarksurfaces[0] ), header );
-        data->numsurfedges = CopyLump( LUMP_SURFEDGES, data->dsurfedges, sizeof( data->dsurfedges[0] ), header );
-        data->numedges = CopyLump( LUMP_EDGES, data->dedges, sizeof( dedge_t ), header );
-        data->numtexrefs = CopyLump( LUMP_TEXTURES, data->dtexrefs, sizeof( texref_t ), header );
-        data->visdatasize = CopyLump( LUMP_VISIBILITY, data->dvisdata, 1, header );
-        data->entdatasize = CopyLump( LUMP_ENTITIES, data->dentdata, 1, header );
+        memcpy( &version, base + sizeof( int ), sizeof( int ) );
+        version = LittleLong( version );
 
-        // new lumps uses STL vectors and templates!
-        CopyLump( LUMP_BRUSHES, data->dbrushes, header );
-        CopyLump( LUMP_BRUSHSIDES, data->dbrushsides, header );
-        CopyLump( LUMP_LEAFBRUSHES, data->dleafbrushes, header );
-        CopyLump( LUMP_LEAFAMBIENTINDEX, data->leafambientindex, header );
-        CopyLump( LUMP_LEAFAMBIENTLIGHTING, data->leafambientlighting, header );
-	CopyLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header );
-        CopyLump( LUMP_DIRECTLIGHTING, data->lightdata, header );
-	CopyLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header );
-        CopyLump( LUMP_STATICPROPS, data->dstaticprops, header );
-        CopyLump( LUMP_STATICPROPVERTEXDATA, data->dstaticpropvertexdatas, header );
-        CopyLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header );
-        CopyLump( LUMP_VERTNORMALS, data->vertnormals, header );
-        CopyLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header );
-        CopyLump( LUMP_CUBEMAPDATA, data->cubemapdata, header );
-        CopyLump( LUMP_CUBEMAPS, data->cubemaps, header );
-
-        Free( header );                                          // everything has been copied out
+        int numlumps = version == BSPVERSION_NOLIGHTMAPPAGES ? HEADER_LUMPS_NOLIGHTMAPPAGES : HEADER_LUMPS;
+        return offsetof( dheader_t, lumps ) + numlumps * sizeof( lump_t );
+}
 
-                                                                 //
-                                                                 // swap everything
-                                                                 //      
-        SwapBSPFile( data, false );
+// =====================================================================================
+//  ReadBSPHeader
+//      copies the header at the start of a bsp image and swaps it, the lumps that
+//      an older version doesn't have are left empty
+// =====================================================================================
+static void     ReadBSPHeader( dheader_t* const header, const byte* const base )
+{
+        memset( header, 0, sizeof( dheader_t ) );
+        memcpy( header, base, BSPHeaderSize( base ) );
+        SwapBSPHeader( header );
+}
+
+// =====================================================================================
+//  ReadBSPLumps
+//      copies the lumps out of a bsp image that starts at base, or, if map_lumps
+//      is set, points the lumps directly into it
+// =====================================================================================
+static void     ReadBSPLumps( bspdata_t* data, const dheader_t* const header, byte* const base, const bool map_lumps )
+{
+        data->nummodels = CopyLump( LUMP_MODELS, data->dmodels, header, base, map_lumps );
+        data->numvertexes = CopyLump( LUMP_VERTEXES, data->dvertexes, header, base, map_lumps );
+        data->numplanes = CopyLump( LUMP_PLANES, data->dplanes, header, base, map_lumps );
+        data->numleafs = CopyLump( LUMP_LEAFS, data->dleafs, header, base, map_lumps );
+        data->numnodes = CopyLump( LUMP_NODES, data->dnodes, header, base, map_lumps );
+        data->numtexinfo = CopyLump( LUMP_TEXINFO, data->texinfo, header, base, map_lumps );
+        data->numfaces = CopyLump( LUMP_FACES, data->dfaces, header, base, map_lumps );
+        //data->numorigfaces = CopyLump( LUMP_ORIGFACES, data->dorigfaces, header, base, map_lumps );
+        data->nummarksurfaces = CopyLump( LUMP_MARKSURFACES, data->dmarksurfaces, header, base, map_lumps );
+        data->numsurfedges = CopyLump( LUMP_SURFEDGES, data->dsurfedges, header, base, map_lumps );
+        data->numedges = CopyLump( LUMP_EDGES, data->dedges, header, base, map_lumps );
+        data->numtexrefs = CopyLump( LUMP_TEXTURES, data->dtexrefs, header, base, map_lumps );
+        data->visdatasize = CopyLump( LUMP_VISIBILITY, data->dvisdata, header, base, map_lumps );
+        data->entdatasize = CopyLump( LUMP_ENTITIES, data->dentdata, header, base, map_lumps );
+        CopyLump( LUMP_BRUSHES, data->dbrushes, header, base, map_lumps );
+        CopyLump( LUMP_BRUSHSIDES, data->dbrushsides, header, base, map_lumps );
+        CopyLump( LUMP_LEAFBRUSHES, data->dleafbrushes, header, base, map_lumps );
+        CopyLump( LUMP_LEAFAMBIENTINDEX, data->leafambientindex, header, base, map_lumps );
+        CopyLump( LUMP_LEAFAMBIENTLIGHTING, data->leafambientlighting, header, base, map_lumps );
+	CopyLump( LUMP_BOUNCEDLIGHTING, data->bouncedlightdata, header, base, map_lumps );
+        CopyLump( LUMP_DIRECTLIGHTING, data->lightdata, header, base, map_lumps );
+	CopyLump( LUMP_DIRECTSUNLIGHTING, data->sunlightdata, header, base, map_lumps );
+        CopyLump( LUMP_STATICPROPS, data->dstaticprops, header, base, map_lumps );
+        CopyLump( LUMP_STATICPROPVERTEXDATA, data->dstaticpropvertexdatas, header, base, map_lumps );
+        CopyLump( LUMP_STATICPROPLIGHTING, data->staticproplighting, header, base, map_lumps );
+        CopyLump( LUMP_VERTNORMALS, data->vertnormals, header, base, map_lumps );
+        CopyLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header, base, map_lumps );
+        CopyLump( LUMP_CUBEMAPDATA, data->cubemapdata, header, base, map_lumps );
+        CopyLump( LUMP_CUBEMAPS, data->cubemaps, header, base, map_lumps );
+        CopyLump( LUMP_LIGHTMAPPAGES, data->lightmappages, header, base, map_lumps );
+        CopyLump( LUMP_LIGHTMAPPAGEINFOS, data->lightmappageinfos, header, base, map_lumps );
+        CopyLump( LUMP_LIGHTMAPPAGEDATA, data->lightmappagedata, header, base, map_lumps );
+}
 
+// =====================================================================================
+//  ChecksumBSPData
+// =====================================================================================
+static void     ChecksumBSPData( bspdata_t* data )
+{
         data->dmodels_checksum = FastChecksum( data->dmodels, data->nummodels * sizeof( data->dmodels[0] ) );
         data->dvertexes_checksum = FastChecksum( data->dvertexes, data->numvertexes * sizeof( data->dvertexes[0] ) );
         data->dplanes_checksum = FastChecksum( data->dplanes, data->numplanes * sizeof( data->dplanes[0] ) );
@@ -458,10 +482,133 @@ bspdata_t            *LoadBSPImage( dheader_t* const header )
         data->dmarksurfaces_checksum = FastChecksum( data->dmarksurfaces, data->nummarksurfaces * sizeof( data->dmarksurfaces[0] ) );
         data->dsurfedges_checksum = FastChecksum( data->dsurfedges, data->numsurfedges * sizeof( data->dsurfedges[0] ) );
         data->dedges_checksum = FastChecksum( data->dedges, data->numedges * sizeof( data->dedges[0] ) );
-        data->dtexrefs_checksum = FastChecksum( data->dtexrefs, data->numedges * sizeof( data->dtexrefs[0] ) );
+        data->dtexrefs_checksum = FastChecksum( data->dtexrefs, data->numtexrefs * sizeof( data->dtexrefs[0] ) );
         data->dvisdata_checksum = FastChecksum( data->dvisdata, data->visdatasize * sizeof( data->dvisdata[0] ) );
         data->dlightdata_checksum = FastChecksum( data->lightdata.data(), data->lightdata.size() * sizeof( colorrgbexp32_t ) );
         data->dentdata_checksum = FastChecksum( data->dentdata, data->entdatasize * sizeof( data->dentdata[0] ) );
+}
+
+// =====================================================================================
+//  LoadBSPFile
+//      balh
+// =====================================================================================
+bspdata_t            *LoadBSPFile( const char* const filename )
+{
+        dheader_t* header;
+        LoadFile( filename, (char**)&header );
+        bspdata_t *data = LoadBSPImage( header );
+        // the compile tools keep adding to the lumps in place
+        ReserveBSPLumps( data );
+        return data;
+}
+
+// =====================================================================================
+//  ReserveBSPLumps
+//      Lumps are normally exactly the size of what was loaded.  The compile tools
+//      fill them in place up to the MAX_MAP_* limits, so this grows every limited
+//      lump to its limit.  The counts (numfaces, ...) are left alone.
+// =====================================================================================
+template<class T>
+static void ReserveLump( lumpdata_t<T> &lump, size_t maxcount )
+{
+        if ( lump.size() < maxcount )
+        {
+                lump.resize( maxcount );
+        }
+}
+
+void            ReserveBSPLumps( bspdata_t *data )
+{
+        ReserveLump( data->dmodels, MAX_MAP_MODELS );
+        ReserveLump( data->dvisdata, MAX_MAP_VISIBILITY );
+        ReserveLump( data->dtexrefs, MAX_MAP_TEXTURES );
+        ReserveLump( data->dentdata, MAX_MAP_ENTSTRING );
+        ReserveLump( data->dleafs, MAX_MAP_LEAFS );
+        ReserveLump( data->dplanes, MAX_INTERNAL_MAP_PLANES );
+        ReserveLump( data->dvertexes, MAX_MAP_VERTS );
+        ReserveLump( data->dnodes, MAX_MAP_NODES );
+        ReserveLump( data->texinfo, MAX_INTERNAL_MAP_TEXINFO );
+        ReserveLump( data->dfaces, MAX_MAP_FACES );
+        ReserveLump( data->dorigfaces, MAX_MAP_FACES );
+        ReserveLump( data->dedges, MAX_MAP_EDGES );
+        ReserveLump( data->dmarksurfaces, MAX_MAP_MARKSURFACES );
+        ReserveLump( data->dsurfedges, MAX_MAP_SURFEDGES );
+        ReserveLump( data->entities, MAX_MAP_ENTITIES );
+}
+
+// =====================================================================================
+//  LoadBSPFileMapped
+//      Maps the bsp file into memory and leaves the variable sized lumps in the
+//      mapping instead of copying them out.  The pages are shared with any other
+//      process that maps the same file.  offset and length select a range of the
+//      file, for a bsp stored uncompressed inside of a package.
+//      Returns nullptr if the file could not be mapped.
+// =====================================================================================
+bspdata_t            *LoadBSPFileMapped( const char* const filename, size_t offset, size_t length )
+{
+        mappedfile_t    map;
+        dheader_t       header;
+        int             i;
+
+        if ( !MapFile( filename, &map, offset, length ) )
+        {
+                return nullptr;
+        }
+
+        if ( map.size < offsetof( dheader_t, lumps ) || map.size < BSPHeaderSize( map.data ) )
+        {
+                UnmapFile( &map );
+                return nullptr;
+        }
+
+        // swap a copy of the header, the mapping is left alone
+        ReadBSPHeader( &header, map.data );
+
+        for ( i = 0; i < HEADER_LUMPS; i++ )
+        {
+                if ( header.lumps[i].fileofs < 0 || header.lumps[i].filelen < 0 ||
+                     (size_t)header.lumps[i].fileofs + (size_t)header.lumps[i].filelen > map.size )
+                {
+                        Error( "LoadBSPFile: lump %i of %s extends past the end of the file", i, filename );
+                }
+        }
+
+        bspdata_t *data = new bspdata_t;
+        data->mapping = map;
+
+        ReadBSPLumps( data, &header, map.data, true );
+
+#ifdef WORDS_BIGENDIAN
+        // Swapping writes to the mapped lumps, which only touches our private copy of those pages.
+        SwapBSPFile( data, false );
+#endif
+
+        ChecksumBSPData( data );
+
+        return data;
+}
+
+// =====================================================================================
+//  LoadBSPImage
+//      balh
+// =====================================================================================
+bspdata_t            *LoadBSPImage( dheader_t* const image )
+{
+        dheader_t       header;
+        ReadBSPHeader( &header, (byte*)image );
+
+        bspdata_t *data = new bspdata_t;
+
+        ReadBSPLumps( data, &header, (byte*)image, false );
+
+        Free( image );                                           // everything has been copied out
+
+                                                                 //
+                                                                 // swap everything
+                                                                 //      
+        SwapBSPFile( data, false );
+
+        ChecksumBSPData( data );
 
         return data;
 }
@@ -479,15 +626,69 @@ static void     AddLump( int lumpnum, void* data, int len, dheader_t* header, FI
         lump_t* lump = &header->lumps[lumpnum];
         lump->fileofs = LittleLong( ftell( bspfile ) );
         lump->filelen = LittleLong( len );
-        SafeWrite( bspfile, data, ( len + 3 ) & ~3 );
+        SafeWrite( bspfile, data, len );
+
+        // pad the lump out to a 4 byte boundary, the lump storage might not extend that far
+        static const byte pad[4] = { 0, 0, 0, 0 };
+        if ( len & 3 )
+        {
+                SafeWrite( bspfile, pad, 4 - ( len & 3 ) );
+        }
 }
 
 template<class T>
-static void AddLump( int lumpnum, pvector<T> &data, dheader_t *header, FILE *bspfile )
+static void AddLump( int lumpnum, lumpdata_t<T> &data, dheader_t *header, FILE *bspfile )
 {
         AddLump( lumpnum, data.data(), data.size() * sizeof( T ), header, bspfile );
 }
 
+// =====================================================================================
+//  UnmapBSPData
+//      Copies any lumps that still alias a mapped file into memory and closes
+//      the mapping, so the file can be written to.
+// =====================================================================================
+void            UnmapBSPData( bspdata_t *data )
+{
+        if ( !data->mapping.view )
+        {
+                return;
+        }
+
+        data->dmodels.own();
+        data->dvisdata.own();
+        data->dtexrefs.own();
+        data->dentdata.own();
+        data->dleafs.own();
+        data->dplanes.own();
+        data->dvertexes.own();
+        data->dnodes.own();
+        data->texinfo.own();
+        data->dfaces.own();
+        data->dedges.own();
+        data->dmarksurfaces.own();
+        data->dsurfedges.own();
+        data->dbrushes.own();
+        data->dbrushsides.own();
+        data->dleafbrushes.own();
+        data->leafambientindex.own();
+        data->leafambientlighting.own();
+        data->bouncedlightdata.own();
+        data->lightdata.own();
+        data->sunlightdata.own();
+        data->dstaticprops.own();
+        data->dstaticpropvertexdatas.own();
+        data->staticproplighting.own();
+        data->vertnormals.own();
+        data->vertnormalindices.own();
+        data->cubemapdata.own();
+        data->cubemaps.own();
+        data->lightmappages.own();
+        data->lightmappageinfos.own();
+        data->lightmappagedata.own();
+
+        UnmapFile( &data->mapping );
+}
+
 // =====================================================================================
 //  WriteBSPFile
 //      Swaps the bsp file in place, so it should not be referenced again
@@ -498,6 +699,9 @@ void            WriteBSPFile( bspdata_t *data, const char* const filename )
         dheader_t*      header;
         FILE*           bspfile;
 
+        // We might be writing over the file we were mapped from.
+        UnmapBSPData( data );
+
         header = &outheader;
         memset( header, 0, sizeof( dheader_t ) );
 
@@ -542,6 +746,9 @@ void            WriteBSPFile( bspdata_t *data, const char* const filename )
         AddLump( LUMP_VERTNORMALINDICES, data->vertnormalindices, header, bspfile );
         AddLump( LUMP_CUBEMAPDATA, data->cubemapdata, header, bspfile );
         AddLump( LUMP_CUBEMAPS, data->cubemaps, header, bspfile );
+        AddLump( LUMP_LIGHTMAPPAGES, data->lightmappages, header, bspfile );
+        AddLump( LUMP_LIGHTMAPPAGEINFOS, data->lightmappageinfos, header, bspfile );
+        AddLump( LUMP_LIGHTMAPPAGEDATA, data->lightmappagedata, header, bspfile );
 
         fseek( bspfile, 0, SEEK_SET );
         SafeWrite( bspfile, header, sizeof( dheader_t ) );
@@ -1015,7 +1222,6 @@ return NULL;
 #endif
 */
 
-#define ENTRIES(a)		(sizeof(a)/sizeof(*(a)))
 #define ENTRYSIZE(a)	(sizeof(*(a)))
 
 // =====================================================================================
@@ -1059,24 +1265,24 @@ void            PrintBSPFileSizes(bspdata_t *data)
         Log( "Object names  Objects/Maxobjs  Memory / Maxmem  Fullness\n" );
         Log( "------------  ---------------  ---------------  --------\n" );
 
-        totalmemory += ArrayUsage( "models", data->nummodels, ENTRIES( data->dmodels ), ENTRYSIZE( data->dmodels ) );
+        totalmemory += ArrayUsage( "models", data->nummodels, MAX_MAP_MODELS, ENTRYSIZE( data->dmodels ) );
         totalmemory += ArrayUsage( "planes", data->numplanes, MAX_MAP_PLANES, ENTRYSIZE( data->dplanes ) );
-        totalmemory += ArrayUsage( "vertexes", data->numvertexes, ENTRIES( data->dvertexes ), ENTRYSIZE( data->dvertexes ) );
-        totalmemory += ArrayUsage( "nodes", data->numnodes, ENTRIES( data->dnodes ), ENTRYSIZE( data->dnodes ) );
+        totalmemory += ArrayUsage( "vertexes", data->numvertexes, MAX_MAP_VERTS, ENTRYSIZE( data->dvertexes ) );
+        totalmemory += ArrayUsage( "nodes", data->numnodes, MAX_MAP_NODES, ENTRYSIZE( data->dnodes ) );
         totalmemory += ArrayUsage( "texinfos", data->numtexinfo, MAX_MAP_TEXINFO, ENTRYSIZE( data->texinfo ) );
-        totalmemory += ArrayUsage( "faces", data->numfaces, ENTRIES( data->dfaces ), ENTRYSIZE( data->dfaces ) );
-        //totalmemory += ArrayUsage( "origfaces", data->numorigfaces, ENTRIES( data->dorigfaces ), ENTRYSIZE( data->dorigfaces ) );
+        totalmemory += ArrayUsage( "faces", data->numfaces, MAX_MAP_FACES, ENTRYSIZE( data->dfaces ) );
+        //totalmemory += ArrayUsage( "origfaces", data->numorigfaces, MAX_MAP_FACES, ENTRYSIZE( data->dorigfaces ) );
         totalmemory += ArrayUsage( "* worldfaces", ( data->nummodels > 0 ? data->dmodels[0].numfaces : 0 ), MAX_MAP_WORLDFACES, 0 );
         totalmemory += ArrayUsage( "leaves", data->numleafs, MAX_MAP_LEAFS, ENTRYSIZE( data->dleafs ) );
         totalmemory += ArrayUsage( "* worldleaves", ( data->nummodels > 0 ? data->dmodels[0].visleafs : 0 ), MAX_MAP_LEAFS_ENGINE, 0 );
-        totalmemory += ArrayUsage( "marksurfaces", data->nummarksurfaces, ENTRIES( data->dmarksurfaces ), ENTRYSIZE( data->dmarksurfaces ) );
-        totalmemory += ArrayUsage( "surfedges", data->numsurfedges, ENTRIES( data->dsurfedges ), ENTRYSIZE( data->dsurfedges ) );
-        totalmemory += ArrayUsage( "edges", data->numedges, ENTRIES( data->dedges ), ENTRYSIZE( data->dedges ) );
-        totalmemory += ArrayUsage( "texrefs", data->numtexrefs, ENTRIES( data->dtexrefs ), ENTRYSIZE( data->dtexrefs ) );
+        totalmemory += ArrayUsage( "marksurfaces", data->nummarksurfaces, MAX_MAP_MARKSURFACES, ENTRYSIZE( data->dmarksurfaces ) );
+        totalmemory += ArrayUsage( "surfedges", data->numsurfedges, MAX_MAP_SURFEDGES, ENTRYSIZE( data->dsurfedges ) );
+        totalmemory += ArrayUsage( "edges", data->numedges, MAX_MAP_EDGES, ENTRYSIZE( data->dedges ) );
+        totalmemory += ArrayUsage( "texrefs", data->numtexrefs, MAX_MAP_TEXTURES, ENTRYSIZE( data->dtexrefs ) );
 
         totalmemory += GlobUsage( "lightdata", data->lightdata.size(), g_max_map_lightdata );
-        totalmemory += GlobUsage( "visdata", data->visdatasize, sizeof( data->dvisdata ) );
-        totalmemory += GlobUsage( "entdata", data->entdatasize, sizeof( data->dentdata ) );
+        totalmemory += GlobUsage( "visdata", data->visdatasize, MAX_MAP_VISIBILITY );
+        totalmemory += GlobUsage( "entdata", data->entdatasize, MAX_MAP_ENTSTRING );
         if ( numallocblocks == -1 )
         {
                 Log( "* AllocBlock    [ not available to the " PLATFORM_VERSIONSTRING " version ]\n" );
@@ -1146,6 +1352,11 @@ bool            ParseEntity(bspdata_t *data)
                 Error( "data->numentities == MAX_MAP_ENTITIES" );
         }
 
+        if ( data->numentities >= (int)data->entities.size() )
+        {
+                data->entities.resize( data->numentities + 1 );
+        }
+
         mapent = &data->entities[data->numentities];
         data->numentities++;
 
@@ -1315,6 +1526,11 @@ void            UnparseEntities(bspdata_t *data)
                                 {
                                         Error( "data->numentities == MAX_MAP_ENTITIES" );
                                 }
+                                if ( data->numentities >= (int)data->entities.size() )
+                                {
+                                        data->entities.resize( data->numentities + 1 );
+                                        mapent = &data->entities[i];
+                                }
                                 entity_t *newent = &data->entities[data->numentities++];
                                 newent->epairs = mapent->epairs;
                                 SetKeyValue( newent, "classname", "light_environment" );
@@ -1670,7 +1886,7 @@ LRGBColor dface_AvgLightColor( bspdata_t *data, dface_t *face, int style )
         return avg;
 }
 
-INLINE colorrgbexp32_t *SampleLightData( pvector<colorrgbexp32_t> &data, const dface_t *face, int ofs, int luxel, int style, int bump )
+INLINE colorrgbexp32_t *SampleLightData( lumpdata_t<colorrgbexp32_t> &data, const dface_t *face, int ofs, int luxel, int style, int bump )
 {
 	int luxels = ( face->lightmap_size[0] + 1 ) * ( face->lightmap_size[1] + 1 );
 	int bump_count = face->bumped_lightmap ? NUM_BUMP_VECTS + 1 : 1;
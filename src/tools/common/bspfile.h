@@ -1,6 +1,7 @@
 #ifndef BSPFILE_H__
 #define BSPFILE_H__
 #include "cmdlib.h" //--vluzacn
+#include "filelib.h"
 #include "mathlib.h"
 
 #include <pvector.h>
@@ -101,7 +102,10 @@
 #define MAX_LIGHTSTYLES 64
 //=============================================================================
 
-#define BSPVERSION  33
+#define BSPVERSION  34
+// Files from before the lightmap page lumps were added.  They are still
+// read, with those lumps empty.
+#define BSPVERSION_NOLIGHTMAPPAGES 33
 #define TOOLVERSION 4
 
 // One hammer unit is 1/16th of a foot.
@@ -150,8 +154,14 @@ enum
         LUMP_VERTNORMALINDICES,
         LUMP_CUBEMAPDATA,
         LUMP_CUBEMAPS,
+        LUMP_LIGHTMAPPAGES,
+        LUMP_LIGHTMAPPAGEINFOS,
+        LUMP_LIGHTMAPPAGEDATA,
 
 	HEADER_LUMPS,
+
+        // lumps in the header of a BSPVERSION_NOLIGHTMAPPAGES file
+        HEADER_LUMPS_NOLIGHTMAPPAGES = LUMP_LIGHTMAPPAGES,
 };
 
 typedef struct
@@ -409,6 +419,26 @@ struct dcubemap_t
         float pos[3];
 };
 
+// The lightmaps of the level packed into texture arrays by p3rad.  The texels
+// of a page are stored exactly as the game uploads them: each layer of the
+// array in turn, 16-bit BGR, bottom row first.
+struct dlightmappage_t
+{
+        int width, height;
+        int num_layers;
+        int dataofs; // byte offset into LUMP_LIGHTMAPPAGEDATA
+};
+
+#define LIGHTMAPPAGEINFO_FLIPPED 1
+
+// Where the lightmap of a face went, one for each face.
+struct dlightmappageinfo_t
+{
+        int page; // index into LUMP_LIGHTMAPPAGES, -1 if the face has no lightmap
+        unsigned short offset[2];
+        int flags;
+};
+
 typedef struct epair_s
 {
         struct epair_s* next;
@@ -431,88 +461,240 @@ entity_t;
 #define ANGLE_UP    -1.0 //#define ANGLE_UP    -1 //--vluzacn
 #define ANGLE_DOWN  -2.0 //#define ANGLE_DOWN  -2 //--vluzacn
 
+//
+// Storage for a lump, sized to exactly what is in the file.  Behaves like a
+// pvector, but can also alias lump data that lives somewhere else, such as a
+// memory-mapped BSP file (see LoadBSPFileMapped()).  Elements of an aliased
+// lump may be modified in place, but anything that changes the size of the
+// lump copies it into owned storage first.
+//
+// It converts to a plain pointer to the first element, so code written
+// against the old fixed-size lump arrays (data->dfaces + facenum,
+// leaf - data->dleafs, ...) works unchanged.
+//
+
+template<class T>
+class lumpdata_t
+{
+public:
+        typedef T value_type;
+        typedef T *iterator;
+        typedef const T *const_iterator;
+        typedef size_t size_type;
+
+        INLINE lumpdata_t() :
+                _view( nullptr ),
+                _view_count( 0 )
+        {
+        }
+
+        INLINE void set_view( T *view, size_t count )
+        {
+                pvector<T>().swap( _storage );
+                _view = count > 0 ? view : nullptr;
+                _view_count = count > 0 ? count : 0;
+        }
+
+        INLINE bool is_view() const
+        {
+                return _view != nullptr;
+        }
+
+        INLINE size_t size() const
+        {
+                return _view ? _view_count : _storage.size();
+        }
+
+        INLINE bool empty() const
+        {
+                return size() == 0;
+        }
+
+        INLINE T *data()
+        {
+                return _view ? _view : _storage.data();
+        }
+
+        INLINE const T *data() const
+        {
+                return _view ? _view : _storage.data();
+        }
+
+        INLINE operator T *()
+        {
+                return data();
+        }
+
+        INLINE operator const T *() const
+        {
+                return data();
+        }
+
+        INLINE iterator begin()
+        {
+                return data();
+        }
+
+        INLINE iterator end()
+        {
+                return data() + size();
+        }
+
+        INLINE const_iterator begin() const
+        {
+                return data();
+        }
+
+        INLINE const_iterator end() const
+        {
+                return data() + size();
+        }
+
+        INLINE void push_back( const T &val )
+        {
+                own();
+                _storage.push_back( val );
+        }
+
+        INLINE void resize( size_t count )
+        {
+                own();
+                _storage.resize( count );
+        }
+
+        INLINE void reserve( size_t count )
+        {
+                own();
+                _storage.reserve( count );
+        }
+
+        INLINE void clear()
+        {
+                _view = nullptr;
+                _view_count = 0;
+                _storage.clear();
+        }
+
+        // Copies an aliased lump into our own storage.
+        INLINE void own()
+        {
+                if ( _view )
+                {
+                        _storage.assign( _view, _view + _view_count );
+                        _view = nullptr;
+                        _view_count = 0;
+                }
+        }
+
+private:
+        pvector<T> _storage;
+        T *_view;
+        size_t _view_count;
+};
+
 //
 // BSP File Data
 //
 
 struct bspdata_t
 {
+        INLINE bspdata_t()
+        {
+                memset( &mapping, 0, sizeof( mappedfile_t ) );
+        }
+
+        INLINE ~bspdata_t()
+        {
+                // Lumps may still alias the mapping, so it goes away with us.
+                UnmapFile( &mapping );
+        }
+
+        // A copy would unmap the file out from under the original.
+        bspdata_t( const bspdata_t & ) = delete;
+        bspdata_t &operator = ( const bspdata_t & ) = delete;
+
         int      nummodels;
-        dmodel_t dmodels[MAX_MAP_MODELS];
+        lumpdata_t<dmodel_t> dmodels;
         int      dmodels_checksum;
 
         int      visdatasize;
-        byte     dvisdata[MAX_MAP_VISIBILITY];
+        lumpdata_t<byte> dvisdata;
         int      dvisdata_checksum;
 
         int      numtexrefs;
-        texref_t dtexrefs[MAX_MAP_TEXTURES];                                  // (dtexlump_t)
+        lumpdata_t<texref_t> dtexrefs;                                       // (dtexlump_t)
         int      dtexrefs_checksum;
 
         int      entdatasize;
-        char     dentdata[MAX_MAP_ENTSTRING];
+        lumpdata_t<char> dentdata;
         int      dentdata_checksum;
 
         int      numleafs;
-        dleaf_t  dleafs[MAX_MAP_LEAFS];
+        lumpdata_t<dleaf_t> dleafs;
         int      dleafs_checksum;
 
         int      numplanes;
-        dplane_t dplanes[MAX_INTERNAL_MAP_PLANES];
+        lumpdata_t<dplane_t> dplanes;
         int      dplanes_checksum;
 
         int      numvertexes;
-        dvertex_t dvertexes[MAX_MAP_VERTS];
+        lumpdata_t<dvertex_t> dvertexes;
         int      dvertexes_checksum;
 
         int      numnodes;
-        dnode_t  dnodes[MAX_MAP_NODES];
+        lumpdata_t<dnode_t> dnodes;
         int      dnodes_checksum;
 
         int      numtexinfo;
-        texinfo_t texinfo[MAX_INTERNAL_MAP_TEXINFO];
+        lumpdata_t<texinfo_t> texinfo;
         int      texinfo_checksum;
 
         int      numfaces;
-        dface_t  dfaces[MAX_MAP_FACES];
+        lumpdata_t<dface_t> dfaces;
         int      dfaces_checksum;
 
         int	numorigfaces;
-        dface_t	dorigfaces[MAX_MAP_FACES];
+        lumpdata_t<dface_t> dorigfaces;
         int	dorigfaces_checksum;
 
         int      numedges;
-        dedge_t  dedges[MAX_MAP_EDGES];
+        lumpdata_t<dedge_t> dedges;
         int      dedges_checksum;
 
         int      nummarksurfaces;
-        unsigned short dmarksurfaces[MAX_MAP_MARKSURFACES];
+        lumpdata_t<unsigned short> dmarksurfaces;
         int      dmarksurfaces_checksum;
 
         int      numsurfedges;
-        int      dsurfedges[MAX_MAP_SURFEDGES];
+        lumpdata_t<int> dsurfedges;
         int      dsurfedges_checksum;
 
-        pvector<dleafambientlighting_t> leafambientlighting;
-        pvector<dleafambientindex_t> leafambientindex;
-        pvector<dbrush_t> dbrushes;
-        pvector<dbrushside_t> dbrushsides;
-        pvector<unsigned short> dleafbrushes;
-        pvector<dstaticprop_t> dstaticprops;
-        pvector<dstaticpropvertexdata_t> dstaticpropvertexdatas;
-        pvector<colorrgbexp32_t> staticproplighting;
-        pvector<dvertex_t> vertnormals;
-        pvector<unsigned short> vertnormalindices;
-        pvector<colorrgbexp32_t> cubemapdata;
-        pvector<dcubemap_t> cubemaps;
-
-	pvector<colorrgbexp32_t> bouncedlightdata;
-	pvector<colorrgbexp32_t> sunlightdata;
-	pvector<colorrgbexp32_t> lightdata;
+        lumpdata_t<dleafambientlighting_t> leafambientlighting;
+        lumpdata_t<dleafambientindex_t> leafambientindex;
+        lumpdata_t<dbrush_t> dbrushes;
+        lumpdata_t<dbrushside_t> dbrushsides;
+        lumpdata_t<unsigned short> dleafbrushes;
+        lumpdata_t<dstaticprop_t> dstaticprops;
+        lumpdata_t<dstaticpropvertexdata_t> dstaticpropvertexdatas;
+        lumpdata_t<colorrgbexp32_t> staticproplighting;
+        lumpdata_t<dvertex_t> vertnormals;
+        lumpdata_t<unsigned short> vertnormalindices;
+        lumpdata_t<colorrgbexp32_t> cubemapdata;
+        lumpdata_t<dcubemap_t> cubemaps;
+        lumpdata_t<dlightmappage_t> lightmappages;
+        lumpdata_t<dlightmappageinfo_t> lightmappageinfos;
+        lumpdata_t<byte> lightmappagedata;
+
+	lumpdata_t<colorrgbexp32_t> bouncedlightdata;
+	lumpdata_t<colorrgbexp32_t> sunlightdata;
+	lumpdata_t<colorrgbexp32_t> lightdata;
 	int      dlightdata_checksum;
 
         int      numentities;
-        entity_t entities[MAX_MAP_ENTITIES];
+        lumpdata_t<entity_t> entities;
+
+        // The file that the lumps were mapped from, if any
+        mappedfile_t mapping;
 };
 
 extern _BSPEXPORT bspdata_t *g_bspdata;
@@ -523,6 +705,9 @@ extern _BSPEXPORT int      CompressVis( const byte* const src, const unsigned in
 
 extern _BSPEXPORT bspdata_t     *LoadBSPImage( dheader_t* header );
 extern _BSPEXPORT bspdata_t     *LoadBSPFile( const char* const filename );
+extern _BSPEXPORT bspdata_t     *LoadBSPFileMapped( const char* const filename, size_t offset = 0, size_t length = 0 );
+extern _BSPEXPORT void     ReserveBSPLumps( bspdata_t *data );
+extern _BSPEXPORT void     UnmapBSPData( bspdata_t *data );
 extern _BSPEXPORT void     WriteBSPFile( bspdata_t *data, const char* const filename );
 extern _BSPEXPORT void     PrintBSPFileSizes( bspdata_t *data );
 #ifdef PLATFORM_CAN_CALC_EXTENT
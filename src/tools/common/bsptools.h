@@ -30,6 +30,12 @@ INLINE LVector3 angles_to_vector( const vec3_t &angles )
 
 struct _BSPEXPORT Ray
 {
+        Ray() :
+                is_swept( false ),
+                is_ray( true )
+        {
+        }
+
         Ray( const LPoint3 &s, const LPoint3 &e,
              const LPoint3 &mi, const LPoint3 &ma )
         {
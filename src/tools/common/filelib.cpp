@@ -3,6 +3,7 @@
 #endif
 
 #ifdef _WIN32
+#include <windows.h>
 #include <sys/stat.h>
 #include <io.h>
 #include <fcntl.h>
@@ -20,6 +21,8 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+
+#include <sys/mman.h>
 #endif
 
 #include "filelib.h"
@@ -215,3 +218,126 @@ void            SaveFile( const char* const filename, const void* const buffer,
         fclose( f );
 }
 
+
+/*
+* ==============
+* MapFile
+*
+* Maps `length` bytes of the file starting at `offset` into memory.  A length
+* of 0 maps everything from `offset` to the end of the file.  Returns false
+* if the file could not be mapped, in which case the caller should fall back
+* to reading it.
+* ==============
+*/
+bool            MapFile( const char* const filename, mappedfile_t* map, size_t offset, size_t length )
+{
+        memset( map, 0, sizeof( mappedfile_t ) );
+
+#ifdef _WIN32
+        HANDLE          file;
+        HANDLE          mapping;
+        LARGE_INTEGER   filesize;
+        SYSTEM_INFO     sysinfo;
+        size_t          aligned;
+        void*           view;
+
+        file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+        if ( file == INVALID_HANDLE_VALUE )
+        {
+                return false;
+        }
+
+        if ( !GetFileSizeEx( file, &filesize ) || (unsigned long long)filesize.QuadPart <= offset )
+        {
+                CloseHandle( file );
+                return false;
+        }
+        if ( length == 0 || offset + length > (unsigned long long)filesize.QuadPart )
+        {
+                length = (size_t)( filesize.QuadPart - offset );
+        }
+
+        // The mapping object holds its own reference to the file.
+        mapping = CreateFileMappingA( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+        CloseHandle( file );
+        if ( mapping == NULL )
+        {
+                return false;
+        }
+
+        GetSystemInfo( &sysinfo );
+        aligned = offset - ( offset % sysinfo.dwAllocationGranularity );
+
+        view = MapViewOfFile( mapping, FILE_MAP_COPY, (DWORD)( (unsigned long long)aligned >> 32 ),
+                              (DWORD)( aligned & 0xFFFFFFFF ), ( offset - aligned ) + length );
+        if ( view == NULL )
+        {
+                CloseHandle( mapping );
+                return false;
+        }
+
+        map->mapping = mapping;
+#else
+        int             fd;
+        struct stat     filestat;
+        size_t          aligned;
+        long            pagesize;
+        void*           view;
+
+        fd = open( filename, O_RDONLY );
+        if ( fd == -1 )
+        {
+                return false;
+        }
+
+        if ( fstat( fd, &filestat ) != 0 || (size_t)filestat.st_size <= offset )
+        {
+                close( fd );
+                return false;
+        }
+        if ( length == 0 || offset + length > (size_t)filestat.st_size )
+        {
+                length = (size_t)filestat.st_size - offset;
+        }
+
+        pagesize = sysconf( _SC_PAGESIZE );
+        aligned = offset - ( offset % pagesize );
+
+        // The mapping holds its own reference to the file.
+        view = mmap( NULL, ( offset - aligned ) + length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, aligned );
+        close( fd );
+        if ( view == MAP_FAILED )
+        {
+                return false;
+        }
+#endif
+
+        map->view = view;
+        map->viewsize = ( offset - aligned ) + length;
+        map->data = (byte*)view + ( offset - aligned );
+        map->size = length;
+
+        return true;
+}
+
+/*
+* ==============
+* UnmapFile
+* ==============
+*/
+void            UnmapFile( mappedfile_t* map )
+{
+        if ( !map->view )
+        {
+                return;
+        }
+
+#ifdef _WIN32
+        UnmapViewOfFile( map->view );
+        CloseHandle( (HANDLE)map->mapping );
+#else
+        munmap( map->view, map->viewsize );
+#endif
+
+        memset( map, 0, sizeof( mappedfile_t ) );
+}
@@ -20,4 +20,22 @@ extern _BSPEXPORT void     SafeWrite( FILE* f, const void* const buffer, int cou
 extern _BSPEXPORT int      LoadFile( const char* const filename, char** bufferptr );
 extern _BSPEXPORT void     SaveFile( const char* const filename, const void* const buffer, int count );
 
+// A range of a file mapped into memory.  The pages are mapped copy-on-write,
+// so they are shared with every other process mapping the same file until
+// somebody writes to them, and writes never reach the file on disk.
+typedef struct
+{
+        byte*           data;                                  // start of the requested range
+        size_t          size;                                  // length of the requested range
+        void*           view;                                  // start of the mapping (allocation aligned)
+        size_t          viewsize;
+#ifdef _WIN32
+        void*           mapping;                               // HANDLE of the file mapping object
+#endif
+}
+mappedfile_t;
+
+extern _BSPEXPORT bool     MapFile( const char* const filename, mappedfile_t* map, size_t offset = 0, size_t length = 0 );
+extern _BSPEXPORT void     UnmapFile( mappedfile_t* map );
+
 #endif //**/ FILELIB_H__
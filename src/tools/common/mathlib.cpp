@@ -4,16 +4,134 @@
 #include "hlassert.h"
 #include "mathtypes.h"
 #include "mathlib.h"
+#include "mathlib/ssemath.h"
 #include "win32fix.h"
 
 const vec3_t    vec3_origin = { 0, 0, 0 };
 
+// 2^exponent for each value of the exponent byte, so decoding a color
+// doesn't have to call pow().
+struct rgbexp32_powers_t
+{
+        float power[256];
+
+        rgbexp32_powers_t()
+        {
+                for ( int i = 0; i < 256; i++ )
+                {
+                        power[i] = ldexpf( 1.0f, (signed char)i );
+                }
+        }
+};
+
+static const float *GetRGBExp32Powers()
+{
+        static const rgbexp32_powers_t powers;
+        return powers.power;
+}
+
 void ColorRGBExp32ToVector( const colorrgbexp32_t& in, LVector3& out )
 {
         // FIXME: Why is there a factor of 255 built into this?
-        out[0] = 255.0f * TexLightToLinear( in.r, in.exponent );
-        out[1] = 255.0f * TexLightToLinear( in.g, in.exponent );
-        out[2] = 255.0f * TexLightToLinear( in.b, in.exponent );
+        // (255 * TexLightToLinear() is just the channel times 2^exponent.)
+        float power = GetRGBExp32Powers()[(unsigned char)in.exponent];
+        out[0] = in.r * power;
+        out[1] = in.g * power;
+        out[2] = in.b * power;
+}
+
+// =====================================================================================
+//  ColorRGBExp32ToTexels16
+//      Decodes count colors into 16-bit texels, in the blue, green, red order of
+//      a Texture RAM image.  Each channel is the color times scale, clamped to
+//      0..1, which is what storing it in a 16-bit linear PNMImage does.
+//      Four colors are converted at a time.
+// =====================================================================================
+void ColorRGBExp32ToTexels16( const colorrgbexp32_t *in, int count, float scale, unsigned short *out )
+{
+        const float *powers = GetRGBExp32Powers();
+        const fltx4 maxval = ReplicateX4( 65535.0f );
+        const fltx4 half = ReplicateX4( 0.5f );
+
+        ALIGN_16BYTE float r[4];
+        ALIGN_16BYTE float g[4];
+        ALIGN_16BYTE float b[4];
+        ALIGN_16BYTE float p[4];
+
+        int i = 0;
+        for ( ; i + 4 <= count; i += 4 )
+        {
+                for ( int j = 0; j < 4; j++ )
+                {
+                        const colorrgbexp32_t &col = in[i + j];
+                        r[j] = col.r;
+                        g[j] = col.g;
+                        b[j] = col.b;
+                        p[j] = powers[(unsigned char)col.exponent] * scale;
+                }
+
+                fltx4 p4 = LoadAlignedSIMD( p );
+                fltx4 r4 = MinSIMD( MaxSIMD( MulSIMD( LoadAlignedSIMD( r ), p4 ), Four_Zeros ), Four_Ones );
+                fltx4 g4 = MinSIMD( MaxSIMD( MulSIMD( LoadAlignedSIMD( g ), p4 ), Four_Zeros ), Four_Ones );
+                fltx4 b4 = MinSIMD( MaxSIMD( MulSIMD( LoadAlignedSIMD( b ), p4 ), Four_Zeros ), Four_Ones );
+                StoreAlignedSIMD( r, AddSIMD( MulSIMD( r4, maxval ), half ) );
+                StoreAlignedSIMD( g, AddSIMD( MulSIMD( g4, maxval ), half ) );
+                StoreAlignedSIMD( b, AddSIMD( MulSIMD( b4, maxval ), half ) );
+
+                for ( int j = 0; j < 4; j++ )
+                {
+                        out[0] = (unsigned short)b[j];
+                        out[1] = (unsigned short)g[j];
+                        out[2] = (unsigned short)r[j];
+                        out += 3;
+                }
+        }
+
+        for ( ; i < count; i++ )
+        {
+                const colorrgbexp32_t &col = in[i];
+                float power = powers[(unsigned char)col.exponent] * scale;
+                out[0] = (unsigned short)( qmin( qmax( col.b * power, 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                out[1] = (unsigned short)( qmin( qmax( col.g * power, 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                out[2] = (unsigned short)( qmin( qmax( col.r * power, 0.0f ), 1.0f ) * 65535.0f + 0.5f );
+                out += 3;
+        }
+}
+
+// =====================================================================================
+//  BlitTexels16
+//      Copies a width x height block of 3-channel 16-bit texels, top row first,
+//      into a Texture RAM image (which is bottom row first) with its top left
+//      corner at x, y counting from the top.  If rotated, the block is transposed
+//      on the way, so it covers height x width texels of the destination.
+// =====================================================================================
+void BlitTexels16( const unsigned short *src, int width, int height,
+                   unsigned short *dest, int dest_width, int dest_height,
+                   int x, int y, bool rotated )
+{
+        int rows = rotated ? width : height;
+        int cols = rotated ? height : width;
+
+        hlassert( x >= 0 && y >= 0 && x + cols <= dest_width && y + rows <= dest_height );
+
+        for ( int row = 0; row < rows; row++ )
+        {
+                unsigned short *d = dest + ( (size_t)( dest_height - 1 - ( y + row ) ) * dest_width + x ) * 3;
+                if ( !rotated )
+                {
+                        memcpy( d, src + (size_t)row * width * 3, width * 3 * sizeof( unsigned short ) );
+                        continue;
+                }
+
+                for ( int col = 0; col < cols; col++ )
+                {
+                        const unsigned short *s = src + ( (size_t)col * width + row ) * 3;
+                        d[0] = s[0];
+                        d[1] = s[1];
+                        d[2] = s[2];
+                        d += 3;
+                }
+        }
 }
 
 // given a floating point number  f, return an exponent e such that
@@ -233,6 +233,10 @@ struct colorrgbexp32_t
 
 _BSPEXPORT void VectorToColorRGBExp32( const LVector3 &v, colorrgbexp32_t &out );
 _BSPEXPORT void ColorRGBExp32ToVector( const colorrgbexp32_t &color, LVector3 &out );
+_BSPEXPORT void ColorRGBExp32ToTexels16( const colorrgbexp32_t *in, int count, float scale, unsigned short *out );
+_BSPEXPORT void BlitTexels16( const unsigned short *src, int width, int height,
+                              unsigned short *dest, int dest_width, int dest_height,
+                              int x, int y, bool rotated );
 
 // maps a float to a byte fraction between min & max
 INLINE unsigned char fixed_8_fraction( float t, float tMin, float tMax )
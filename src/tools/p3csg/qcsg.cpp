@@ -1957,6 +1957,7 @@ int             main( const int argc, char** argv )
                         DefaultExtension( name, ".map" );                  // might be .reg
 
                         g_bspdata = new bspdata_t;
+                        ReserveBSPLumps( g_bspdata );
 
                         LoadMapFile( name );
                         ThreadSetDefault();
@@ -5,6 +5,8 @@
 
 #include "KDTree.h"
 
+using namespace std;
+
 
 bool KDTree::KDTreeNode::is_leaf() {
     return (left == nullptr) && (right == nullptr);
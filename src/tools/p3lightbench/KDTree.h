@@ -16,35 +16,32 @@
 #include <iostream>
 #include <unordered_map>
 #include "utils.h"
-#include "config_bsp.h"
 
 #include <referenceCount.h>
 
-using namespace std;
-
-class EXPCL_PANDABSP KDTree : public ReferenceCount {
+class KDTree : public ReferenceCount {
 public:
     explicit KDTree(unsigned int dim)
             : dim(dim), num_samples(0), Datas(), root(nullptr) {}
     ~KDTree() = default;
 
-    void build(vector<vector<double> > & datas);
+    void build(std::vector<std::vector<double> > & datas);
     unsigned int depth();
     void render();
-    unordered_map<unsigned int, double> query(vector<double> & data, unsigned int k);
-    unordered_map<unsigned int, double> query_distance(vector<double> & data, double dist);
-    pair<unsigned int, double> query(vector<double> & data);
+    std::unordered_map<unsigned int, double> query(std::vector<double> & data, unsigned int k);
+    std::unordered_map<unsigned int, double> query_distance(std::vector<double> & data, double dist);
+    std::pair<unsigned int, double> query(std::vector<double> & data);
 
     unsigned int dim; // number of features
     unsigned int num_samples; // number of samples
-    vector<vector<double> > Datas;
+    std::vector<std::vector<double> > Datas;
 
 private:
     class KDTreeNode {
     public:
         explicit KDTreeNode(unsigned int index,
                            unsigned int split_axis,
-                           vector<vector<unsigned int> > & indexs,
+                           std::vector<std::vector<unsigned int> > & indexs,
                            KDTreeNode * parent=nullptr,
                            KDTreeNode * left=nullptr,
                            KDTreeNode * right=nullptr)
@@ -57,7 +54,7 @@ private:
 
         unsigned int index;
         unsigned int split_axis;
-        vector<vector<unsigned int> > indexs;
+        std::vector<std::vector<unsigned int> > indexs;
         KDTreeNode * parent;
         KDTreeNode * left;
         KDTreeNode * right;
@@ -69,10 +66,10 @@ private:
     KDTreeNode * root;
     unsigned int depth(KDTreeNode * node);
     void render(KDTreeNode * node);
-    void mergesort(vector<vector<double> > & arr, vector<unsigned int> & args, unsigned int axis, unsigned int left, unsigned int right);
-    vector<vector<unsigned int> > argsort();
+    void mergesort(std::vector<std::vector<double> > & arr, std::vector<unsigned int> & args, unsigned int axis, unsigned int left, unsigned int right);
+    std::vector<std::vector<unsigned int> > argsort();
     bool smaller(unsigned int row1, unsigned int row2, unsigned int axis);
-    double computeDistance(vector<double> & data1, vector<double> & data2);
+    double computeDistance(std::vector<double> & data1, std::vector<double> & data2);
 };
 
 
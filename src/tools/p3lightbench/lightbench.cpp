@@ -0,0 +1,466 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file lightbench.cpp
+ *
+ * @desc Times the lighting code of libpandabsp against the lighting of a
+ *       compiled level, and checks that the fast paths give the same results
+ *       as the ones they replace.
+ */
+
+#include "cmdlib.h"
+#include "log.h"
+#include "bspfile.h"
+#include "mathlib.h"
+#include "kdtree/flat_kdtree.h"
+#include "KDTree.h"
+
+#include <pnmImage.h>
+
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <cfloat>
+#include <algorithm>
+
+static int g_passes = 10;
+static int g_palette_width = 1024;
+static int g_numprobes = 16384;
+static int g_numqueries = 20000;
+static unsigned int g_seed = 1;
+
+// =====================================================================================
+//  Lightmap texels
+// =====================================================================================
+
+// The first lightmap of a face, and where it goes in the palette.
+struct benchlightmap_t
+{
+        const colorrgbexp32_t *samples;
+        int width;
+        int height;
+        int x;
+        int y;
+        bool rotated;
+};
+
+// Lays the lightmaps of the level out in rows of a palette, rotating every
+// other one so the rotated copy is covered too.  Returns the palette height.
+static int PlaceLightmaps( bspdata_t *data, pvector<benchlightmap_t> &lightmaps )
+{
+        int x = 0;
+        int y = 0;
+        int row_height = 0;
+
+        for ( int facenum = 0; facenum < data->numfaces; facenum++ )
+        {
+                dface_t *face = &data->dfaces[facenum];
+                int width = face->lightmap_size[0] + 1;
+                int height = face->lightmap_size[1] + 1;
+                if ( face->lightofs == -1 || width <= 0 || height <= 0 )
+                {
+                        continue;
+                }
+
+                benchlightmap_t lm;
+                lm.samples = SampleLightmap( data, face, 0, 0 );
+                lm.width = width;
+                lm.height = height;
+                lm.rotated = ( lightmaps.size() & 1 ) != 0;
+
+                int cols = lm.rotated ? height : width;
+                int rows = lm.rotated ? width : height;
+                if ( cols > g_palette_width )
+                {
+                        continue;
+                }
+                if ( x + cols > g_palette_width )
+                {
+                        x = 0;
+                        y += row_height;
+                        row_height = 0;
+                }
+                lm.x = x;
+                lm.y = y;
+                x += cols;
+                row_height = std::max( row_height, rows );
+
+                lightmaps.push_back( lm );
+        }
+
+        return y + row_height;
+}
+
+// The old copy of a lightmap into the palette, one texel at a time.
+static void CopyToPalette( const PNMImage &img, const benchlightmap_t &lm, PNMImage &palette )
+{
+        int cols = lm.rotated ? lm.height : lm.width;
+        int rows = lm.rotated ? lm.width : lm.height;
+        for ( int y = 0; y < rows; y++ )
+        {
+                for ( int x = 0; x < cols; x++ )
+                {
+                        palette.set_xel( x + lm.x, y + lm.y, lm.rotated ? img.get_xel( y, x ) : img.get_xel( x, y ) );
+                }
+        }
+}
+
+static PNMImage MakeLinear16Image( int width, int height )
+{
+        PNMImage img( width, height );
+        img.set_color_space( ColorSpace::CS_linear );
+        img.set_maxval( USHRT_MAX );
+        img.fill( 0 );
+        return img;
+}
+
+// ColorRGBExp32ToTexels16() and BlitTexels16() into a RAM image against the
+// old ColorRGBExp32ToVector(), which called pow() through TexLightToLinear(),
+// and PNMImage::set_xel(), which is how the lightmap palettes used to be built.
+static void BenchLightmapTexels( bspdata_t *data )
+{
+        pvector<benchlightmap_t> lightmaps;
+        int palette_height = PlaceLightmaps( data, lightmaps );
+        if ( lightmaps.empty() )
+        {
+                Log( "\nThe level has no lightmaps\n" );
+                return;
+        }
+
+        double num_texels = 0;
+        for ( size_t i = 0; i < lightmaps.size(); i++ )
+        {
+                num_texels += (double)lightmaps[i].width * lightmaps[i].height;
+        }
+        num_texels *= g_passes;
+
+        Log( "\nLightmap texels, %d lightmaps in a %dx%d palette:\n",
+             (int)lightmaps.size(), g_palette_width, palette_height );
+
+        size_t palette_texels = (size_t)g_palette_width * palette_height * 3;
+        pvector<unsigned short> ram_image( palette_texels );
+        pvector<unsigned short> texels;
+
+        double start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < lightmaps.size(); i++ )
+                {
+                        const benchlightmap_t &lm = lightmaps[i];
+                        texels.resize( (size_t)lm.width * lm.height * 3 );
+                        ColorRGBExp32ToTexels16( lm.samples, lm.width * lm.height, 1.0f / 255.0f, texels.data() );
+                        BlitTexels16( texels.data(), lm.width, lm.height, ram_image.data(),
+                                      g_palette_width, palette_height, lm.x, lm.y, lm.rotated );
+                }
+        }
+        double seconds = I_FloatTime() - start;
+        Log( "    %-36s %8.3f s  %8.3f Mtexels/s\n", "ColorRGBExp32ToTexels16", seconds,
+             num_texels / seconds / 1000000.0 );
+
+        PNMImage palette = MakeLinear16Image( g_palette_width, palette_height );
+
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < lightmaps.size(); i++ )
+                {
+                        const benchlightmap_t &lm = lightmaps[i];
+                        PNMImage img = MakeLinear16Image( lm.width, lm.height );
+                        int luxel = 0;
+                        for ( int y = 0; y < lm.height; y++ )
+                        {
+                                for ( int x = 0; x < lm.width; x++ )
+                                {
+                                        const colorrgbexp32_t &col = lm.samples[luxel++];
+                                        img.set_xel( x, y, LVector3( TexLightToLinear( col.r, col.exponent ),
+                                                                     TexLightToLinear( col.g, col.exponent ),
+                                                                     TexLightToLinear( col.b, col.exponent ) ) );
+                                }
+                        }
+                        CopyToPalette( img, lm, palette );
+                }
+        }
+        seconds = I_FloatTime() - start;
+        Log( "    %-36s %8.3f s  %8.3f Mtexels/s\n", "ColorRGBExp32ToVector + set_xel", seconds,
+             num_texels / seconds / 1000000.0 );
+
+        // The decode may be off by a 16-bit step, where pow() and the table
+        // round differently.  A RAM image is bottom row first, blue first.
+        int max_diff = 0;
+        int off_texels = 0;
+        for ( int y = 0; y < palette_height; y++ )
+        {
+                const unsigned short *row = &ram_image[(size_t)( palette_height - 1 - y ) * g_palette_width * 3];
+                for ( int x = 0; x < g_palette_width; x++ )
+                {
+                        const unsigned short *texel = row + x * 3;
+                        int diff = std::max( std::abs( (int)texel[0] - (int)palette.get_blue_val( x, y ) ),
+                                   std::max( std::abs( (int)texel[1] - (int)palette.get_green_val( x, y ) ),
+                                             std::abs( (int)texel[2] - (int)palette.get_red_val( x, y ) ) ) );
+                        max_diff = std::max( max_diff, diff );
+                        if ( diff > 1 )
+                        {
+                                off_texels++;
+                        }
+                }
+        }
+        Log( "    decode: largest difference %d, %d texels off by more than one step\n", max_diff, off_texels );
+
+        // The copy has to be exact, so copy the same decoded texels both ways.
+        PNMImage copied = MakeLinear16Image( g_palette_width, palette_height );
+        for ( size_t i = 0; i < lightmaps.size(); i++ )
+        {
+                const benchlightmap_t &lm = lightmaps[i];
+                texels.resize( (size_t)lm.width * lm.height * 3 );
+                ColorRGBExp32ToTexels16( lm.samples, lm.width * lm.height, 1.0f / 255.0f, texels.data() );
+
+                PNMImage img = MakeLinear16Image( lm.width, lm.height );
+                for ( int y = 0; y < lm.height; y++ )
+                {
+                        for ( int x = 0; x < lm.width; x++ )
+                        {
+                                const unsigned short *texel = &texels[( (size_t)y * lm.width + x ) * 3];
+                                img.set_xel_val( x, y, texel[2], texel[1], texel[0] );
+                        }
+                }
+                CopyToPalette( img, lm, copied );
+        }
+
+        int copy_mismatches = 0;
+        for ( int y = 0; y < palette_height; y++ )
+        {
+                const unsigned short *row = &ram_image[(size_t)( palette_height - 1 - y ) * g_palette_width * 3];
+                for ( int x = 0; x < g_palette_width; x++ )
+                {
+                        const unsigned short *texel = row + x * 3;
+                        if ( texel[0] != copied.get_blue_val( x, y ) ||
+                             texel[1] != copied.get_green_val( x, y ) ||
+                             texel[2] != copied.get_red_val( x, y ) )
+                        {
+                                copy_mismatches++;
+                        }
+                }
+        }
+        Log( "    copy: %d texels differ\n", copy_mismatches );
+}
+
+// =====================================================================================
+//  Probe lookups
+// =====================================================================================
+
+// xorshift, so the same seed gives the same probes on every platform
+static unsigned int NextRandom()
+{
+        g_seed ^= g_seed << 13;
+        g_seed ^= g_seed >> 17;
+        g_seed ^= g_seed << 5;
+        return g_seed;
+}
+
+static float RandomFloat( float lo, float hi )
+{
+        return lo + ( hi - lo ) * ( NextRandom() & 0xffffff ) / (float)0xffffff;
+}
+
+// Picks a point somewhere in one of the empty leafs of the world, which is
+// where the compiler puts ambient probes and where lit models stand.
+static LPoint3 RandomLeafPoint( const bspdata_t *data, const pvector<int> &leafs )
+{
+        const dleaf_t *leaf = &data->dleafs[leafs[NextRandom() % leafs.size()]];
+        return LPoint3( RandomFloat( leaf->mins[0], leaf->maxs[0] ),
+                        RandomFloat( leaf->mins[1], leaf->maxs[1] ),
+                        RandomFloat( leaf->mins[2], leaf->maxs[2] ) );
+}
+
+static float DistanceSq( const LPoint3 &a, const LPoint3 &b )
+{
+        return ( a - b ).length_squared();
+}
+
+// Returns true if index is not one of the points closest to pos.  Points
+// at the same distance are all right.
+static bool IsWrongNearest( const pvector<LPoint3> &probes, const LPoint3 &pos, int index, float best_dist_sq )
+{
+        if ( index < 0 || index >= (int)probes.size() )
+        {
+                return true;
+        }
+        return DistanceSq( probes[index], pos ) > best_dist_sq * 1.0001f + 0.0001f;
+}
+
+// FlatKDTree::find_nearest() against the KDTree it replaced, which took a
+// std::vector<double> per query.  Both are checked against a linear search
+// of every probe.
+static void BenchProbeLookups( bspdata_t *data )
+{
+        pvector<int> leafs;
+        for ( int i = 1; i <= data->dmodels[0].visleafs && i < data->numleafs; i++ )
+        {
+                if ( data->dleafs[i].contents != CONTENTS_SOLID )
+                {
+                        leafs.push_back( i );
+                }
+        }
+        if ( leafs.empty() )
+        {
+                Log( "\nThe level has no empty leafs to put probes in\n" );
+                return;
+        }
+
+        pvector<LPoint3> probes( g_numprobes );
+        for ( int i = 0; i < g_numprobes; i++ )
+        {
+                probes[i] = RandomLeafPoint( data, leafs );
+        }
+        pvector<LPoint3> queries( g_numqueries );
+        for ( int i = 0; i < g_numqueries; i++ )
+        {
+                queries[i] = RandomLeafPoint( data, leafs );
+        }
+
+        Log( "\nProbe lookups, %d probes, %d queries:\n", g_numprobes, g_numqueries );
+
+        double num_queries = (double)g_numqueries * g_passes;
+
+        double start = I_FloatTime();
+        PT( FlatKDTree ) flat_tree = new FlatKDTree;
+        flat_tree->build( probes );
+        double build_seconds = I_FloatTime() - start;
+
+        pvector<int> flat_results( g_numqueries );
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( int i = 0; i < g_numqueries; i++ )
+                {
+                        flat_results[i] = flat_tree->find_nearest( queries[i] );
+                }
+        }
+        double seconds = I_FloatTime() - start;
+        Log( "    %-36s build %8.3f s  %8.3f Mqueries/s\n", "FlatKDTree", build_seconds,
+             num_queries / seconds / 1000000.0 );
+
+        std::vector<std::vector<double>> points( g_numprobes );
+        for ( int i = 0; i < g_numprobes; i++ )
+        {
+                points[i] = { probes[i][0], probes[i][1], probes[i][2] };
+        }
+
+        start = I_FloatTime();
+        PT( KDTree ) tree = new KDTree( 3 );
+        tree->build( points );
+        build_seconds = I_FloatTime() - start;
+
+        pvector<int> results( g_numqueries );
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( int i = 0; i < g_numqueries; i++ )
+                {
+                        std::vector<double> pos = { queries[i][0], queries[i][1], queries[i][2] };
+                        results[i] = (int)tree->query( pos ).first;
+                }
+        }
+        seconds = I_FloatTime() - start;
+        Log( "    %-36s build %8.3f s  %8.3f Mqueries/s\n", "KDTree", build_seconds,
+             num_queries / seconds / 1000000.0 );
+
+        int flat_mismatches = 0;
+        int mismatches = 0;
+        for ( int i = 0; i < g_numqueries; i++ )
+        {
+                float best_dist_sq = FLT_MAX;
+                for ( int j = 0; j < g_numprobes; j++ )
+                {
+                        best_dist_sq = std::min( best_dist_sq, DistanceSq( probes[j], queries[i] ) );
+                }
+
+                if ( IsWrongNearest( probes, queries[i], flat_results[i], best_dist_sq ) )
+                {
+                        flat_mismatches++;
+                }
+                if ( IsWrongNearest( probes, queries[i], results[i], best_dist_sq ) )
+                {
+                        mismatches++;
+                }
+        }
+        Log( "    not the nearest probe: FlatKDTree %d, KDTree %d\n", flat_mismatches, mismatches );
+}
+
+// =====================================================================================
+//  Usage
+// =====================================================================================
+static void Usage()
+{
+        Log( "\n-= %s Options =-\n\n", g_Program );
+        Log( "    -passes #       : number of times each test is run (default %d)\n", g_passes );
+        Log( "    -palette #      : width of the lightmap palette (default %d)\n", g_palette_width );
+        Log( "    -probes #       : number of random probes to look up (default %d)\n", g_numprobes );
+        Log( "    -queries #      : number of random probe lookups (default %d)\n", g_numqueries );
+        Log( "    -seed #         : seed of the random probes (default %u)\n\n", g_seed );
+        Log( "    bspfile         : the compiled level to take the lighting from\n\n" );
+
+        exit( 1 );
+}
+
+// =====================================================================================
+//  main
+// =====================================================================================
+int main( const int argc, char **argv )
+{
+        g_Program = "p3lightbench";
+        g_log = false;
+
+        const char *bspfile = nullptr;
+
+        for ( int i = 1; i < argc; i++ )
+        {
+                if ( !strcasecmp( argv[i], "-passes" ) && i + 1 < argc )
+                {
+                        g_passes = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-palette" ) && i + 1 < argc )
+                {
+                        g_palette_width = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-probes" ) && i + 1 < argc )
+                {
+                        g_numprobes = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-queries" ) && i + 1 < argc )
+                {
+                        g_numqueries = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-seed" ) && i + 1 < argc )
+                {
+                        g_seed = std::max( atoi( argv[++i] ), 1 );
+                }
+                else if ( argv[i][0] == '-' )
+                {
+                        Log( "Unknown option \"%s\"\n", argv[i] );
+                        Usage();
+                }
+                else
+                {
+                        bspfile = argv[i];
+                }
+        }
+
+        if ( !bspfile || g_passes < 1 || g_palette_width < 1 || g_numprobes < 1 || g_numqueries < 1 )
+        {
+                Usage();
+        }
+
+        bspdata_t *data = LoadBSPFile( bspfile );
+
+        Log( "%s: %d passes\n", bspfile, g_passes );
+
+        BenchLightmapTexels( data );
+        BenchProbeLookups( data );
+
+        delete data;
+
+        return 0;
+}
@@ -2206,7 +2206,7 @@ void PrecompLightmapOffsets()
 
 void ReduceLightmap()
 {
-        pvector<colorrgbexp32_t> oldlightdata = g_bspdata->lightdata;
+        lumpdata_t<colorrgbexp32_t> oldlightdata = g_bspdata->lightdata;
         g_bspdata->lightdata.clear();
 
         int facenum;
@@ -56,6 +56,7 @@ A simple summary of RAD goes as follows:
 #include "lights.h"
 #include "vismat.h"
 #include "trace.h"
+#include "lightmap_palettes.h"
 //#include "clhelper.h"
 #include <virtualFileSystem.h>
 #include <simpleHashMap.h>
@@ -2747,6 +2748,16 @@ int             main( const int argc, char** argv )
 
                         RadWorld();
 
+                        // Pack the lightmaps into the pages the game uploads as they are,
+                        // so it doesn't have to do it every time the level is loaded.
+                        {
+                                LightmapPalettizer lmp( g_bspdata );
+                                if ( !lmp.write_lightmap_pages( lmp.pack_lightmaps() ) )
+                                {
+                                        Warning( "Couldn't write lightmap pages, the game will pack the lightmaps at load time." );
+                                }
+                        }
+
                         if ( g_chart )
                                 PrintBSPFileSizes( g_bspdata );
 
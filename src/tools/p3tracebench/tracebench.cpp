@@ -0,0 +1,1013 @@
+/**
+ * PANDA3D BSP TOOLS
+ * Copyright (c) CIO Team. All rights reserved.
+ *
+ * @file tracebench.cpp
+ *
+ * @desc Times the traces of libpandabsp against a compiled level with a fixed
+ *       set of rays, and checks that the fast paths give the same results as
+ *       the ones they replace.
+ */
+
+#include "cmdlib.h"
+#include "log.h"
+#include "bspfile.h"
+#include "bsptools.h"
+#include "bsp_trace.h"
+#include "bsploader.h"
+
+#include <boundingBox.h>
+#include <vector_uchar.h>
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <cfloat>
+
+// A line to trace, in BSP units.
+struct benchray_t
+{
+        LPoint3 start;
+        LPoint3 end;
+};
+
+static pvector<benchray_t> g_rays;
+static int g_passes = 10;
+static int g_numrays = 100000;
+static unsigned int g_seed = 1;
+static float g_extents = 16.0f;
+
+// =====================================================================================
+//  Ray sets
+// =====================================================================================
+
+// xorshift, so the same seed gives the same rays on every platform
+static unsigned int NextRandom()
+{
+        g_seed ^= g_seed << 13;
+        g_seed ^= g_seed >> 17;
+        g_seed ^= g_seed << 5;
+        return g_seed;
+}
+
+static float RandomFloat( float lo, float hi )
+{
+        return lo + ( hi - lo ) * ( NextRandom() & 0xffffff ) / (float)0xffffff;
+}
+
+// Picks a point somewhere in one of the empty leafs of the world.
+static LPoint3 RandomLeafPoint( const bspdata_t *data, const pvector<int> &leafs )
+{
+        const dleaf_t *leaf = &data->dleafs[leafs[NextRandom() % leafs.size()]];
+        return LPoint3( RandomFloat( leaf->mins[0], leaf->maxs[0] ),
+                        RandomFloat( leaf->mins[1], leaf->maxs[1] ),
+                        RandomFloat( leaf->mins[2], leaf->maxs[2] ) );
+}
+
+// Makes lines between random points in the empty leafs of the world, the
+// kind of lines that line-of-sight and lighting traces are.
+static void MakeRays( const bspdata_t *data )
+{
+        pvector<int> leafs;
+        for ( int i = 1; i <= data->dmodels[0].visleafs && i < data->numleafs; i++ )
+        {
+                if ( data->dleafs[i].contents != CONTENTS_SOLID )
+                {
+                        leafs.push_back( i );
+                }
+        }
+        if ( leafs.empty() )
+        {
+                Error( "The level has no empty leafs to trace between\n" );
+        }
+
+        g_rays.resize( g_numrays );
+        for ( int i = 0; i < g_numrays; i++ )
+        {
+                g_rays[i].start = RandomLeafPoint( data, leafs );
+                g_rays[i].end = RandomLeafPoint( data, leafs );
+        }
+}
+
+// Reads a ray set written by WriteRays(), one line per ray:
+// start x y z end x y z
+static void ReadRays( const char *filename )
+{
+        FILE *fp = fopen( filename, "r" );
+        if ( !fp )
+        {
+                Error( "Could not open ray file %s\n", filename );
+        }
+
+        benchray_t ray;
+        while ( fscanf( fp, "%f %f %f %f %f %f",
+                        &ray.start[0], &ray.start[1], &ray.start[2],
+                        &ray.end[0], &ray.end[1], &ray.end[2] ) == 6 )
+        {
+                g_rays.push_back( ray );
+        }
+        fclose( fp );
+
+        if ( g_rays.empty() )
+        {
+                Error( "No rays in %s\n", filename );
+        }
+}
+
+static void WriteRays( const char *filename )
+{
+        FILE *fp = fopen( filename, "w" );
+        if ( !fp )
+        {
+                Error( "Could not write ray file %s\n", filename );
+        }
+
+        for ( size_t i = 0; i < g_rays.size(); i++ )
+        {
+                const benchray_t &ray = g_rays[i];
+                fprintf( fp, "%f %f %f %f %f %f\n",
+                         ray.start[0], ray.start[1], ray.start[2],
+                         ray.end[0], ray.end[1], ray.end[2] );
+        }
+        fclose( fp );
+}
+
+static void LogTime( const char *name, double seconds )
+{
+        double num_rays = (double)g_rays.size() * g_passes;
+        Log( "    %-36s %8.3f s  %8.3f Mrays/s\n", name, seconds, num_rays / seconds / 1000000.0 );
+}
+
+static bool SameTrace( const Trace &a, const Trace &b )
+{
+        return a.has_hit() == b.has_hit() &&
+                std::fabs( a.fraction - b.fraction ) < 0.0001f &&
+                a.start_solid == b.start_solid &&
+                a.all_solid == b.all_solid;
+}
+
+// =====================================================================================
+//  CM_BoxTrace
+// =====================================================================================
+
+// Point rays one at a time against the same rays four at a time.
+static void BenchBoxTrace4( const collbspdata_t *cdata )
+{
+        size_t num_rays = g_rays.size();
+        pvector<Ray> rays( num_rays );
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                rays[i] = Ray( g_rays[i].start, g_rays[i].end, LPoint3::zero(), LPoint3::zero() );
+        }
+
+        pvector<Trace> scalar( num_rays );
+        pvector<Trace> packet( num_rays );
+        static const int masks[4] = { CONTENTS_SOLID, CONTENTS_SOLID, CONTENTS_SOLID, CONTENTS_SOLID };
+
+        Log( "\nCM_BoxTrace vs CM_BoxTrace4, point rays:\n" );
+
+        double start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < num_rays; i++ )
+                {
+                        scalar[i] = Trace();
+                        CM_BoxTrace( rays[i], 0, CONTENTS_SOLID, false, cdata, scalar[i] );
+                }
+        }
+        LogTime( "CM_BoxTrace", I_FloatTime() - start );
+
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < num_rays; i += 4 )
+                {
+                        int count = (int)std::min( num_rays - i, (size_t)4 );
+                        CM_BoxTrace4( &rays[i], count, 0, masks, cdata, &packet[i] );
+                }
+        }
+        LogTime( "CM_BoxTrace4", I_FloatTime() - start );
+
+        int mismatches = 0;
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                if ( !SameTrace( scalar[i], packet[i] ) )
+                {
+                        mismatches++;
+                }
+        }
+        Log( "    %d of %d results differ\n", mismatches, (int)num_rays );
+}
+
+// =====================================================================================
+//  Reference brush clipping
+//
+//  CM_BoxTrace the way it was before the side groups and brush checks: every
+//  brush is clipped one side at a time, box brushes included, and again in
+//  every leaf it shows up in along the trace.
+// =====================================================================================
+
+#define REF_NEVER_UPDATED -99999
+
+static void RefClipBoxToBrush( Trace *trace, const dbrush_t *brush )
+{
+        if ( !brush->numsides )
+        {
+                return;
+        }
+
+        const bspdata_t *data = trace->bspdata->bspdata;
+        const LVector3 &p1 = trace->start_pos;
+        const LVector3 &p2 = trace->end_pos;
+
+        float enter_frac = REF_NEVER_UPDATED;
+        float leave_frac = 1.0f;
+        bool getout = false;
+        bool startout = false;
+        const dbrushside_t *leadside = nullptr;
+
+        for ( int i = 0; i < brush->numsides; i++ )
+        {
+                const dbrushside_t *side = &data->dbrushsides[brush->firstside + i];
+                const dplane_t *plane = &data->dplanes[side->planenum];
+                LVector3 plane_normal( plane->normal[0], plane->normal[1], plane->normal[2] );
+
+                float dist;
+                if ( !trace->is_point )
+                {
+                        // push the plane out appropriately for mins/maxs
+                        dist = plane->dist + DotProductAbs( plane_normal, trace->extents );
+                }
+                else
+                {
+                        // don't trace rays against bevel planes
+                        if ( side->bevel )
+                        {
+                                continue;
+                        }
+                        dist = plane->dist;
+                }
+
+                float d1 = p1.dot( plane_normal ) - dist;
+                float d2 = p2.dot( plane_normal ) - dist;
+
+                // if completely in front of face, no intersection
+                if ( d1 > 0.0f && d2 > 0.0f )
+                {
+                        return;
+                }
+
+                if ( d1 > 0.0f )
+                {
+                        startout = true;
+                }
+                else
+                {
+                        if ( d2 <= 0.0f )
+                        {
+                                continue;
+                        }
+                        getout = true;
+                }
+
+                if ( d1 > d2 )
+                {
+                        // enter
+                        float f = std::max( d1 - (float)DIST_EPSILON, 0.0f ) / ( d1 - d2 );
+                        if ( f > enter_frac )
+                        {
+                                enter_frac = f;
+                                leadside = side;
+                        }
+                }
+                else
+                {
+                        // leave
+                        float f = ( d1 + DIST_EPSILON ) / ( d1 - d2 );
+                        if ( f < leave_frac )
+                        {
+                                leave_frac = f;
+                        }
+                }
+        }
+
+        if ( trace->is_point && startout && ( trace->fraction_left_solid - enter_frac ) > 0.0f )
+        {
+                startout = false;
+        }
+
+        if ( !startout )
+        {
+                // original point was inside brush
+                trace->start_solid = true;
+                trace->hit_contents = brush->contents;
+
+                if ( !getout )
+                {
+                        trace->all_solid = true;
+                        trace->fraction = 0.0f;
+                        trace->fraction_left_solid = 1.0f;
+                }
+                else if ( leave_frac != 1 && leave_frac > trace->fraction_left_solid )
+                {
+                        trace->fraction_left_solid = leave_frac;
+                        if ( trace->fraction <= leave_frac )
+                        {
+                                trace->fraction = 1.0f;
+                                trace->surface = nullptr;
+                        }
+                }
+                return;
+        }
+
+        if ( enter_frac < leave_frac && enter_frac > REF_NEVER_UPDATED && enter_frac < trace->fraction )
+        {
+                trace->fraction = std::max( enter_frac, 0.0f );
+                trace->plane = data->dplanes[leadside->planenum];
+                trace->surface = (texinfo_t *)&data->texinfo[leadside->texinfo];
+                trace->hit_contents = brush->contents;
+        }
+}
+
+static void RefTraceToLeaf( Trace *trace, int leaf_idx )
+{
+        const bspdata_t *data = trace->bspdata->bspdata;
+        const dleaf_t *leaf = &data->dleafs[leaf_idx];
+
+        for ( int i = 0; i < leaf->numleafbrushes; i++ )
+        {
+                const dbrush_t *brush = &data->dbrushes[data->dleafbrushes[leaf->firstleafbrush + i]];
+                if ( !( brush->contents & trace->contents ) )
+                {
+                        continue;
+                }
+
+                RefClipBoxToBrush( trace, brush );
+                if ( !trace->fraction )
+                {
+                        return;
+                }
+        }
+}
+
+static void RefRecursiveHullCheck( Trace *trace, int num, float p1f, float p2f,
+                                   const LVector3 &p1, const LVector3 &p2 )
+{
+        if ( trace->fraction <= p1f )
+        {
+                // already hit something nearer
+                return;
+        }
+
+        const bspdata_t *data = trace->bspdata->bspdata;
+        const dnode_t *node = nullptr;
+        float t1 = 0, t2 = 0;
+        double offset = 0;
+
+        while ( num >= 0 )
+        {
+                node = &data->dnodes[num];
+                const dplane_t *plane = &data->dplanes[node->planenum];
+                if ( plane->type < 3 )
+                {
+                        t1 = p1[plane->type] - plane->dist;
+                        t2 = p2[plane->type] - plane->dist;
+                        offset = trace->extents[plane->type];
+                }
+                else
+                {
+                        t1 = DotProduct( plane->normal, p1 ) - plane->dist;
+                        t2 = DotProduct( plane->normal, p2 ) - plane->dist;
+                        offset = trace->is_point ? 0.0 : DotProductAbsD( trace->extents, plane->normal );
+                }
+
+                if ( t1 > offset && t2 > offset )
+                {
+                        num = node->children[0];
+                }
+                else if ( t1 < -offset && t2 < -offset )
+                {
+                        num = node->children[1];
+                }
+                else
+                {
+                        break;
+                }
+        }
+
+        if ( num < 0 )
+        {
+                RefTraceToLeaf( trace, ~num );
+                return;
+        }
+
+        // put the crosspoint DIST_EPSILON pixels on the near side
+        int side;
+        float frac, frac2;
+        if ( t1 < t2 )
+        {
+                float idist = 1.0 / ( t1 - t2 );
+                side = 1;
+                frac2 = ( t1 + offset + DIST_EPSILON ) * idist;
+                frac = ( t1 - offset - DIST_EPSILON ) * idist;
+        }
+        else if ( t1 > t2 )
+        {
+                float idist = 1.0 / ( t1 - t2 );
+                side = 0;
+                frac2 = ( t1 - offset - DIST_EPSILON ) * idist;
+                frac = ( t1 + offset + DIST_EPSILON ) * idist;
+        }
+        else
+        {
+                side = 0;
+                frac = 1;
+                frac2 = 0;
+        }
+
+        LVector3 mid;
+
+        frac = std::min( std::max( frac, 0.0f ), 1.0f );
+        VectorLerp( p1, p2, frac, mid );
+        RefRecursiveHullCheck( trace, node->children[side], p1f, p1f + ( p2f - p1f ) * frac, p1, mid );
+
+        frac2 = std::min( std::max( frac2, 0.0f ), 1.0f );
+        VectorLerp( p1, p2, frac2, mid );
+        RefRecursiveHullCheck( trace, node->children[side ^ 1], p1f + ( p2f - p1f ) * frac2, p2f, mid, p2 );
+}
+
+static void RefBoxTrace( const Ray &ray, int headnode, int brushmask, const collbspdata_t *cdata, Trace &trace )
+{
+        trace.contents = brushmask;
+        trace.start_pos = ray.start;
+        trace.end_pos = ray.start + ray.delta;
+        trace.extents = ray.extents;
+        trace.delta = ray.delta;
+        trace.inv_delta = ray.inv_delta();
+        trace.mins = -ray.extents;
+        trace.maxs = ray.extents;
+        trace.is_point = ray.is_ray;
+        trace.bspdata = (collbspdata_t *)cdata;
+
+        RefRecursiveHullCheck( &trace, headnode, 0, 1, trace.start_pos, trace.end_pos );
+}
+
+// The brush clipping CM_BoxTrace does now against the reference above, for
+// point rays and for boxes swept along the same rays.
+static void BenchBrushClipping( const collbspdata_t *cdata )
+{
+        size_t num_rays = g_rays.size();
+        pvector<Trace> fast( num_rays );
+        pvector<Trace> scalar( num_rays );
+        pvector<Ray> rays( num_rays );
+
+        for ( int i = 0; i < 2; i++ )
+        {
+                bool box = i == 1;
+                LPoint3 mins = box ? LPoint3( -g_extents ) : LPoint3::zero();
+                LPoint3 maxs = box ? LPoint3( g_extents ) : LPoint3::zero();
+                for ( size_t j = 0; j < num_rays; j++ )
+                {
+                        rays[j] = Ray( g_rays[j].start, g_rays[j].end, mins, maxs );
+                }
+
+                if ( box )
+                {
+                        Log( "\nCM_ClipBoxToBrush, %g unit boxes:\n", g_extents * 2 );
+                }
+                else
+                {
+                        Log( "\nCM_ClipBoxToBrush, point rays:\n" );
+                }
+
+                double start = I_FloatTime();
+                for ( int pass = 0; pass < g_passes; pass++ )
+                {
+                        for ( size_t j = 0; j < num_rays; j++ )
+                        {
+                                fast[j] = Trace();
+                                CM_BoxTrace( rays[j], 0, CONTENTS_SOLID, false, cdata, fast[j] );
+                        }
+                }
+                LogTime( "side groups, brush checks", I_FloatTime() - start );
+
+                start = I_FloatTime();
+                for ( int pass = 0; pass < g_passes; pass++ )
+                {
+                        for ( size_t j = 0; j < num_rays; j++ )
+                        {
+                                scalar[j] = Trace();
+                                RefBoxTrace( rays[j], 0, CONTENTS_SOLID, cdata, scalar[j] );
+                        }
+                }
+                LogTime( "one side at a time", I_FloatTime() - start );
+
+                int mismatches = 0;
+                for ( size_t j = 0; j < num_rays; j++ )
+                {
+                        if ( !SameTrace( fast[j], scalar[j] ) )
+                        {
+                                mismatches++;
+                        }
+                }
+                Log( "    %d of %d results differ\n", mismatches, (int)num_rays );
+        }
+}
+
+// =====================================================================================
+//  PVS bounds
+// =====================================================================================
+
+// The leafs visible from one leaf, laid out the way update_leaf() does it.
+struct benchvis_t
+{
+        pvector<PT( BoundingBox )> boxes;
+        vector_int leaf_flags;
+        pvector<float> mins[3];
+        pvector<float> maxs[3];
+};
+
+static void AddVisibleLeaf( const bspdata_t *data, benchvis_t &vis, int leafnum )
+{
+        const dleaf_t *leaf = &data->dleafs[leafnum];
+        LPoint3 mins( leaf->mins[0], leaf->mins[1], leaf->mins[2] );
+        LPoint3 maxs( leaf->maxs[0], leaf->maxs[1], leaf->maxs[2] );
+        vis.boxes.push_back( new BoundingBox( mins, maxs ) );
+        vis.leaf_flags.push_back( leaf->flags );
+        for ( int i = 0; i < 3; i++ )
+        {
+                vis.mins[i].push_back( mins[i] );
+                vis.maxs[i].push_back( maxs[i] );
+        }
+}
+
+// Makes the visible sets of up to max_sets leafs spread across the level.
+static void MakeVisibleSets( bspdata_t *data, int max_sets, pvector<benchvis_t> &sets )
+{
+        int visleafs = std::min( data->dmodels[0].visleafs, data->numleafs - 1 );
+        int pvs_row = ( visleafs + 7 ) / 8;
+        pvector<byte> pvs( pvs_row + 1 );
+        int step = std::max( visleafs / max_sets, 1 );
+
+        for ( int leafnum = 1; leafnum <= visleafs && (int)sets.size() < max_sets; leafnum += step )
+        {
+                const dleaf_t *leaf = &data->dleafs[leafnum];
+                bool has_pvs = leaf->visofs != -1;
+                if ( has_pvs )
+                {
+                        memset( &pvs[0], 0, pvs.size() );
+                        DecompressVis( data, &data->dvisdata[leaf->visofs], &pvs[0], pvs_row );
+                }
+
+                sets.push_back( benchvis_t() );
+                benchvis_t &vis = sets.back();
+                AddVisibleLeaf( data, vis, leafnum );
+                for ( int other = 1; other <= visleafs; other++ )
+                {
+                        if ( other != leafnum &&
+                             ( !has_pvs || ( pvs[( other - 1 ) >> 3] & ( 1 << ( ( other - 1 ) & 7 ) ) ) ) )
+                        {
+                                AddVisibleLeaf( data, vis, other );
+                        }
+                }
+
+                // Pad with inside-out boxes that can't intersect anything.
+                while ( vis.leaf_flags.size() & 3 )
+                {
+                        for ( int i = 0; i < 3; i++ )
+                        {
+                                vis.mins[i].push_back( FLT_MAX );
+                                vis.maxs[i].push_back( -FLT_MAX );
+                        }
+                        vis.leaf_flags.push_back( 0 );
+                }
+        }
+}
+
+// What pvs_bounds_test() did before, one virtual contains() per leaf.
+static bool ContainsTest( const benchvis_t &vis, const BoundingBox *bounds, unsigned int required_leaf_flags )
+{
+        for ( size_t i = 0; i < vis.boxes.size(); i++ )
+        {
+                if ( required_leaf_flags != 0 && ( vis.leaf_flags[i] & required_leaf_flags ) == 0 )
+                {
+                        continue;
+                }
+                if ( vis.boxes[i]->contains( bounds ) != BoundingVolume::IF_no_intersection )
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+// Boxes around the start of each ray against the visible leafs of a handful
+// of leafs, four leafs at a time against one contains() per leaf.
+static void BenchPVSBounds( bspdata_t *data )
+{
+        pvector<benchvis_t> sets;
+        MakeVisibleSets( data, 16, sets );
+        if ( sets.empty() )
+        {
+                return;
+        }
+
+        size_t num_boxes = g_rays.size();
+        pvector<PT( BoundingBox )> boxes( num_boxes );
+        for ( size_t i = 0; i < num_boxes; i++ )
+        {
+                boxes[i] = new BoundingBox( g_rays[i].start - LVector3( g_extents ),
+                                            g_rays[i].start + LVector3( g_extents ) );
+        }
+
+        size_t num_tests = sets.size() * num_boxes;
+        vector_uchar simd_results( num_tests );
+        vector_uchar contains_results( num_tests );
+
+        static const unsigned int required_flags[2] = { 0u, LEAF_FLAGS_SKY };
+        for ( int f = 0; f < 2; f++ )
+        {
+                unsigned int required = required_flags[f];
+                Log( "\npvs_bounds_test, %d leaf sets, required flags %u:\n", (int)sets.size(), required );
+
+                double start = I_FloatTime();
+                for ( int pass = 0; pass < g_passes; pass++ )
+                {
+                        for ( size_t s = 0; s < sets.size(); s++ )
+                        {
+                                const benchvis_t &vis = sets[s];
+                                const float *mins[3] = { vis.mins[0].data(), vis.mins[1].data(), vis.mins[2].data() };
+                                const float *maxs[3] = { vis.maxs[0].data(), vis.maxs[1].data(), vis.maxs[2].data() };
+                                for ( size_t i = 0; i < num_boxes; i++ )
+                                {
+                                        simd_results[s * num_boxes + i] = pvs_leaf_boxes_test(
+                                                mins, maxs, vis.leaf_flags.data(), vis.leaf_flags.size(),
+                                                boxes[i]->get_minq(), boxes[i]->get_maxq(), required );
+                                }
+                        }
+                }
+                double seconds = I_FloatTime() - start;
+                Log( "    %-36s %8.3f s  %8.3f Mtests/s\n", "four leafs at a time", seconds,
+                     (double)num_tests * g_passes / seconds / 1000000.0 );
+
+                start = I_FloatTime();
+                for ( int pass = 0; pass < g_passes; pass++ )
+                {
+                        for ( size_t s = 0; s < sets.size(); s++ )
+                        {
+                                for ( size_t i = 0; i < num_boxes; i++ )
+                                {
+                                        contains_results[s * num_boxes + i] = ContainsTest( sets[s], boxes[i], required );
+                                }
+                        }
+                }
+                seconds = I_FloatTime() - start;
+                Log( "    %-36s %8.3f s  %8.3f Mtests/s\n", "contains() per leaf", seconds,
+                     (double)num_tests * g_passes / seconds / 1000000.0 );
+
+                int mismatches = 0;
+                for ( size_t i = 0; i < num_tests; i++ )
+                {
+                        if ( simd_results[i] != contains_results[i] )
+                        {
+                                mismatches++;
+                        }
+                }
+                Log( "    %d of %d results differ\n", mismatches, (int)num_tests );
+        }
+}
+
+// =====================================================================================
+//  Embree
+// =====================================================================================
+
+// Adds the faces of the world to the scene, either as one triangle mesh the
+// way BSPTrace does it now, or as one mesh per face the way it used to.
+static void AddWorldMeshes( const bspdata_t *data, RayTraceScene *scene, bool per_face,
+                            pvector<PT( RayTraceTriangleMesh )> &meshes )
+{
+        const dmodel_t *model = &data->dmodels[0];
+        RayTraceTriangleMesh *geom = nullptr;
+        for ( int facenum = 0; facenum < model->numfaces; facenum++ )
+        {
+                const dface_t *face = &data->dfaces[model->firstface + facenum];
+                if ( face->numedges < 3 )
+                {
+                        continue;
+                }
+
+                if ( geom == nullptr || per_face )
+                {
+                        geom = new RayTraceTriangleMesh;
+                        geom->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
+                        geom->set_mask( TRACETYPE_WORLD );
+                        meshes.push_back( geom );
+                }
+
+                int ntris = face->numedges - 2;
+                for ( int tri = 0; tri < ntris; tri++ )
+                {
+                        geom->add_triangle( VertCoord( data, face, 0 ),
+                                            VertCoord( data, face, ( tri + 1 ) % face->numedges ),
+                                            VertCoord( data, face, ( tri + 2 ) % face->numedges ) );
+                }
+        }
+
+        for ( size_t i = 0; i < meshes.size(); i++ )
+        {
+                meshes[i]->build();
+                scene->add_geometry( meshes[i] );
+        }
+        scene->update();
+}
+
+static void TraceScene( RayTraceScene *scene, pvector<RayTraceHitResult> &results )
+{
+        BitMask32 mask( TRACETYPE_WORLD );
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < g_rays.size(); i++ )
+                {
+                        results[i] = scene->trace_line( g_rays[i].start, g_rays[i].end, mask );
+                }
+        }
+}
+
+static bool SameHit( const RayTraceHitResult &a, const RayTraceHitResult &b )
+{
+        return a.hit == b.hit &&
+                ( !a.hit || std::fabs( a.hit_fraction - b.hit_fraction ) < 0.0001f );
+}
+
+// The world as one mesh against the world as one mesh per face.
+static void BenchEmbreeMeshes( const bspdata_t *data )
+{
+        size_t num_rays = g_rays.size();
+        pvector<RayTraceHitResult> per_model( num_rays );
+        pvector<RayTraceHitResult> per_face( num_rays );
+
+        Log( "\nEmbree world as one mesh vs one mesh per face:\n" );
+
+        for ( int i = 0; i < 2; i++ )
+        {
+                bool faces = i == 1;
+                const char *name = faces ? "one mesh per face" : "one mesh";
+
+                PT( RayTraceScene ) scene = new RayTraceScene;
+                scene->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
+                pvector<PT( RayTraceTriangleMesh )> meshes;
+
+                double start = I_FloatTime();
+                AddWorldMeshes( data, scene, faces, meshes );
+                Log( "    %-36s %8.3f s  build, %d meshes\n", name, I_FloatTime() - start, (int)meshes.size() );
+
+                start = I_FloatTime();
+                TraceScene( scene, faces ? per_face : per_model );
+                LogTime( name, I_FloatTime() - start );
+
+                scene->remove_all();
+        }
+
+        int mismatches = 0;
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                if ( !SameHit( per_model[i], per_face[i] ) )
+                {
+                        mismatches++;
+                }
+        }
+        Log( "    %d of %d results differ\n", mismatches, (int)num_rays );
+}
+
+// The same lines one at a time against a stream of all of them at once, for
+// both closest hits and occlusion.
+static void BenchEmbreeStreams( const bspdata_t *data )
+{
+        size_t num_rays = g_rays.size();
+        pvector<LPoint3> starts( num_rays );
+        pvector<LPoint3> ends( num_rays );
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                starts[i] = g_rays[i].start;
+                ends[i] = g_rays[i].end;
+        }
+
+        PT( RayTraceScene ) scene = new RayTraceScene;
+        scene->set_build_quality( RayTraceScene::BUILD_QUALITY_HIGH );
+        pvector<PT( RayTraceTriangleMesh )> meshes;
+        AddWorldMeshes( data, scene, false, meshes );
+
+        BitMask32 mask( TRACETYPE_WORLD );
+
+        Log( "\ntrace_line vs trace_lines:\n" );
+
+        pvector<RayTraceHitResult> single( num_rays );
+        double start = I_FloatTime();
+        TraceScene( scene, single );
+        LogTime( "trace_line", I_FloatTime() - start );
+
+        pvector<RayTraceHitResult> stream( num_rays );
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                scene->trace_lines( &starts[0], &ends[0], (int)num_rays, TRACETYPE_WORLD, &stream[0] );
+        }
+        LogTime( "trace_lines", I_FloatTime() - start );
+
+        int mismatches = 0;
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                if ( !SameHit( single[i], stream[i] ) )
+                {
+                        mismatches++;
+                }
+        }
+        Log( "    %d of %d results differ\n", mismatches, (int)num_rays );
+
+        Log( "\ntest_line_occluded vs test_lines_occluded and test_four_rays_occluded:\n" );
+
+        // pvector<bool> is a bitset, test_lines_occluded() wants real bools.
+        bool *single_occluded = new bool[num_rays];
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < num_rays; i++ )
+                {
+                        single_occluded[i] = scene->test_line_occluded( starts[i], ends[i], mask );
+                }
+        }
+        LogTime( "test_line_occluded", I_FloatTime() - start );
+
+        bool *stream_occluded = new bool[num_rays];
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                scene->test_lines_occluded( &starts[0], &ends[0], (int)num_rays, TRACETYPE_WORLD, stream_occluded );
+        }
+        LogTime( "test_lines_occluded", I_FloatTime() - start );
+
+        // Four lines at a time, the last group padded with its last line.
+        u32x4 mask4;
+        for ( int k = 0; k < 4; k++ )
+        {
+                SubInt( mask4, k ) = TRACETYPE_WORLD;
+        }
+        bool *four_occluded = new bool[num_rays];
+        start = I_FloatTime();
+        for ( int pass = 0; pass < g_passes; pass++ )
+        {
+                for ( size_t i = 0; i < num_rays; i += 4 )
+                {
+                        FourVectors start4;
+                        FourVectors direction4;
+                        fltx4 distance4;
+                        for ( int k = 0; k < 4; k++ )
+                        {
+                                size_t j = std::min( i + k, num_rays - 1 );
+                                LVector3 direction = ends[j] - starts[j];
+                                SubFloat( distance4, k ) = direction.length();
+                                direction.normalize();
+                                start4.X( k ) = starts[j][0];
+                                start4.Y( k ) = starts[j][1];
+                                start4.Z( k ) = starts[j][2];
+                                direction4.X( k ) = direction[0];
+                                direction4.Y( k ) = direction[1];
+                                direction4.Z( k ) = direction[2];
+                        }
+
+                        u32x4 occluded4 = scene->test_four_rays_occluded( start4, direction4, distance4, mask4 );
+                        for ( size_t k = 0; k < 4 && i + k < num_rays; k++ )
+                        {
+                                four_occluded[i + k] = SubInt( occluded4, (int)k ) != 0;
+                        }
+                }
+        }
+        LogTime( "test_four_rays_occluded", I_FloatTime() - start );
+
+        mismatches = 0;
+        int four_mismatches = 0;
+        for ( size_t i = 0; i < num_rays; i++ )
+        {
+                // An occlusion test is a closest hit test that stops early.
+                if ( single_occluded[i] != stream_occluded[i] || single_occluded[i] != single[i].hit )
+                {
+                        mismatches++;
+                }
+                if ( four_occluded[i] != single_occluded[i] )
+                {
+                        four_mismatches++;
+                }
+        }
+        Log( "    %d of %d results differ\n", mismatches, (int)num_rays );
+        Log( "    %d of %d four at a time results differ\n", four_mismatches, (int)num_rays );
+
+        delete[] single_occluded;
+        delete[] stream_occluded;
+        delete[] four_occluded;
+
+        scene->remove_all();
+}
+
+// =====================================================================================
+//  Usage
+// =====================================================================================
+static void Usage()
+{
+        Log( "\n-= %s Options =-\n\n", g_Program );
+        Log( "    -rays file      : trace the rays in file instead of random ones\n" );
+        Log( "    -writerays file : write the rays that are traced to file\n" );
+        Log( "    -numrays #      : number of random rays to make (default %d)\n", g_numrays );
+        Log( "    -seed #         : seed of the random rays (default %u)\n", g_seed );
+        Log( "    -passes #       : number of times each ray set is traced (default %d)\n", g_passes );
+        Log( "    -extents #      : half size of the swept and PVS test boxes (default %g)\n\n", g_extents );
+        Log( "    bspfile         : the compiled level to trace against\n\n" );
+        Log( "A ray file has one ray per line, as start x y z end x y z in BSP units.\n" );
+
+        exit( 1 );
+}
+
+// =====================================================================================
+//  main
+// =====================================================================================
+int main( const int argc, char **argv )
+{
+        g_Program = "p3tracebench";
+        g_log = false;
+
+        const char *bspfile = nullptr;
+        const char *rayfile = nullptr;
+        const char *writefile = nullptr;
+
+        for ( int i = 1; i < argc; i++ )
+        {
+                if ( !strcasecmp( argv[i], "-rays" ) && i + 1 < argc )
+                {
+                        rayfile = argv[++i];
+                }
+                else if ( !strcasecmp( argv[i], "-writerays" ) && i + 1 < argc )
+                {
+                        writefile = argv[++i];
+                }
+                else if ( !strcasecmp( argv[i], "-numrays" ) && i + 1 < argc )
+                {
+                        g_numrays = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-seed" ) && i + 1 < argc )
+                {
+                        g_seed = std::max( atoi( argv[++i] ), 1 );
+                }
+                else if ( !strcasecmp( argv[i], "-passes" ) && i + 1 < argc )
+                {
+                        g_passes = atoi( argv[++i] );
+                }
+                else if ( !strcasecmp( argv[i], "-extents" ) && i + 1 < argc )
+                {
+                        g_extents = atof( argv[++i] );
+                }
+                else if ( argv[i][0] == '-' )
+                {
+                        Log( "Unknown option \"%s\"\n", argv[i] );
+                        Usage();
+                }
+                else
+                {
+                        bspfile = argv[i];
+                }
+        }
+
+        if ( !bspfile || g_numrays < 1 || g_passes < 1 || g_extents <= 0.0f )
+        {
+                Usage();
+        }
+
+        bspdata_t *data = LoadBSPFile( bspfile );
+        if ( rayfile )
+        {
+                ReadRays( rayfile );
+        }
+        else
+        {
+                MakeRays( data );
+        }
+        if ( writefile )
+        {
+                WriteRays( writefile );
+        }
+
+        Log( "%s: %d rays, %d passes\n", bspfile, (int)g_rays.size(), g_passes );
+
+        collbspdata_t *cdata = SetupCollisionBSPData( data );
+        BenchBoxTrace4( cdata );
+        BenchBrushClipping( cdata );
+        BenchPVSBounds( data );
+
+        RayTrace::initialize();
+        BenchEmbreeMeshes( data );
+        BenchEmbreeStreams( data );
+        RayTrace::destruct();
+
+        delete cdata;
+        delete data;
+
+        return 0;
+}